@@ -1,424 +1,8983 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <array>
+#include <cstdint>
 #include <stdexcept>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <cstdlib>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
 #include <ctime>
 #include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <exception>
+#include <optional>
+#include <limits>
+#include <charconv>
+#include <bit>
+#include <condition_variable>
+#include <coroutine>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <climits>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // Using the standard namespace to remove 'std::' prefixes
 using namespace std;
 
-// Utility function to get current date as string
-string getCurrentDate() {
-    time_t now = time(0);
-    tm *ltm = localtime(&now);
-    char buffer[11];
-    sprintf(buffer, "%04d-%02d-%02d", 1900 + ltm->tm_year, 1 + ltm->tm_mon, ltm->tm_mday);
-    return string(buffer);
+const int64_t MICROS_PER_SECOND = 1000000;
+
+// Journal timestamps, in microseconds since the epoch.
+// Reading the system clock on every posting is a vDSO call; instead each thread reads the CPU
+// cycle counter and scales it from an anchor it took on the system clock, re-anchoring every
+// few hundred milliseconds so the two cannot drift apart. A thread's timestamps never go
+// backwards. Without a usable cycle counter it falls back to the system clock.
+class TimestampClock {
+private:
+    static constexpr int64_t ANCHOR_MICROS = 250000;
+
+    static int64_t systemMicros() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    struct Anchor {
+        uint64_t cycles = 0;
+        int64_t micros = 0;
+        uint64_t expires = 0; // cycle count at which to re-anchor
+        double microsPerCycle = 0;
+    };
+
+    // Cycle counter ticks per microsecond, measured once against the steady clock
+    static double cyclesPerMicro() {
+        static const double rate = [] {
+            auto start = chrono::steady_clock::now();
+            uint64_t startCycles = __rdtsc();
+            chrono::steady_clock::duration elapsed;
+            do {
+                elapsed = chrono::steady_clock::now() - start;
+            } while(elapsed < chrono::milliseconds(2));
+            return static_cast<double>(__rdtsc() - startCycles) / chrono::duration<double, micro>(elapsed).count();
+        }();
+        return rate;
+    }
+#endif
+
+public:
+    static int64_t now() {
+        thread_local int64_t last = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        thread_local Anchor anchor;
+        uint64_t cycles = __rdtsc();
+        int64_t micros;
+        if(cycles >= anchor.expires || cycles < anchor.cycles) {
+            double rate = cyclesPerMicro();
+            anchor.cycles = __rdtsc();
+            anchor.micros = systemMicros();
+            anchor.expires = anchor.cycles + static_cast<uint64_t>(rate * ANCHOR_MICROS);
+            anchor.microsPerCycle = 1 / rate;
+            micros = anchor.micros;
+        }
+        else {
+            micros = anchor.micros + static_cast<int64_t>((cycles - anchor.cycles) * anchor.microsPerCycle);
+        }
+#else
+        int64_t micros = systemMicros();
+#endif
+        last = max(last, micros);
+        return last;
+    }
+};
+
+// Format a journal timestamp as an ISO 8601 local date and time, YYYY-MM-DDTHH:MM:SS, into
+// out (at least TIMESTAMP_TEXT_LENGTH chars, not terminated). Each thread caches recent local
+// days, indexed by UTC day, so localtime_r runs about once per day rather than once per
+// transaction even when statements alternate between a period's ends and its transactions.
+const size_t TIMESTAMP_TEXT_LENGTH = 19;
+
+void formatTimestamp(int64_t micros, char* out) {
+    struct Day {
+        int64_t start = 1;       // seconds since the epoch; the cache covers [start, end)
+        int64_t end = 0;
+        int64_t startOfDay = 0;  // local time of day at start, in seconds
+        char date[32];
+    };
+    thread_local Day days[16];
+    int64_t seconds = micros / MICROS_PER_SECOND;
+    Day& day = days[static_cast<uint64_t>(seconds / 86400) % 16];
+    if(seconds < day.start || seconds >= day.end) {
+        time_t when = static_cast<time_t>(seconds);
+        tm ltm;
+        localtime_r(&when, &ltm); // thread-safe variant, accounts may be rendered concurrently
+        snprintf(day.date, sizeof(day.date), "%04d-%02d-%02d", 1900 + ltm.tm_year, 1 + ltm.tm_mon, ltm.tm_mday);
+        day.startOfDay = 0;
+        day.start = seconds - (ltm.tm_hour * 3600 + ltm.tm_min * 60 + ltm.tm_sec);
+        day.end = day.start + 86400;
+        // On a day the UTC offset changes, cache only the current hour
+        time_t lastSecond = static_cast<time_t>(day.end - 1);
+        tm check;
+        localtime_r(&lastSecond, &check);
+        if(check.tm_gmtoff != ltm.tm_gmtoff || check.tm_mday != ltm.tm_mday) {
+            day.startOfDay = ltm.tm_hour * 3600;
+            day.start = seconds - (ltm.tm_min * 60 + ltm.tm_sec);
+            day.end = day.start + 3600;
+        }
+    }
+    int64_t timeOfDay = day.startOfDay + (seconds - day.start);
+    int fields[3] = {static_cast<int>(timeOfDay / 3600), static_cast<int>(timeOfDay / 60 % 60),
+                     static_cast<int>(timeOfDay % 60)};
+    memcpy(out, day.date, 10);
+    out[10] = 'T';
+    for(int f = 0; f < 3; ++f) {
+        out[11 + 3 * f] = static_cast<char>('0' + fields[f] / 10);
+        out[12 + 3 * f] = static_cast<char>('0' + fields[f] % 10);
+        if(f < 2) {
+            out[13 + 3 * f] = ':';
+        }
+    }
+}
+
+string formatTimestamp(int64_t micros) {
+    char buffer[TIMESTAMP_TEXT_LENGTH];
+    formatTimestamp(micros, buffer);
+    return string(buffer, TIMESTAMP_TEXT_LENGTH);
+}
+
+// Rounding modes used when converting to or scaling Money
+enum class RoundingMode {
+    HalfEven, // banker's rounding, the default for interest
+    HalfUp,
+    Down      // truncate toward zero
+};
+
+// Divide with an explicit rounding mode
+int64_t roundedDivide(__int128 numerator, int64_t denominator, RoundingMode mode) {
+    __int128 quotient = numerator / denominator;
+    __int128 remainder = numerator % denominator;
+    if(remainder == 0 || mode == RoundingMode::Down) {
+        return static_cast<int64_t>(quotient);
+    }
+    __int128 twiceRemainder = 2 * (remainder < 0 ? -remainder : remainder);
+    int sign = (numerator < 0) != (denominator < 0) ? -1 : 1;
+    bool awayFromZero = twiceRemainder > denominator ||
+        (twiceRemainder == denominator && (mode == RoundingMode::HalfUp || quotient % 2 != 0));
+    return static_cast<int64_t>(awayFromZero ? quotient + sign : quotient);
+}
+
+// Fixed-point interest rate in millionths (0.03 is stored as 30000)
+class Rate {
+private:
+    int64_t micros;
+    constexpr explicit Rate(int64_t m) : micros(m) {}
+
+public:
+    static constexpr int64_t SCALE = 1000000;
+
+    constexpr Rate() : micros(0) {}
+    static constexpr Rate fromMicros(int64_t m) { return Rate(m); }
+    static Rate fromDouble(double rate) { return Rate(static_cast<int64_t>(llround(rate * SCALE))); }
+
+    constexpr int64_t getMicros() const { return micros; }
+
+    // Rate as a percentage with two decimals, e.g. "3.00"
+    string toPercentString() const {
+        int64_t hundredths = roundedDivide(micros, 100, RoundingMode::HalfEven);
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%s%lld.%02lld", hundredths < 0 ? "-" : "",
+                 static_cast<long long>(llabs(hundredths) / 100), static_cast<long long>(llabs(hundredths) % 100));
+        return string(buffer);
+    }
+};
+
+// Monetary amount as a whole number of cents.
+// There are no implicit conversions from floating point, so every place that turns a
+// double into Money, or scales Money by a rate, has to name its rounding mode.
+class Money {
+private:
+    int64_t cents;
+    constexpr explicit Money(int64_t c) : cents(c) {}
+
+public:
+    constexpr Money() : cents(0) {}
+    static constexpr Money fromCents(int64_t c) { return Money(c); }
+    static constexpr Money fromDollars(int64_t dollars) { return Money(dollars * 100); }
+    static Money fromDouble(double amount, RoundingMode mode) {
+        double scaled = amount * 100;
+        switch(mode) {
+            case RoundingMode::Down: return Money(static_cast<int64_t>(trunc(scaled)));
+            case RoundingMode::HalfUp: return Money(static_cast<int64_t>(round(scaled)));
+            default: return Money(static_cast<int64_t>(nearbyint(scaled))); // default FE rounding is half-even
+        }
+    }
+
+    // Parse an exact decimal amount such as "250", "19.99" or "-3.5"
+    static Money parse(string_view text) {
+        size_t pos = 0;
+        bool negative = false;
+        if(pos < text.size() && (text[pos] == '-' || text[pos] == '+')) {
+            negative = text[pos++] == '-';
+        }
+        int64_t whole = 0;
+        size_t digits = 0;
+        while(pos < text.size() && isdigit(static_cast<unsigned char>(text[pos]))) {
+            if(whole > (INT64_MAX / 100 - 9) / 10) {
+                throw out_of_range("Amount is too large.");
+            }
+            whole = whole * 10 + (text[pos++] - '0');
+            ++digits;
+        }
+        int64_t fraction = 0;
+        if(pos < text.size() && text[pos] == '.') {
+            ++pos;
+            for(int place = 0; place < 2 && pos < text.size() && isdigit(static_cast<unsigned char>(text[pos])); ++place) {
+                fraction += (text[pos++] - '0') * (place == 0 ? 10 : 1);
+                ++digits;
+            }
+        }
+        if(digits == 0 || pos != text.size()) {
+            throw invalid_argument("Invalid amount: " + string(text));
+        }
+        int64_t total = whole * 100 + fraction;
+        return Money(negative ? -total : total);
+    }
+
+    constexpr int64_t getCents() const { return cents; }
+
+    // Scale by a rate, e.g. balance.applyRate(interestRate, RoundingMode::HalfEven)
+    Money applyRate(Rate rate, RoundingMode mode) const {
+        return Money(roundedDivide(static_cast<__int128>(cents) * rate.getMicros(), Rate::SCALE, mode));
+    }
+
+    // Write the amount with two decimals to out (24 chars at most); returns the end
+    char* format(char* out) const {
+        uint64_t magnitude = cents < 0 ? 0 - static_cast<uint64_t>(cents) : static_cast<uint64_t>(cents);
+        if(cents < 0) {
+            *out++ = '-';
+        }
+        out = to_chars(out, out + 20, magnitude / 100).ptr;
+        *out++ = '.';
+        *out++ = static_cast<char>('0' + magnitude % 100 / 10);
+        *out++ = static_cast<char>('0' + magnitude % 10);
+        return out;
+    }
+
+    // Amount with two decimals, e.g. "1234.50"
+    string toString() const {
+        char buffer[32];
+        return string(buffer, format(buffer));
+    }
+
+    constexpr Money operator-() const { return Money(-cents); }
+    constexpr Money operator+(Money other) const { return Money(cents + other.cents); }
+    constexpr Money operator-(Money other) const { return Money(cents - other.cents); }
+    constexpr Money operator*(int64_t factor) const { return Money(cents * factor); }
+    Money& operator+=(Money other) { cents += other.cents; return *this; }
+    Money& operator-=(Money other) { cents -= other.cents; return *this; }
+
+    constexpr bool operator==(Money other) const { return cents == other.cents; }
+    constexpr bool operator!=(Money other) const { return cents != other.cents; }
+    constexpr bool operator<(Money other) const { return cents < other.cents; }
+    constexpr bool operator<=(Money other) const { return cents <= other.cents; }
+    constexpr bool operator>(Money other) const { return cents > other.cents; }
+    constexpr bool operator>=(Money other) const { return cents >= other.cents; }
+};
+static_assert(sizeof(Money) == sizeof(int64_t), "Money must stay a plain int64");
+
+ostream& operator<<(ostream& out, Money amount) {
+    return out << amount.toString();
+}
+
+// Read an amount typed by the user, failing the stream on malformed input
+istream& operator>>(istream& in, Money& amount) {
+    string text;
+    if(in >> text) {
+        try {
+            amount = Money::parse(text);
+        }
+        catch(const exception&) {
+            in.setstate(ios::failbit);
+        }
+    }
+    return in;
+}
+
+// Transaction types recorded in account journals
+enum class TransactionType : char {
+    Deposit = 'D',
+    Withdrawal = 'W',
+    Transfer = 'T',
+    Loan = 'L'
+};
+
+// Interned transaction descriptions, so journal records carry an id instead of a string
+class DescriptionPool {
+private:
+    static constexpr size_t MAX_DESCRIPTIONS = 4096;
+    mutex mtx;
+    deque<string> strings;
+    unordered_map<string, uint32_t> ids;
+    // Published strings, readable without taking the lock
+    array<atomic<const string*>, MAX_DESCRIPTIONS> published{};
+
+public:
+    static DescriptionPool& instance() {
+        static DescriptionPool pool;
+        return pool;
+    }
+
+    // Return the id for a description, adding it on first use
+    uint32_t intern(const string& text) {
+        lock_guard<mutex> lock(mtx);
+        auto it = ids.find(text);
+        if(it != ids.end()) {
+            return it->second;
+        }
+        if(strings.size() == MAX_DESCRIPTIONS) {
+            throw runtime_error("Too many distinct transaction descriptions.");
+        }
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(text);
+        ids.emplace(text, id);
+        published[id].store(&strings.back(), memory_order_release);
+        return id;
+    }
+
+    // Number of interned descriptions (ids are 0..size-1)
+    uint32_t size() {
+        lock_guard<mutex> lock(mtx);
+        return static_cast<uint32_t>(strings.size());
+    }
+
+    // Look up the text for an id
+    const string& lookup(uint32_t id) const {
+        static const string unknown = "Unknown";
+        const string* text = id < MAX_DESCRIPTIONS ? published[id].load(memory_order_acquire) : nullptr;
+        return text ? *text : unknown;
+    }
+};
+
+// Descriptions used by the account classes
+const uint32_t DESC_DEPOSIT = DescriptionPool::instance().intern("Deposit");
+const uint32_t DESC_WITHDRAWAL = DescriptionPool::instance().intern("Withdrawal");
+const uint32_t DESC_INTEREST = DescriptionPool::instance().intern("Interest Applied");
+const uint32_t DESC_LOAN_PAYMENT = DescriptionPool::instance().intern("Monthly Loan Payment");
+const uint32_t DESC_LOAN_REPAYMENT = DescriptionPool::instance().intern("Loan Repayment");
+const uint32_t DESC_TRANSFER_OUT = DescriptionPool::instance().intern("Transfer Out");
+const uint32_t DESC_TRANSFER_IN = DescriptionPool::instance().intern("Transfer In");
+const uint32_t DESC_TRANSFER_REVERSAL = DescriptionPool::instance().intern("Transfer Reversal");
+
+// Transaction Structure (fixed-size record, copied by value into journals)
+struct Transaction {
+    int64_t timestamp; // microseconds since the epoch, from TimestampClock
+    Money amount;
+    uint32_t descriptionId;
+    TransactionType type;
+    // Shared by the debit and credit legs of one transfer; 0 for other transactions
+    uint64_t transferId = 0;
+
+    string isoTime() const { return formatTimestamp(timestamp); }
+    const string& description() const { return DescriptionPool::instance().lookup(descriptionId); }
+};
+static_assert(is_trivially_copyable<Transaction>::value, "Transaction must stay a plain record");
+
+// Change a transaction made to its account's balance: deposits (including interest and loan
+// repayments) add, withdrawals and loan payments take away, and transfer legs carry their
+// sign (negative for the debit leg)
+Money balanceEffect(const Transaction& txn) {
+    switch(txn.type) {
+        case TransactionType::Deposit:
+        case TransactionType::Transfer:
+            return txn.amount;
+        default:
+            return -txn.amount;
+    }
+}
+
+// Memory subsystem.
+// A Bank owns a CountingResource over the heap, a thread-safe ArenaResource on top of it for
+// journal segments and the strings and vectors inside accounts and customers, and one
+// SlabPool per object type. Every byte a bank takes from the heap is counted, and the
+// deposit, withdraw and transfer paths only reach the heap when the arena needs a new block.
+
+// Allocation statistics for one memory resource
+struct AllocationStats {
+    uint64_t allocations = 0;
+    uint64_t deallocations = 0;
+    uint64_t bytesInUse = 0;
+    uint64_t peakBytes = 0;
+};
+
+// Passes allocations through to an upstream resource, counting them
+class CountingResource : public pmr::memory_resource {
+private:
+    pmr::memory_resource* upstream;
+    atomic<uint64_t> allocations{0};
+    atomic<uint64_t> deallocations{0};
+    atomic<uint64_t> bytesInUse{0};
+    atomic<uint64_t> peakBytes{0};
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* p = upstream->allocate(bytes, alignment);
+        allocations.fetch_add(1, memory_order_relaxed);
+        uint64_t inUse = bytesInUse.fetch_add(bytes, memory_order_relaxed) + bytes;
+        uint64_t peak = peakBytes.load(memory_order_relaxed);
+        while(inUse > peak && !peakBytes.compare_exchange_weak(peak, inUse, memory_order_relaxed)) {}
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        upstream->deallocate(p, bytes, alignment);
+        deallocations.fetch_add(1, memory_order_relaxed);
+        bytesInUse.fetch_sub(bytes, memory_order_relaxed);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit CountingResource(pmr::memory_resource* upstreamResource = pmr::new_delete_resource())
+        : upstream(upstreamResource) {}
+
+    AllocationStats stats() const {
+        return {allocations.load(), deallocations.load(), bytesInUse.load(), peakBytes.load()};
+    }
+};
+
+// Monotonic arena safe to use from several threads. Memory is handed out from large
+// upstream blocks and only returned when the arena is destroyed; deallocate is a no-op.
+class ArenaResource : public pmr::memory_resource {
+private:
+    mutex mtx;
+    pmr::monotonic_buffer_resource arena;
+    uint64_t bytesRequested = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        lock_guard<mutex> lock(mtx);
+        bytesRequested += bytes;
+        return arena.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit ArenaResource(pmr::memory_resource* upstream, size_t initialBlock = 1 << 16)
+        : arena(initialBlock, upstream) {}
+
+    // Bytes handed out so far
+    uint64_t used() {
+        lock_guard<mutex> lock(mtx);
+        return bytesRequested;
+    }
+};
+
+// Stable, chunked storage for objects of one type.
+// Objects are constructed in place in fixed-size chunks taken from a memory resource, so
+// they never move, sit next to other objects of the same type and need no allocation or
+// reference count of their own. Objects live until the pool is destroyed.
+template<typename T>
+class SlabPool {
+private:
+    static constexpr size_t CHUNK = 256;
+
+    pmr::memory_resource* memory;
+    vector<unsigned char*> chunks;
+    size_t count = 0;
+
+    unsigned char* slot(size_t index) const {
+        return chunks[index / CHUNK] + (index % CHUNK) * sizeof(T);
+    }
+
+public:
+    explicit SlabPool(pmr::memory_resource* resource = pmr::get_default_resource()) : memory(resource) {}
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    ~SlabPool() {
+        for(size_t i = 0; i < count; ++i) {
+            (*this)[i].~T();
+        }
+        for(unsigned char* chunk : chunks) {
+            memory->deallocate(chunk, CHUNK * sizeof(T), alignof(T));
+        }
+    }
+
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+        if(count == chunks.size() * CHUNK) {
+            chunks.push_back(static_cast<unsigned char*>(memory->allocate(CHUNK * sizeof(T), alignof(T))));
+        }
+        T* object = new(slot(count)) T(forward<Args>(args)...);
+        ++count;
+        return *object;
+    }
+
+    T& operator[](size_t index) { return *launder(reinterpret_cast<T*>(slot(index))); }
+    const T& operator[](size_t index) const { return *launder(reinterpret_cast<const T*>(slot(index))); }
+
+    size_t size() const { return count; }
+    size_t chunkCount() const { return chunks.size(); }
+    size_t bytesReserved() const { return chunks.size() * CHUNK * sizeof(T); }
+};
+
+// Append-only journal, of transactions or of anything else an account indexes them by.
+// Records live in segments that double in size and never move once allocated, so an
+// append reserves a slot with one atomic increment, takes no lock and only allocates
+// when it opens a new segment. Each slot has a ready flag that its writer sets once the
+// record is in place; the published count then advances over every ready slot, whichever
+// appender gets there. No appender waits for another, and readers see a consistent
+// prefix that ends at the first slot not yet ready, scanning each segment as a
+// contiguous array.
+template<typename T>
+class AppendJournal {
+private:
+    static constexpr uint64_t FIRST_SEGMENT = 8;
+    static constexpr int MAX_SEGMENTS = 32;
+
+    struct Directory {
+        atomic<T*> segments[MAX_SEGMENTS] = {};
+    };
+
+    // Where the directory and segments come from (the owning bank's arena, usually)
+    pmr::memory_resource* memory;
+    atomic<Directory*> directory{nullptr};
+    atomic<uint64_t> reserved{0};
+    atomic<uint64_t> committed{0};
+
+    // Segment k holds FIRST_SEGMENT << k records
+    static int segmentOf(uint64_t index) {
+        return 63 - __builtin_clzll(index / FIRST_SEGMENT + 1);
+    }
+    static uint64_t segmentStart(int segment) {
+        return FIRST_SEGMENT * ((uint64_t(1) << segment) - 1);
+    }
+    static uint64_t segmentSize(int segment) {
+        return FIRST_SEGMENT << segment;
+    }
+    // A segment holds its records followed by one ready flag per record
+    static size_t segmentBytes(int segment) {
+        return segmentSize(segment) * (sizeof(T) + sizeof(atomic<uint8_t>));
+    }
+    static atomic<uint8_t>* readyFlags(T* records, int segment) {
+        return reinterpret_cast<atomic<uint8_t>*>(records + segmentSize(segment));
+    }
+
+    // Whether the record in slot index has been written; false if its segment does not exist yet
+    bool isReady(uint64_t index) const {
+        int seg = segmentOf(index);
+        Directory* dir = directory.load(memory_order_acquire);
+        T* records = dir ? dir->segments[seg].load(memory_order_acquire) : nullptr;
+        return records && readyFlags(records, seg)[index - segmentStart(seg)].load();
+    }
+
+    // Atomically install a freshly allocated object, keeping whichever one wins the race
+    template<typename Object>
+    static Object* install(atomic<Object*>& target, Object* fresh) {
+        Object* expected = nullptr;
+        if(target.compare_exchange_strong(expected, fresh, memory_order_acq_rel)) {
+            return fresh;
+        }
+        return expected;
+    }
+
+    T* segment(int index) {
+        Directory* dir = directory.load(memory_order_acquire);
+        if(!dir) {
+            Directory* fresh = new(memory->allocate(sizeof(Directory), alignof(Directory))) Directory();
+            dir = install(directory, fresh);
+            if(dir != fresh) {
+                memory->deallocate(fresh, sizeof(Directory), alignof(Directory));
+            }
+        }
+        T* seg = dir->segments[index].load(memory_order_acquire);
+        if(!seg) {
+            size_t bytes = segmentBytes(index);
+            T* fresh = static_cast<T*>(memory->allocate(bytes, alignof(T)));
+            atomic<uint8_t>* flags = readyFlags(fresh, index);
+            for(uint64_t i = 0; i < segmentSize(index); ++i) {
+                new(flags + i) atomic<uint8_t>(0);
+            }
+            seg = install(dir->segments[index], fresh);
+            if(seg != fresh) {
+                memory->deallocate(fresh, bytes, alignof(T));
+            }
+        }
+        return seg;
+    }
+
+public:
+    explicit AppendJournal(pmr::memory_resource* resource = pmr::get_default_resource()) : memory(resource) {}
+    AppendJournal(const AppendJournal&) = delete;
+    AppendJournal& operator=(const AppendJournal&) = delete;
+
+    ~AppendJournal() {
+        Directory* dir = directory.load();
+        if(dir) {
+            for(int seg = 0; seg < MAX_SEGMENTS; ++seg) {
+                if(T* records = dir->segments[seg].load()) {
+                    memory->deallocate(records, segmentBytes(seg), alignof(T));
+                }
+            }
+            memory->deallocate(dir, sizeof(Directory), alignof(Directory));
+        }
+    }
+
+    // Append a record; safe to call from several threads at once
+    void append(const T& record) {
+        uint64_t index = reserved.fetch_add(1, memory_order_relaxed);
+        int seg = segmentOf(index);
+        T* records = segment(seg);
+        new(records + (index - segmentStart(seg))) T(record);
+        // Sequentially consistent, so that of two appenders finishing adjacent slots at once
+        // at least one sees the other's flag and carries the published count past both
+        readyFlags(records, seg)[index - segmentStart(seg)].store(1);
+        uint64_t published = committed.load();
+        while(isReady(published)) {
+            if(committed.compare_exchange_weak(published, published + 1)) {
+                ++published;
+            }
+        }
+    }
+
+    // Number of published records
+    size_t size() const { return committed.load(memory_order_acquire); }
+
+    // A published record (index < size())
+    const T& operator[](uint64_t index) const {
+        int seg = segmentOf(index);
+        const Directory* dir = directory.load(memory_order_acquire);
+        return dir->segments[seg].load(memory_order_acquire)[index - segmentStart(seg)];
+    }
+
+    // Visit published records in order, one contiguous segment at a time
+    template<typename Visitor>
+    void forEach(Visitor visit) const {
+        uint64_t count = committed.load(memory_order_acquire);
+        Directory* dir = directory.load(memory_order_acquire);
+        for(int seg = 0; dir && segmentStart(seg) < count; ++seg) {
+            const T* records = dir->segments[seg].load(memory_order_acquire);
+            uint64_t end = min(count - segmentStart(seg), segmentSize(seg));
+            for(uint64_t i = 0; i < end; ++i) {
+                visit(records[i]);
+            }
+        }
+    }
+};
+
+using TransactionJournal = AppendJournal<Transaction>;
+
+class Account;
+
+// A page of an account's history: the transactions stamped in [from, to), optionally of one
+// type only, in time order (or newest first), skipping offset matches and keeping at most limit
+struct HistoryQuery {
+    int64_t from = numeric_limits<int64_t>::min(); // microseconds since the epoch
+    int64_t to = numeric_limits<int64_t>::max();
+    optional<TransactionType> type;
+    size_t offset = 0;
+    size_t limit = 50;
+    bool newestFirst = false;
+};
+
+// Account types; every Account carries its kind as a tag, and the persisted formats store it
+enum class AccountKind : uint8_t {
+    Savings = 'S',
+    Checking = 'C',
+    Loan = 'L'
+};
+
+// Outcome of an account operation. Declines are ordinary results, returned rather than thrown
+// so that a refused withdrawal costs no more than a successful one. Other marks an
+// unexpected exception and is only seen by the metrics.
+enum class TxnStatus : uint8_t {
+    Ok,
+    InvalidAmount,
+    InsufficientFunds,
+    OverdraftExceeded,
+    NotPermitted,
+    AccountNotFound,
+    SameAccount,
+    LimitExceeded,
+    Other,
+    Count
+};
+
+// Short machine-readable name of a status
+const char* statusName(TxnStatus status) {
+    static const char* NAMES[] = {"ok", "invalid_amount", "insufficient_funds", "overdraft_exceeded",
+                                  "not_permitted", "account_not_found", "same_account", "limit_exceeded",
+                                  "other"};
+    return NAMES[static_cast<int>(status)];
+}
+
+// Message for a status; amountName says which amount was invalid ("Deposit", "Withdrawal", ...)
+string statusMessage(TxnStatus status, const char* amountName = "Transaction") {
+    switch(status) {
+        case TxnStatus::Ok: return "OK.";
+        case TxnStatus::InvalidAmount: return string(amountName) + " amount must be positive.";
+        case TxnStatus::InsufficientFunds: return "Insufficient funds.";
+        case TxnStatus::OverdraftExceeded: return "Overdraft limit exceeded.";
+        case TxnStatus::NotPermitted: return "Withdrawals are not allowed from a loan account.";
+        case TxnStatus::AccountNotFound: return "One or both accounts not found.";
+        case TxnStatus::SameAccount: return "Cannot transfer to the same account.";
+        case TxnStatus::LimitExceeded: return "Withdrawal limit exceeded.";
+        default: return "Transaction failed.";
+    }
+}
+
+// Throw the exception the throwing API has always used for a failed status
+void throwIfFailed(TxnStatus status, const char* amountName) {
+    if(status == TxnStatus::Ok) {
+        return;
+    }
+    if(status == TxnStatus::InvalidAmount || status == TxnStatus::SameAccount) {
+        throw invalid_argument(statusMessage(status, amountName));
+    }
+    throw runtime_error(statusMessage(status, amountName));
+}
+
+// Hot-path metrics.
+// Each thread records into its own shard, so recording is a few relaxed loads and stores
+// to memory no other thread writes. A dump sums the shards. When a thread exits its counts
+// move into a retired total and its shard goes to the next new thread, so short-lived
+// worker threads do not grow the set of shards. For every operation and
+// account type the shards hold a count, failure counts by reason and a log2-bucketed
+// latency histogram, and dumpPrometheus renders them in the Prometheus text format.
+enum class MetricOp { Deposit, Withdraw, Transfer, Interest, LoanPayment, Count };
+// Account kind recorded for operations whose account could not be resolved
+constexpr AccountKind UNRESOLVED_ACCOUNT = static_cast<AccountKind>(0);
+
+class Metrics {
+public:
+    static constexpr int OPS = static_cast<int>(MetricOp::Count);
+    static constexpr int KINDS = 4; // savings, checking, loan, unresolved
+    static constexpr int REASONS = static_cast<int>(TxnStatus::Count);
+    // Bucket b counts latencies up to 2^(b + FIRST_BUCKET_SHIFT) ns; the last one is unbounded
+    static constexpr int BUCKETS = 32;
+    static constexpr int FIRST_BUCKET_SHIFT = 6;
+
+private:
+    struct Series {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> totalNs{0};
+        atomic<uint64_t> failures[REASONS] = {};
+        atomic<uint64_t> buckets[BUCKETS] = {};
+    };
+
+    // One thread's counters; only that thread writes them
+    struct Shard {
+        Series series[OPS][KINDS];
+    };
+
+    mutex mtx;
+    vector<unique_ptr<Shard>> shards;
+    // Shards whose threads have exited, zeroed and ready for the next new thread
+    vector<Shard*> freeShards;
+    // What exited threads recorded
+    Shard retired;
+    atomic<bool> enabled{true};
+
+    // Hands a thread's shard back when the thread exits
+    struct Lease {
+        Metrics* owner = nullptr;
+        Shard* shard = nullptr;
+        ~Lease() {
+            if(shard) {
+                owner->release(shard);
+            }
+        }
+    };
+
+    static void bump(atomic<uint64_t>& counter, uint64_t by = 1) {
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+    // Add from's counts into into and zero from
+    static void absorb(Series& into, Series& from) {
+        bump(into.count, from.count.exchange(0, memory_order_relaxed));
+        bump(into.totalNs, from.totalNs.exchange(0, memory_order_relaxed));
+        for(int r = 0; r < REASONS; ++r) {
+            bump(into.failures[r], from.failures[r].exchange(0, memory_order_relaxed));
+        }
+        for(int b = 0; b < BUCKETS; ++b) {
+            bump(into.buckets[b], from.buckets[b].exchange(0, memory_order_relaxed));
+        }
+    }
+
+    void release(Shard* shard) {
+        lock_guard<mutex> lock(mtx);
+        for(int op = 0; op < OPS; ++op) {
+            for(int k = 0; k < KINDS; ++k) {
+                absorb(retired.series[op][k], shard->series[op][k]);
+            }
+        }
+        freeShards.push_back(shard);
+    }
+
+    static int kindIndex(AccountKind kind) {
+        switch(kind) {
+            case AccountKind::Savings: return 0;
+            case AccountKind::Checking: return 1;
+            case AccountKind::Loan: return 2;
+        }
+        return 3;
+    }
+
+    static int bucketOf(uint64_t ns) {
+        int bits = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1); // ceil(log2(ns))
+        return min(BUCKETS - 1, max(0, bits - FIRST_BUCKET_SHIFT));
+    }
+
+    // This thread's shard, reusing one left by an exited thread when there is one
+    Shard& shard() {
+        thread_local Lease lease;
+        if(!lease.shard) {
+            lock_guard<mutex> lock(mtx);
+            if(freeShards.empty()) {
+                shards.push_back(make_unique<Shard>());
+                lease.shard = shards.back().get();
+            }
+            else {
+                lease.shard = freeShards.back();
+                freeShards.pop_back();
+            }
+            lease.owner = this;
+        }
+        return *lease.shard;
+    }
+
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+    void setEnabled(bool on) { enabled.store(on, memory_order_relaxed); }
+
+    // Shards allocated so far; bounded by the most threads ever recording at once
+    size_t shardCount() {
+        lock_guard<mutex> lock(mtx);
+        return shards.size();
+    }
+
+    void record(MetricOp op, AccountKind kind, uint64_t ns) {
+        Series& s = shard().series[static_cast<int>(op)][kindIndex(kind)];
+        bump(s.count);
+        bump(s.totalNs, ns);
+        bump(s.buckets[bucketOf(ns)]);
+    }
+
+    void recordFailure(MetricOp op, AccountKind kind, TxnStatus reason, uint64_t ns) {
+        record(op, kind, ns);
+        bump(shard().series[static_cast<int>(op)][kindIndex(kind)].failures[static_cast<int>(reason)]);
+    }
+
+    // Write every series with activity in the Prometheus text exposition format
+    void dumpPrometheus(ostream& out) {
+        static const char* OP_NAMES[OPS] = {"deposit", "withdraw", "transfer", "interest", "loan_payment"};
+        static const char* KIND_NAMES[KINDS] = {"savings", "checking", "loan", "unknown"};
+        struct Totals {
+            uint64_t count = 0, totalNs = 0, failures[REASONS] = {}, buckets[BUCKETS] = {};
+        };
+        Totals totals[OPS][KINDS];
+        {
+            lock_guard<mutex> lock(mtx);
+            vector<const Shard*> sources{&retired};
+            for(const auto& s : shards) {
+                sources.push_back(s.get());
+            }
+            for(const Shard* s : sources) {
+                for(int op = 0; op < OPS; ++op) {
+                    for(int k = 0; k < KINDS; ++k) {
+                        const Series& series = s->series[op][k];
+                        Totals& t = totals[op][k];
+                        t.count += series.count.load(memory_order_relaxed);
+                        t.totalNs += series.totalNs.load(memory_order_relaxed);
+                        for(int r = 0; r < REASONS; ++r) {
+                            t.failures[r] += series.failures[r].load(memory_order_relaxed);
+                        }
+                        for(int b = 0; b < BUCKETS; ++b) {
+                            t.buckets[b] += series.buckets[b].load(memory_order_relaxed);
+                        }
+                    }
+                }
+            }
+        }
+        auto labels = [&](int op, int k) {
+            return string("operation=\"") + OP_NAMES[op] + "\",account=\"" + KIND_NAMES[k] + "\"";
+        };
+
+        out << "# HELP safetransact_operations_total Account operations attempted, by operation and account type.\n"
+            << "# TYPE safetransact_operations_total counter\n";
+        for(int op = 0; op < OPS; ++op) {
+            for(int k = 0; k < KINDS; ++k) {
+                if(totals[op][k].count) {
+                    out << "safetransact_operations_total{" << labels(op, k) << "} " << totals[op][k].count << "\n";
+                }
+            }
+        }
+        out << "# HELP safetransact_operation_failures_total Failed account operations, by reason.\n"
+            << "# TYPE safetransact_operation_failures_total counter\n";
+        for(int op = 0; op < OPS; ++op) {
+            for(int k = 0; k < KINDS; ++k) {
+                for(int r = 0; r < REASONS; ++r) {
+                    if(totals[op][k].failures[r]) {
+                        out << "safetransact_operation_failures_total{" << labels(op, k) << ",reason=\"" << statusName(static_cast<TxnStatus>(r))
+                            << "\"} " << totals[op][k].failures[r] << "\n";
+                    }
+                }
+            }
+        }
+        out << "# HELP safetransact_operation_duration_seconds Latency of account operations.\n"
+            << "# TYPE safetransact_operation_duration_seconds histogram\n";
+        for(int op = 0; op < OPS; ++op) {
+            for(int k = 0; k < KINDS; ++k) {
+                const Totals& t = totals[op][k];
+                if(!t.count) {
+                    continue;
+                }
+                uint64_t cumulative = 0;
+                for(int b = 0; b < BUCKETS - 1; ++b) {
+                    cumulative += t.buckets[b];
+                    out << "safetransact_operation_duration_seconds_bucket{" << labels(op, k) << ",le=\""
+                        << static_cast<double>(uint64_t(1) << (b + FIRST_BUCKET_SHIFT)) / 1e9 << "\"} " << cumulative << "\n";
+                }
+                out << "safetransact_operation_duration_seconds_bucket{" << labels(op, k) << ",le=\"+Inf\"} " << t.count << "\n"
+                    << "safetransact_operation_duration_seconds_sum{" << labels(op, k) << "} " << t.totalNs / 1e9 << "\n"
+                    << "safetransact_operation_duration_seconds_count{" << labels(op, k) << "} " << t.count << "\n";
+            }
+        }
+    }
+
+    // Write a snapshot to path, replacing it atomically; extra appends more series
+    void dumpPrometheus(const string& path, const function<void(ostream&)>& extra = nullptr) {
+        string temp = path + ".tmp";
+        {
+            ofstream out(temp);
+            dumpPrometheus(out);
+            if(extra) {
+                extra(out);
+            }
+            if(!out) {
+                throw runtime_error("Cannot write metrics to " + temp);
+            }
+        }
+        filesystem::rename(temp, path);
+    }
+};
+
+// Run body as operation op on an account of the given kind, recording its latency and any
+// failure. body returns a TxnStatus, or nothing if it can only fail by throwing.
+template<typename Body>
+auto metered(MetricOp op, AccountKind kind, Body body) {
+    Metrics& metrics = Metrics::instance();
+    if(!metrics.isEnabled()) {
+        return body();
+    }
+    auto start = chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    };
+    try {
+        if constexpr(is_void_v<decltype(body())>) {
+            body();
+            metrics.record(op, kind, elapsed());
+        }
+        else {
+            TxnStatus status = body();
+            if(status == TxnStatus::Ok) {
+                metrics.record(op, kind, elapsed());
+            }
+            else {
+                metrics.recordFailure(op, kind, status, elapsed());
+            }
+            return status;
+        }
+    }
+    catch(...) {
+        metrics.recordFailure(op, kind, TxnStatus::Other, elapsed());
+        throw;
+    }
+}
+
+// Running totals.
+// A Bank keeps the totals that risk dashboards poll up to date posting by posting, bank-wide
+// and per customer, so reading them never walks the accounts. BookTotals is one set of
+// figures; LiveTotals holds them for concurrent update under sequence locks.
+
+// Balances and account counts by account type, outstanding loan principal, and how far
+// checking accounts are overdrawn in total, over some set of accounts
+struct BookTotals {
+    static constexpr int KINDS = 3; // savings, checking, loan
+    Money balance[KINDS];
+    int64_t accounts[KINDS] = {};
+    Money loanPrincipal;
+    Money overdraft;
+
+    static int kindIndex(AccountKind kind) {
+        return kind == AccountKind::Savings ? 0 : kind == AccountKind::Checking ? 1 : 2;
+    }
+
+    // What one account with the given balance (and loan principal) contributes
+    static BookTotals of(AccountKind kind, Money balance, Money principal) {
+        BookTotals totals;
+        totals.balance[kindIndex(kind)] = balance;
+        totals.accounts[kindIndex(kind)] = 1;
+        totals.loanPrincipal = principal;
+        if(kind == AccountKind::Checking && balance < Money()) {
+            totals.overdraft = -balance;
+        }
+        return totals;
+    }
+
+    // Funds held for customers: savings and checking balances, overdrawn accounts counting as zero
+    Money deposits() const { return balance[0] + balance[1] + overdraft; }
+
+    BookTotals& operator+=(const BookTotals& other) {
+        for(int k = 0; k < KINDS; ++k) {
+            balance[k] += other.balance[k];
+            accounts[k] += other.accounts[k];
+        }
+        loanPrincipal += other.loanPrincipal;
+        overdraft += other.overdraft;
+        return *this;
+    }
+
+    BookTotals& operator-=(const BookTotals& other) {
+        for(int k = 0; k < KINDS; ++k) {
+            balance[k] -= other.balance[k];
+            accounts[k] -= other.accounts[k];
+        }
+        loanPrincipal -= other.loanPrincipal;
+        overdraft -= other.overdraft;
+        return *this;
+    }
+
+    bool operator==(const BookTotals& other) const {
+        for(int k = 0; k < KINDS; ++k) {
+            if(balance[k] != other.balance[k] || accounts[k] != other.accounts[k]) {
+                return false;
+            }
+        }
+        return loanPrincipal == other.loanPrincipal && overdraft == other.overdraft;
+    }
+};
+
+// BookTotals split over STRIPES stripes, each under its own sequence lock. A thread always
+// adds to the same stripe, so concurrent writers seldom share one. A read copies every
+// stripe and checks that none changed meanwhile, retrying if one did; after a few retries it
+// locks the stripes instead. Either way it sees a state in which each add is wholly
+// applied or not at all.
+template<size_t STRIPES>
+class LiveTotals {
+private:
+    static constexpr int FIELDS = 2 * BookTotals::KINDS + 2;
+    static constexpr int READ_ATTEMPTS = 8;
+
+    struct alignas(STRIPES > 1 ? 64 : alignof(uint64_t)) Stripe {
+        atomic<uint64_t> sequence{0}; // odd while a writer holds the stripe
+        atomic<int64_t> fields[FIELDS] = {};
+    };
+    Stripe stripes[STRIPES];
+
+    static void unpack(const BookTotals& totals, int64_t (&fields)[FIELDS]) {
+        for(int k = 0; k < BookTotals::KINDS; ++k) {
+            fields[k] = totals.balance[k].getCents();
+            fields[BookTotals::KINDS + k] = totals.accounts[k];
+        }
+        fields[FIELDS - 2] = totals.loanPrincipal.getCents();
+        fields[FIELDS - 1] = totals.overdraft.getCents();
+    }
+
+    static void pack(const int64_t (&fields)[FIELDS], BookTotals& totals) {
+        for(int k = 0; k < BookTotals::KINDS; ++k) {
+            totals.balance[k] += Money::fromCents(fields[k]);
+            totals.accounts[k] += fields[BookTotals::KINDS + k];
+        }
+        totals.loanPrincipal += Money::fromCents(fields[FIELDS - 2]);
+        totals.overdraft += Money::fromCents(fields[FIELDS - 1]);
+    }
+
+    static size_t myStripe() {
+        if constexpr(STRIPES == 1) {
+            return 0;
+        }
+        static atomic<size_t> nextStripe{0};
+        thread_local size_t stripe = SIZE_MAX; // constant-initialized, so no guard on each use
+        if(stripe == SIZE_MAX) {
+            stripe = nextStripe.fetch_add(1, memory_order_relaxed) % STRIPES;
+        }
+        return stripe;
+    }
+
+    // Take a stripe's lock; returns the even sequence it had
+    static uint64_t lock(Stripe& s) {
+        uint64_t seq = s.sequence.load(memory_order_relaxed);
+        while((seq & 1) || !s.sequence.compare_exchange_weak(seq, seq + 1, memory_order_acquire)) {
+            this_thread::yield();
+            seq = s.sequence.load(memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_release);
+        return seq;
+    }
+
+    static void unlock(Stripe& s, uint64_t seq) {
+        s.sequence.store(seq + 2, memory_order_release);
+    }
+
+public:
+    void add(const BookTotals& change) {
+        int64_t deltas[FIELDS];
+        unpack(change, deltas);
+        // Transfers between accounts of one type leave the bank-wide totals as they were
+        if(all_of(begin(deltas), end(deltas), [](int64_t delta) { return delta == 0; })) {
+            return;
+        }
+        Stripe& s = stripes[myStripe()];
+        uint64_t seq = lock(s);
+        for(int f = 0; f < FIELDS; ++f) {
+            if(deltas[f]) {
+                s.fields[f].store(s.fields[f].load(memory_order_relaxed) + deltas[f], memory_order_relaxed);
+            }
+        }
+        unlock(s, seq);
+    }
+
+    // Replace the totals; only while nothing else updates them
+    void reset(const BookTotals& totals) {
+        for(Stripe& s : stripes) {
+            for(auto& field : s.fields) {
+                field.store(0, memory_order_relaxed);
+            }
+        }
+        add(totals);
+    }
+
+    BookTotals read() const {
+        int64_t fields[STRIPES][FIELDS];
+        uint64_t sequences[STRIPES];
+        for(int attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+            bool busy = false;
+            for(size_t i = 0; i < STRIPES && !busy; ++i) {
+                sequences[i] = stripes[i].sequence.load(memory_order_acquire);
+                busy = sequences[i] & 1;
+                for(int f = 0; f < FIELDS; ++f) {
+                    fields[i][f] = stripes[i].fields[f].load(memory_order_relaxed);
+                }
+            }
+            atomic_thread_fence(memory_order_acquire);
+            for(size_t i = 0; i < STRIPES && !busy; ++i) {
+                busy = stripes[i].sequence.load(memory_order_relaxed) != sequences[i];
+            }
+            if(!busy) {
+                BookTotals totals;
+                for(size_t i = 0; i < STRIPES; ++i) {
+                    pack(fields[i], totals);
+                }
+                return totals;
+            }
+        }
+        // Writers keep getting in the way: hold them all off while copying
+        Stripe* mutableStripes = const_cast<Stripe*>(stripes);
+        for(size_t i = 0; i < STRIPES; ++i) {
+            sequences[i] = lock(mutableStripes[i]);
+        }
+        BookTotals totals;
+        for(size_t i = 0; i < STRIPES; ++i) {
+            for(int f = 0; f < FIELDS; ++f) {
+                fields[i][f] = stripes[i].fields[f].load(memory_order_relaxed);
+            }
+            pack(fields[i], totals);
+        }
+        for(size_t i = STRIPES; i-- > 0;) {
+            unlock(mutableStripes[i], sequences[i]);
+        }
+        return totals;
+    }
+};
+
+// A customer's totals: one stripe, as only the customer's own accounts update it
+using CustomerTotals = LiveTotals<1>;
+using BankTotals = LiveTotals<16>;
+
+// Debit limits.
+// A LimitRule caps how much money, or how many debits, may leave one account (or all of one
+// customer's accounts together) within a sliding window: "at most $5000 a day", "at most
+// 3 withdrawals in 10 minutes". Withdrawals and the debit legs of transfers are checked
+// inline, after the balance check, against windows kept beside each account and customer.
+// Until a bucket ends a check costs two comparisons whatever the number of rules, and it
+// never allocates.
+enum class LimitScope : uint8_t { Account, Customer };
+
+struct LimitRule {
+    LimitScope scope = LimitScope::Account;
+    int64_t windowMicros = 0;
+    Money maxAmount;       // zero: the amount is not capped
+    uint32_t maxCount = 0; // zero: the number of debits is not capped
+};
+
+// The rules in force, split by scope. A Bank replaces its policy whole, so the windows
+// attached to an account or customer never see their rule list change under them.
+struct LimitPolicy {
+    vector<LimitRule> accountRules;
+    vector<LimitRule> customerRules;
+};
+
+// One rule's debits over its window, kept in BUCKETS buckets of a fifteenth of the window.
+// The sums cover the current bucket and the fifteen before it, so a rule holds over at
+// least its full window (and at most a fifteenth more). The current bucket is kept beside
+// the sums, and only moved into the ring of older buckets (stored apart, see LimitWindows)
+// when it ends. Moving on drops the expired buckets from the sums, at most BUCKETS steps
+// however long the window idled.
+class SlidingWindow {
+public:
+    static constexpr int64_t BUCKETS = 16;
+
+    // Older buckets, bucket b in slot b % BUCKETS
+    struct Ring {
+        Money amount[BUCKETS];
+        uint32_t count[BUCKETS] = {};
+    };
+
+private:
+    int64_t newest = 0;    // number (time / width) of the current bucket
+    int64_t newestEnd = 0; // time the current bucket ends
+    Money amount;          // sums over the window, current bucket included
+    uint32_t count = 0;
+    uint32_t currentCount = 0;
+    Money currentAmount;
+
+    static int64_t bucketWidth(const LimitRule& rule) {
+        return max<int64_t>(1, (rule.windowMicros + BUCKETS - 2) / (BUCKETS - 1));
+    }
+
+public:
+    // Time the current bucket ends
+    int64_t end() const { return newestEnd; }
+
+    // Move to the bucket holding now; rule's older buckets are in ring. Clocks on different
+    // threads can disagree by a few microseconds; a debit stamped in an earlier bucket is
+    // counted in the current one.
+    void advance(const LimitRule& rule, Ring& ring, int64_t now) {
+        if(now < newestEnd) {
+            return;
+        }
+        int64_t width = bucketWidth(rule);
+        int64_t bucket = now / width;
+        newestEnd = (bucket + 1) * width;
+        if(bucket <= newest) {
+            return;
+        }
+        if(bucket - newest >= BUCKETS) {
+            amount = Money();
+            count = 0;
+            ring = Ring();
+        }
+        else {
+            ring.amount[newest % BUCKETS] = currentAmount;
+            ring.count[newest % BUCKETS] = currentCount;
+            for(int64_t b = newest + 1; b <= bucket; ++b) {
+                amount -= ring.amount[b % BUCKETS];
+                count -= ring.count[b % BUCKETS];
+                ring.amount[b % BUCKETS] = Money();
+                ring.count[b % BUCKETS] = 0;
+            }
+        }
+        currentAmount = Money();
+        currentCount = 0;
+        newest = bucket;
+    }
+
+    // Count debits totalling debitAmount in the current bucket
+    void add(Money debitAmount, uint32_t debits) {
+        currentAmount += debitAmount;
+        currentCount += debits;
+        amount += debitAmount;
+        count += debits;
+    }
+
+    // How much more money, and how many more debits, rule allows in the current window
+    Money amountRoom(const LimitRule& rule) const {
+        return rule.maxAmount == Money() ? Money::fromCents(numeric_limits<int64_t>::max()) : rule.maxAmount - amount;
+    }
+    uint32_t countRoom(const LimitRule& rule) const {
+        return rule.maxCount == 0 ? numeric_limits<uint32_t>::max() : rule.maxCount - min(count, rule.maxCount);
+    }
+};
+
+// The windows of every rule of one scope, for one account or customer. Not synchronized:
+// an account's windows are guarded by the account lock, a customer's by CustomerLimits.
+// Every rule sees the same debits, so the windows need no update until one of their
+// buckets ends. Until then debits only add up in pending, and a check compares them with
+// the least room any rule had when the windows were last brought up to date. A check thus
+// costs two comparisons however many rules there are, and touches only this header.
+class LimitWindows {
+private:
+    // One block: every rule's window side by side, then their rings
+    const LimitRule* rules = nullptr;
+    SlidingWindow* windows = nullptr;
+    SlidingWindow::Ring* rings = nullptr;
+    size_t ruleCount = 0;
+    pmr::memory_resource* memory = nullptr;
+    int64_t refreshAt = 0; // time the first current bucket ends
+    Money amountRoom;      // least room over the rules as of the last refresh
+    uint32_t countRoom = 0;
+    uint32_t pendingCount = 0; // debits counted since the last refresh
+    Money pendingAmount;
+
+    static size_t blockSize(size_t count) {
+        return count * (sizeof(SlidingWindow) + sizeof(SlidingWindow::Ring));
+    }
+
+    // Add the pending debits to every window, move each to the bucket holding now and take
+    // the least room over them
+    void refresh(int64_t now) {
+        refreshAt = numeric_limits<int64_t>::max();
+        amountRoom = Money::fromCents(numeric_limits<int64_t>::max());
+        countRoom = numeric_limits<uint32_t>::max();
+        for(size_t i = 0; i < ruleCount; ++i) {
+            windows[i].add(pendingAmount, pendingCount);
+            windows[i].advance(rules[i], rings[i], now);
+            refreshAt = min(refreshAt, windows[i].end());
+            amountRoom = min(amountRoom, windows[i].amountRoom(rules[i]));
+            countRoom = min(countRoom, windows[i].countRoom(rules[i]));
+        }
+        pendingAmount = Money();
+        pendingCount = 0;
+    }
+
+public:
+    LimitWindows() {}
+    LimitWindows(const LimitWindows&) = delete;
+    LimitWindows& operator=(const LimitWindows&) = delete;
+    ~LimitWindows() { clear(); }
+
+    // Drop the windows, leaving no rules
+    void clear() {
+        if(windows) {
+            memory->deallocate(windows, blockSize(ruleCount), alignof(SlidingWindow));
+        }
+        rules = nullptr;
+        windows = nullptr;
+        rings = nullptr;
+        ruleCount = 0;
+        refreshAt = 0;
+        pendingAmount = Money();
+        pendingCount = 0;
+    }
+
+    // Start empty windows for the given rules, which must outlive them
+    void reset(const vector<LimitRule>& ruleList, pmr::memory_resource* memoryResource) {
+        clear();
+        if(ruleList.empty()) {
+            return;
+        }
+        memory = memoryResource;
+        rules = ruleList.data();
+        ruleCount = ruleList.size();
+        static_assert(alignof(SlidingWindow::Ring) <= alignof(SlidingWindow) && sizeof(SlidingWindow) % alignof(SlidingWindow::Ring) == 0);
+        windows = static_cast<SlidingWindow*>(memory->allocate(blockSize(ruleCount), alignof(SlidingWindow)));
+        rings = reinterpret_cast<SlidingWindow::Ring*>(windows + ruleCount);
+        uninitialized_value_construct_n(windows, ruleCount);
+        uninitialized_value_construct_n(rings, ruleCount);
+    }
+
+    bool empty() const { return ruleCount == 0; }
+
+    // Count a debit at time now if it stays within every rule; whether it did
+    bool charge(Money debit, int64_t now) {
+        if(now >= refreshAt) {
+            refresh(now);
+        }
+        if(debit > amountRoom - pendingAmount || pendingCount >= countRoom) {
+            return false;
+        }
+        pendingAmount += debit;
+        ++pendingCount;
+        return true;
+    }
+
+    // Take back the debit charge has just counted
+    void refund(Money debit) {
+        pendingAmount -= debit;
+        --pendingCount;
+    }
+};
+
+// A customer's windows, shared by all of their accounts and so under a lock of their own
+struct CustomerLimits {
+    mutex mtx;
+    LimitWindows windows;
+};
+
+// Notified of every transaction posted to an account it is attached to.
+// Called with the account locked and its balances already updated: balance is the new
+// balance, and principalChange how much the posting moved a loan's outstanding principal.
+class AccountListener {
+public:
+    virtual void onPosting(Account& account, const Transaction& txn, Money balance, Money principalChange) = 0;
+    virtual ~AccountListener() {}
+};
+
+// Base Account Class.
+// Accounts are not polymorphic: each one carries its AccountKind, and the operations that
+// differ by type are dispatched with a switch on it (see visitAccount), which the compiler
+// can inline. Accounts opened through a Bank live in its per-type pools.
+class Account {
+protected:
+    AccountKind kind;
+    pmr::string accountNumber;
+    pmr::string accountHolder;
+    Money balance;
+    // Guards balance and history; recursive so overrides can call the base class
+    mutable recursive_mutex mtx;
+    // Transaction history shared by every account type, in timestamp order
+    TransactionJournal transactions;
+    // Journal positions of each transaction type's records, for history queries by type;
+    // kept in journals too, so indexing a posting never moves or copies earlier positions
+    static constexpr int TRANSACTION_TYPES = 4;
+    AppendJournal<uint32_t> typePositions[TRANSACTION_TYPES];
+    // Owner notified of each posting (the Bank, for logging), and the last log sequence applied
+    AccountListener* listener = nullptr;
+    uint64_t logSequence = 0;
+    // Running totals of the customer holding the account, kept by the Bank
+    CustomerTotals* ownerTotals = nullptr;
+    // Debit limits: the account's own windows, guarded by mtx, and its owner's when the
+    // Bank has customer rules
+    LimitWindows limits;
+    CustomerLimits* ownerLimits = nullptr;
+
+    static int typeSlot(TransactionType type) {
+        switch(type) {
+            case TransactionType::Deposit: return 0;
+            case TransactionType::Withdrawal: return 1;
+            case TransactionType::Transfer: return 2;
+            default: return 3;
+        }
+    }
+
+    // Binary search: the first i in [low, high) with at(i) stamped at or after t
+    template<typename At>
+    static size_t firstStampedFrom(size_t low, size_t high, int64_t t, At at) {
+        while(low < high) {
+            size_t mid = low + (high - low) / 2;
+            if(at(mid).timestamp < t) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    // Add a record to the journal and the type index. Called with the account locked, which
+    // keeps the balance, the journal and the index in step; the journals need no lock of their
+    // own, so this only allocates when one of them opens a new segment.
+    void appendTransaction(const Transaction& txn) {
+        typePositions[typeSlot(txn.type)].append(static_cast<uint32_t>(transactions.size()));
+        transactions.append(txn);
+    }
+
+    // Record a transaction in the journal
+    void record(TransactionType type, Money amount, uint32_t descriptionId, Money principalChange = Money(),
+                uint64_t transferId = 0) {
+        // Clocks on different threads can disagree by a few microseconds; never stamp a record
+        // earlier than the one before it, so the journal stays in time order
+        int64_t stamp = TimestampClock::now();
+        if(size_t count = transactions.size()) {
+            stamp = max(stamp, transactions[count - 1].timestamp);
+        }
+        Transaction txn{stamp, amount, descriptionId, type, transferId};
+        appendTransaction(txn);
+        if(listener) {
+            listener->onPosting(*this, txn, balance, principalChange);
+        }
+    }
+
+    // Check a debit the balance allows against the account's and its owner's limits, and count
+    // it if they allow it too; called with the account locked
+    TxnStatus chargeLimits(Money amount) {
+        if(limits.empty() && !ownerLimits) {
+            return TxnStatus::Ok;
+        }
+        int64_t now = TimestampClock::now();
+        if(!limits.charge(amount, now)) {
+            return TxnStatus::LimitExceeded;
+        }
+        if(ownerLimits) {
+            lock_guard<mutex> lock(ownerLimits->mtx);
+            if(!ownerLimits->windows.charge(amount, now)) {
+                limits.refund(amount);
+                return TxnStatus::LimitExceeded;
+            }
+        }
+        return TxnStatus::Ok;
+    }
+
+    // Validate a deposit and add it to the balance
+    TxnStatus creditBalance(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount <= Money()) {
+            return TxnStatus::InvalidAmount;
+        }
+        balance += amount;
+        return TxnStatus::Ok;
+    }
+
+    // Constructor (for the derived classes only); strings and history are allocated from memory
+    Account(AccountKind accountKind, const string& accNum, const string& holder, Money initialBalance,
+            pmr::memory_resource* memory)
+        : kind(accountKind), accountNumber(accNum, memory), accountHolder(holder, memory), balance(initialBalance),
+          transactions(memory),
+          typePositions{AppendJournal<uint32_t>(memory), AppendJournal<uint32_t>(memory), AppendJournal<uint32_t>(memory),
+                        AppendJournal<uint32_t>(memory)} {}
+
+public:
+    Account(const Account&) = delete;
+    Account& operator=(const Account&) = delete;
+
+    // Getter methods
+    AccountKind getKind() const { return kind; }
+    string_view getAccountNumber() const { return accountNumber; }
+    string_view getAccountHolder() const { return accountHolder; }
+    Money getBalance() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        return balance;
+    }
+
+    // Per-account lock, used by Bank to make transfers atomic
+    recursive_mutex& getMutex() const { return mtx; }
+
+    // Transaction history
+    const TransactionJournal& getTransactions() const { return transactions; }
+
+    // Attach the listener told about every posting
+    void setListener(AccountListener* accountListener) { listener = accountListener; }
+
+    CustomerTotals* getOwnerTotals() const { return ownerTotals; }
+    void setOwnerTotals(CustomerTotals* totals) { ownerTotals = totals; }
+
+    // Start empty limit windows for policy (none if null), with owner's windows counted too
+    // when the policy has customer rules; window memory comes from memory
+    void attachLimits(const LimitPolicy* policy, CustomerLimits* owner, pmr::memory_resource* memory) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(policy) {
+            limits.reset(policy->accountRules, memory);
+        }
+        else {
+            limits.clear();
+        }
+        ownerLimits = policy && !policy->customerRules.empty() ? owner : nullptr;
+    }
+
+    // Sequence number of the last logged posting reflected in this account
+    uint64_t getLogSequence() const { return logSequence; }
+    void setLogSequence(uint64_t sequence) { logSequence = sequence; }
+
+    // Mutable state beyond the constructor arguments, saved by snapshots and the log
+    struct State {
+        Money balance;
+        Money principal; // outstanding loan amount (loan accounts only)
+        Money payment;   // last monthly payment (loan accounts only)
+    };
+
+    State getState() const;
+    void restoreState(const State& state);
+
+    // Re-add a recovered transaction without notifying the listener
+    void restoreTransaction(const Transaction& txn) {
+        lock_guard<recursive_mutex> lock(mtx);
+        appendTransaction(txn);
+    }
+
+    // Opening and closing balance of [from, to), worked back from the current balance, and the
+    // journal positions [first, last) of the transactions in between
+    struct PeriodRange {
+        Money opening;
+        Money closing;
+        size_t first;
+        size_t last;
+    };
+
+    PeriodRange periodRange(int64_t from, int64_t to) const {
+        lock_guard<recursive_mutex> lock(mtx);
+        size_t count = transactions.size();
+        auto at = [&](size_t i) -> const Transaction& { return transactions[i]; };
+        PeriodRange range;
+        range.first = firstStampedFrom(0, count, from, at);
+        range.last = max(range.first, firstStampedFrom(range.first, count, to, at));
+        range.closing = balance;
+        for(size_t i = range.last; i < count; ++i) {
+            range.closing -= balanceEffect(transactions[i]);
+        }
+        range.opening = range.closing;
+        for(size_t i = range.first; i < range.last; ++i) {
+            range.opening -= balanceEffect(transactions[i]);
+        }
+        return range;
+    }
+
+    // Copy one page of history matching query into page (replacing its contents) and return
+    // the number of matches across all pages. Two binary searches find the time range, in the
+    // journal or in the type's position index, so the cost is O(log n + page).
+    size_t queryHistory(const HistoryQuery& query, vector<Transaction>& page) const {
+        lock_guard<recursive_mutex> lock(mtx);
+        page.clear();
+        const AppendJournal<uint32_t>* positions = query.type ? &typePositions[typeSlot(*query.type)] : nullptr;
+        size_t count = positions ? positions->size() : transactions.size();
+        auto at = [&](size_t i) -> const Transaction& { return transactions[positions ? (*positions)[i] : i]; };
+        size_t first = firstStampedFrom(0, count, query.from, at);
+        size_t last = query.to > query.from ? firstStampedFrom(first, count, query.to, at) : first;
+        size_t total = last - first;
+        for(size_t k = query.offset; k < total && page.size() < query.limit; ++k) {
+            page.push_back(at(query.newestFirst ? last - 1 - k : first + k));
+        }
+        return total;
+    }
+
+    // Operations implemented by each account type, dispatched on the kind tag. The try forms
+    // report a decline as a TxnStatus; deposit and withdraw throw it instead.
+    TxnStatus tryDeposit(Money amount);
+    TxnStatus tryWithdraw(Money amount);
+    void deposit(Money amount);
+    void withdraw(Money amount);
+    void display() const;
+    void displayHistory() const;
+
+    // Print the common details; static so snapshot-backed accounts share the format
+    static void printDetails(string_view number, string_view holder, Money balance) {
+        cout << "Account Number: " << number << "\n"
+             << "Account Holder: " << holder << "\n"
+             << "Balance: $" << balance << "\n";
+    }
+};
+
+// SavingsAccount Derived Class
+class SavingsAccount final : public Account {
+private:
+    Rate interestRate;
+
+public:
+    static constexpr AccountKind KIND = AccountKind::Savings;
+
+    SavingsAccount(const string& accNum, const string& holder, Money initialBalance, Rate rate,
+                   pmr::memory_resource* memory = pmr::get_default_resource())
+        : Account(KIND, accNum, holder, initialBalance, memory), interestRate(rate) {}
+
+    // Apply interest
+    void applyInterest() {
+        metered(MetricOp::Interest, KIND, [&] {
+            lock_guard<recursive_mutex> lock(mtx);
+            Money interest = balance.applyRate(interestRate, RoundingMode::HalfEven);
+            balance += interest;
+            record(TransactionType::Deposit, interest, DESC_INTEREST);
+        });
+    }
+
+    // Post interest computed in bulk on accruedOn; recomputed if the balance has moved since
+    Money postInterest(Money accruedOn, Money interest) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(balance != accruedOn) {
+            interest = balance.applyRate(interestRate, RoundingMode::HalfEven);
+        }
+        balance += interest;
+        record(TransactionType::Deposit, interest, DESC_INTEREST);
+        return interest;
+    }
+
+    Rate getInterestRate() const { return interestRate; }
+
+    // Withdraw method
+    TxnStatus tryWithdraw(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount <= Money()) {
+            return TxnStatus::InvalidAmount;
+        }
+        if(amount > balance) {
+            return TxnStatus::InsufficientFunds;
+        }
+        TxnStatus status = chargeLimits(amount);
+        if(status != TxnStatus::Ok) {
+            return status;
+        }
+        balance -= amount;
+        record(TransactionType::Withdrawal, amount, DESC_WITHDRAWAL);
+        return TxnStatus::Ok;
+    }
+
+    void withdraw(Money amount) { throwIfFailed(tryWithdraw(amount), "Withdrawal"); }
+
+    // Deposit method, recording the transaction
+    TxnStatus tryDeposit(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        TxnStatus status = creditBalance(amount);
+        if(status == TxnStatus::Ok) {
+            record(TransactionType::Deposit, amount, DESC_DEPOSIT);
+        }
+        return status;
+    }
+
+    void deposit(Money amount) { throwIfFailed(tryDeposit(amount), "Deposit"); }
+
+    // Debit leg of a transfer (see Bank::tryTransfer); the amount is already checked. The
+    // transfer's ID comes from nextTransferId(), called only once the debit is allowed.
+    template<typename NextTransferId>
+    TxnStatus debitTransfer(Money amount, NextTransferId nextTransferId) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount > balance) {
+            return TxnStatus::InsufficientFunds;
+        }
+        TxnStatus status = chargeLimits(amount);
+        if(status != TxnStatus::Ok) {
+            return status;
+        }
+        balance -= amount;
+        record(TransactionType::Transfer, -amount, DESC_TRANSFER_OUT, Money(), nextTransferId());
+        return TxnStatus::Ok;
+    }
+
+    // Credit leg of transfer transferId, or with DESC_TRANSFER_REVERSAL the leg undoing its debit
+    void creditTransfer(Money amount, uint64_t transferId, uint32_t descriptionId = DESC_TRANSFER_IN) {
+        lock_guard<recursive_mutex> lock(mtx);
+        balance += amount;
+        record(TransactionType::Transfer, amount, descriptionId, Money(), transferId);
+    }
+
+    // Display account details
+    void display() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        printDetails(accountNumber, accountHolder, balance, interestRate);
+    }
+
+    static void printDetails(string_view number, string_view holder, Money balance, Rate rate) {
+        Account::printDetails(number, holder, balance);
+        cout << "Account Type: Savings\n"
+             << "Interest Rate: " << rate.toPercentString() << "%\n";
+    }
+
+    // Display transaction history
+    void displayHistory() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        cout << "Transaction History for Savings Account " << accountNumber << ":\n";
+        transactions.forEach([](const Transaction& txn) {
+            const char* typeStr;
+            switch(txn.type) {
+                case TransactionType::Deposit: typeStr = "Deposit"; break;
+                case TransactionType::Withdrawal: typeStr = "Withdrawal"; break;
+                case TransactionType::Transfer: typeStr = "Transfer"; break;
+                case TransactionType::Loan: typeStr = "Loan"; break;
+                default: typeStr = "Unknown"; break;
+            }
+            cout << txn.isoTime() << " - " << typeStr << " of $" << txn.amount 
+                 << " - " << txn.description();
+            if(txn.transferId) {
+                cout << " #" << txn.transferId;
+            }
+            cout << "\n";
+        });
+    }
+};
+
+// CheckingAccount Derived Class
+class CheckingAccount final : public Account {
+private:
+    Money overdraftLimit;
+
+public:
+    static constexpr AccountKind KIND = AccountKind::Checking;
+
+    CheckingAccount(const string& accNum, const string& holder, Money initialBalance, Money overdraft,
+                    pmr::memory_resource* memory = pmr::get_default_resource())
+        : Account(KIND, accNum, holder, initialBalance, memory), overdraftLimit(overdraft) {}
+
+    Money getOverdraftLimit() const { return overdraftLimit; }
+
+    // Withdraw method
+    TxnStatus tryWithdraw(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount <= Money()) {
+            return TxnStatus::InvalidAmount;
+        }
+        if(amount > balance + overdraftLimit) {
+            return TxnStatus::OverdraftExceeded;
+        }
+        TxnStatus status = chargeLimits(amount);
+        if(status != TxnStatus::Ok) {
+            return status;
+        }
+        balance -= amount;
+        record(TransactionType::Withdrawal, amount, DESC_WITHDRAWAL);
+        return TxnStatus::Ok;
+    }
+
+    void withdraw(Money amount) { throwIfFailed(tryWithdraw(amount), "Withdrawal"); }
+
+    // Deposit method, recording the transaction
+    TxnStatus tryDeposit(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        TxnStatus status = creditBalance(amount);
+        if(status == TxnStatus::Ok) {
+            record(TransactionType::Deposit, amount, DESC_DEPOSIT);
+        }
+        return status;
+    }
+
+    void deposit(Money amount) { throwIfFailed(tryDeposit(amount), "Deposit"); }
+
+    // Debit leg of a transfer (see Bank::tryTransfer); the amount is already checked. The
+    // transfer's ID comes from nextTransferId(), called only once the debit is allowed.
+    template<typename NextTransferId>
+    TxnStatus debitTransfer(Money amount, NextTransferId nextTransferId) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount > balance + overdraftLimit) {
+            return TxnStatus::OverdraftExceeded;
+        }
+        TxnStatus status = chargeLimits(amount);
+        if(status != TxnStatus::Ok) {
+            return status;
+        }
+        balance -= amount;
+        record(TransactionType::Transfer, -amount, DESC_TRANSFER_OUT, Money(), nextTransferId());
+        return TxnStatus::Ok;
+    }
+
+    // Credit leg of transfer transferId, or with DESC_TRANSFER_REVERSAL the leg undoing its debit
+    void creditTransfer(Money amount, uint64_t transferId, uint32_t descriptionId = DESC_TRANSFER_IN) {
+        lock_guard<recursive_mutex> lock(mtx);
+        balance += amount;
+        record(TransactionType::Transfer, amount, descriptionId, Money(), transferId);
+    }
+
+    // Display account details
+    void display() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        printDetails(accountNumber, accountHolder, balance, overdraftLimit);
+    }
+
+    static void printDetails(string_view number, string_view holder, Money balance, Money overdraft) {
+        Account::printDetails(number, holder, balance);
+        cout << "Account Type: Checking\n"
+             << "Overdraft Limit: $" << overdraft << "\n";
+    }
+
+    // Display transaction history
+    void displayHistory() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        cout << "Transaction History for Checking Account " << accountNumber << ":\n";
+        transactions.forEach([](const Transaction& txn) {
+            const char* typeStr;
+            switch(txn.type) {
+                case TransactionType::Deposit: typeStr = "Deposit"; break;
+                case TransactionType::Withdrawal: typeStr = "Withdrawal"; break;
+                case TransactionType::Transfer: typeStr = "Transfer"; break;
+                case TransactionType::Loan: typeStr = "Loan"; break;
+                default: typeStr = "Unknown"; break;
+            }
+            cout << txn.isoTime() << " - " << typeStr << " of $" << txn.amount 
+                 << " - " << txn.description();
+            if(txn.transferId) {
+                cout << " #" << txn.transferId;
+            }
+            cout << "\n";
+        });
+    }
+};
+
+// LoanAccount Derived Class
+class LoanAccount final : public Account {
+private:
+    Money loanAmount;
+    Rate interestRate;
+    Money monthlyPayment;
+
+public:
+    // Monthly payment as a share of the outstanding loan (1%)
+    static constexpr Rate MONTHLY_PAYMENT_RATE = Rate::fromMicros(10000);
+    static constexpr AccountKind KIND = AccountKind::Loan;
+
+    LoanAccount(const string& accNum, const string& holder, Money loanAmt, Rate rate,
+                pmr::memory_resource* memory = pmr::get_default_resource())
+        : Account(KIND, accNum, holder, Money(), memory), loanAmount(loanAmt), interestRate(rate) {}
+
+    // Apply interest and calculate monthly payment
+    void processMonthlyPayment() {
+        metered(MetricOp::LoanPayment, KIND, [&] {
+            lock_guard<recursive_mutex> lock(mtx);
+            Money interest = loanAmount.applyRate(interestRate, RoundingMode::HalfEven);
+            loanAmount += interest;
+            monthlyPayment = loanAmount.applyRate(MONTHLY_PAYMENT_RATE, RoundingMode::HalfUp);
+            balance -= monthlyPayment;
+            record(TransactionType::Loan, monthlyPayment, DESC_LOAN_PAYMENT, interest);
+        });
+    }
+
+    // Post a monthly payment computed in bulk on accruedOn; recomputed if the loan has moved since
+    Money postMonthlyPayment(Money accruedOn, Money interest, Money payment) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(loanAmount != accruedOn) {
+            interest = loanAmount.applyRate(interestRate, RoundingMode::HalfEven);
+            payment = (loanAmount + interest).applyRate(MONTHLY_PAYMENT_RATE, RoundingMode::HalfUp);
+        }
+        loanAmount += interest;
+        monthlyPayment = payment;
+        balance -= monthlyPayment;
+        record(TransactionType::Loan, monthlyPayment, DESC_LOAN_PAYMENT, interest);
+        return interest;
+    }
+
+    State getState() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        return {balance, loanAmount, monthlyPayment};
+    }
+
+    void restoreState(const State& state) {
+        lock_guard<recursive_mutex> lock(mtx);
+        balance = state.balance;
+        loanAmount = state.principal;
+        monthlyPayment = state.payment;
+    }
+
+    Money getLoanAmount() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        return loanAmount;
+    }
+
+    Rate getInterestRate() const { return interestRate; }
+
+    // Deposit handles loan repayment
+    TxnStatus tryDeposit(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount <= Money()) {
+            return TxnStatus::InvalidAmount;
+        }
+        loanAmount -= amount;
+        balance += amount;
+        record(TransactionType::Deposit, amount, DESC_LOAN_REPAYMENT, -amount);
+        return TxnStatus::Ok;
+    }
+
+    void deposit(Money amount) { throwIfFailed(tryDeposit(amount), "Repayment"); }
+
+    // Withdraw (not applicable for loans)
+    TxnStatus tryWithdraw(Money) {
+        return TxnStatus::NotPermitted;
+    }
+
+    // Loans cannot be the source of a transfer
+    template<typename NextTransferId>
+    TxnStatus debitTransfer(Money, NextTransferId) {
+        return TxnStatus::NotPermitted;
+    }
+
+    // A transfer into a loan repays it
+    void creditTransfer(Money amount, uint64_t transferId, uint32_t descriptionId = DESC_TRANSFER_IN) {
+        lock_guard<recursive_mutex> lock(mtx);
+        loanAmount -= amount;
+        balance += amount;
+        record(TransactionType::Transfer, amount, descriptionId, -amount, transferId);
+    }
+
+    void withdraw(Money amount) { throwIfFailed(tryWithdraw(amount), "Withdrawal"); }
+
+    // Display account details
+    void display() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        printDetails(accountNumber, accountHolder, loanAmount, interestRate, monthlyPayment);
+    }
+
+    static void printDetails(string_view number, string_view holder, Money principal, Rate rate, Money payment) {
+        cout << "Loan Account Number: " << number << "\n"
+             << "Loan Holder: " << holder << "\n"
+             << "Loan Amount: $" << principal << "\n"
+             << "Interest Rate: " << rate.toPercentString() << "%\n"
+             << "Monthly Payment: $" << payment << "\n";
+    }
+
+    // Display transaction history
+    void displayHistory() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        cout << "Transaction History for Loan Account " << accountNumber << ":\n";
+        transactions.forEach([](const Transaction& txn) {
+            const char* typeStr;
+            switch(txn.type) {
+                case TransactionType::Deposit: typeStr = "Repayment"; break;
+                case TransactionType::Loan: typeStr = "Loan Payment"; break;
+                case TransactionType::Transfer: typeStr = "Transfer"; break;
+                default: typeStr = "Unknown"; break;
+            }
+            cout << txn.isoTime() << " - " << typeStr << " of $" << txn.amount 
+                 << " - " << txn.description();
+            if(txn.transferId) {
+                cout << " #" << txn.transferId;
+            }
+            cout << "\n";
+        });
+    }
+};
+
+// Call visit with the account as its concrete type. A switch on the kind tag rather than a
+// vtable, so each branch is a direct call the compiler can inline.
+template<typename Visitor>
+decltype(auto) visitAccount(Account& account, Visitor&& visit) {
+    switch(account.getKind()) {
+        case AccountKind::Savings:
+            return visit(static_cast<SavingsAccount&>(account));
+        case AccountKind::Checking:
+            return visit(static_cast<CheckingAccount&>(account));
+        default:
+            return visit(static_cast<LoanAccount&>(account));
+    }
+}
+
+template<typename Visitor>
+decltype(auto) visitAccount(const Account& account, Visitor&& visit) {
+    switch(account.getKind()) {
+        case AccountKind::Savings:
+            return visit(static_cast<const SavingsAccount&>(account));
+        case AccountKind::Checking:
+            return visit(static_cast<const CheckingAccount&>(account));
+        default:
+            return visit(static_cast<const LoanAccount&>(account));
+    }
+}
+
+// Checked downcast through the kind tag; nullptr if the account is of another type
+template<typename T>
+T* accountAs(Account* account) {
+    return account && account->getKind() == T::KIND ? static_cast<T*>(account) : nullptr;
+}
+
+inline TxnStatus Account::tryDeposit(Money amount) {
+    return metered(MetricOp::Deposit, kind, [&] {
+        return visitAccount(*this, [&](auto& account) { return account.tryDeposit(amount); });
+    });
+}
+
+inline TxnStatus Account::tryWithdraw(Money amount) {
+    return metered(MetricOp::Withdraw, kind, [&] {
+        return visitAccount(*this, [&](auto& account) { return account.tryWithdraw(amount); });
+    });
+}
+
+inline void Account::deposit(Money amount) {
+    throwIfFailed(tryDeposit(amount), kind == AccountKind::Loan ? "Repayment" : "Deposit");
+}
+
+inline void Account::withdraw(Money amount) {
+    throwIfFailed(tryWithdraw(amount), "Withdrawal");
+}
+
+inline void Account::display() const {
+    visitAccount(*this, [](const auto& account) { account.display(); });
+}
+
+inline void Account::displayHistory() const {
+    visitAccount(*this, [](const auto& account) { account.displayHistory(); });
+}
+
+inline Account::State Account::getState() const {
+    if(kind == AccountKind::Loan) {
+        return static_cast<const LoanAccount&>(*this).getState();
+    }
+    lock_guard<recursive_mutex> lock(mtx);
+    return {balance, Money(), Money()};
+}
+
+inline void Account::restoreState(const State& state) {
+    if(kind == AccountKind::Loan) {
+        static_cast<LoanAccount&>(*this).restoreState(state);
+        return;
+    }
+    lock_guard<recursive_mutex> lock(mtx);
+    balance = state.balance;
+}
+
+// Password hashing.
+// Passwords are never stored. Each customer keeps a salted PBKDF2-HMAC-SHA256 hash written
+// as "pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>", and that text is what the customer
+// records, snapshots and write-ahead log hold where the password used to be.
+
+// SHA-256 (FIPS 180-4)
+class Sha256 {
+public:
+    using Digest = array<uint8_t, 32>;
+
+    static constexpr uint32_t INITIAL[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    Sha256() : total(0) {
+        copy(begin(INITIAL), end(INITIAL), state);
+    }
+
+    // Resume from a state that has already absorbed absorbed bytes (a whole number of blocks)
+    Sha256(const uint32_t (&start)[8], uint64_t absorbed) : total(absorbed) {
+        copy(begin(start), end(start), state);
+    }
+
+    void update(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        size_t used = total % 64;
+        total += length;
+        if(used) {
+            size_t take = min(length, 64 - used);
+            memcpy(buffer + used, bytes, take);
+            bytes += take;
+            length -= take;
+            if(used + take < 64) {
+                return;
+            }
+            compress(state, buffer);
+        }
+        for(; length >= 64; bytes += 64, length -= 64) {
+            compress(state, bytes);
+        }
+        if(length) {
+            memcpy(buffer, bytes, length);
+        }
+    }
+
+    Digest finish() {
+        uint64_t bits = total * 8;
+        uint8_t padding[72] = {0x80};
+        size_t padLength = (total % 64 < 56 ? 56 : 120) - total % 64;
+        for(int i = 0; i < 8; ++i) {
+            padding[padLength + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(padding, padLength + 8);
+        Digest digest;
+        for(int i = 0; i < 8; ++i) {
+            for(int b = 0; b < 4; ++b) {
+                digest[4 * i + b] = static_cast<uint8_t>(state[i] >> (24 - 8 * b));
+            }
+        }
+        return digest;
+    }
+
+    // One 64-byte block
+    static void compress(uint32_t (&state)[8], const uint8_t* block) {
+        uint32_t words[16];
+        for(int i = 0; i < 16; ++i) {
+            words[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 |
+                       uint32_t(block[4 * i + 2]) << 8 | uint32_t(block[4 * i + 3]);
+        }
+        compressWords(state, words);
+    }
+
+    // One block already split into big-endian words
+    static void compressWords(uint32_t (&state)[8], const uint32_t* message) {
+        static constexpr uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+        uint32_t w[64];
+        copy(message, message + 16, w);
+        for(int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+private:
+    uint32_t state[8];
+    uint8_t buffer[64];
+    uint64_t total;
+};
+
+// HMAC-SHA256. The key's inner and outer pads are absorbed once, so signing a 32-byte
+// message (as each PBKDF2 round does) costs two compressions.
+class HmacSha256 {
+private:
+    uint32_t inner[8];
+    uint32_t outer[8];
+
+public:
+    HmacSha256(const void* key, size_t length) {
+        uint8_t block[64] = {};
+        if(length > 64) {
+            Sha256 hash;
+            hash.update(key, length);
+            Sha256::Digest digest = hash.finish();
+            memcpy(block, digest.data(), digest.size());
+        }
+        else if(length) {
+            memcpy(block, key, length);
+        }
+        uint8_t pad[64];
+        for(int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x36;
+        }
+        copy(begin(Sha256::INITIAL), end(Sha256::INITIAL), inner);
+        Sha256::compress(inner, pad);
+        for(int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        copy(begin(Sha256::INITIAL), end(Sha256::INITIAL), outer);
+        Sha256::compress(outer, pad);
+    }
+
+    Sha256::Digest sign(const void* data, size_t length) const {
+        Sha256 innerHash(inner, 64);
+        innerHash.update(data, length);
+        Sha256::Digest digest = innerHash.finish();
+        Sha256 outerHash(outer, 64);
+        outerHash.update(digest.data(), digest.size());
+        return outerHash.finish();
+    }
+
+    // Sign a 32-byte message held as big-endian words, giving the MAC in the same form
+    void signWords(const uint32_t* message, uint32_t* mac) const {
+        // Message, then padding and the bit length of pad block plus message (768)
+        uint32_t block[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0x80000000, 0, 0, 0, 0, 0, 0, 768};
+        copy(message, message + 8, block);
+        uint32_t state[8];
+        copy(begin(inner), end(inner), state);
+        Sha256::compressWords(state, block);
+        copy(begin(state), end(state), block);
+        copy(begin(outer), end(outer), state);
+        Sha256::compressWords(state, block);
+        copy(begin(state), end(state), mac);
+    }
+};
+
+// Compare two byte strings in time that depends only on their length
+bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t length) {
+    volatile uint8_t difference = 0;
+    for(size_t i = 0; i < length; ++i) {
+        difference = difference | (a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
+
+// Salted, iterated password hashes in their stored text form
+class PasswordHash {
+public:
+    static constexpr uint32_t DEFAULT_ITERATIONS = 20000;
+    static constexpr size_t SALT_BYTES = 16;
+
+    // Hash password under a fresh random salt
+    static string create(string_view password, uint32_t iterations = DEFAULT_ITERATIONS) {
+        if(iterations == 0) {
+            throw invalid_argument("Password hashing needs at least one iteration.");
+        }
+        Parsed hash;
+        hash.iterations = iterations;
+        random_device device;
+        for(size_t i = 0; i < SALT_BYTES; i += 4) {
+            uint32_t bits = device();
+            memcpy(hash.salt + i, &bits, 4);
+        }
+        hash.digest = derive(password, hash.salt, iterations);
+        string text(PREFIX);
+        text += to_string(iterations);
+        text += '$';
+        appendHex(text, hash.salt, SALT_BYTES);
+        text += '$';
+        appendHex(text, hash.digest.data(), hash.digest.size());
+        return text;
+    }
+
+    // Whether text is a stored hash, as opposed to a plain-text password from an older snapshot or log
+    static bool isEncoded(string_view text) {
+        Parsed hash;
+        return parse(text, hash);
+    }
+
+    // Check password against a stored hash. The work and the comparison take the same time
+    // whether or not the password matches.
+    static bool verify(string_view encoded, string_view password) {
+        Parsed hash;
+        if(!parse(encoded, hash)) {
+            return false;
+        }
+        Sha256::Digest digest = derive(password, hash.salt, hash.iterations);
+        return constantTimeEqual(digest.data(), hash.digest.data(), digest.size());
+    }
+
+private:
+    static constexpr string_view PREFIX = "pbkdf2-sha256$";
+
+    struct Parsed {
+        uint32_t iterations;
+        uint8_t salt[SALT_BYTES];
+        Sha256::Digest digest;
+    };
+
+    // PBKDF2 (RFC 8018) with a single 32-byte output block
+    static Sha256::Digest derive(string_view password, const uint8_t* salt, uint32_t iterations) {
+        HmacSha256 hmac(password.data(), password.size());
+        uint8_t first[SALT_BYTES + 4] = {};
+        memcpy(first, salt, SALT_BYTES);
+        first[SALT_BYTES + 3] = 1;
+        Sha256::Digest u = hmac.sign(first, sizeof(first));
+        uint32_t words[8], sum[8];
+        for(int i = 0; i < 8; ++i) {
+            words[i] = uint32_t(u[4 * i]) << 24 | uint32_t(u[4 * i + 1]) << 16 | uint32_t(u[4 * i + 2]) << 8 | u[4 * i + 3];
+            sum[i] = words[i];
+        }
+        for(uint32_t round = 1; round < iterations; ++round) {
+            hmac.signWords(words, words);
+            for(int i = 0; i < 8; ++i) {
+                sum[i] ^= words[i];
+            }
+        }
+        Sha256::Digest digest;
+        for(int i = 0; i < 8; ++i) {
+            for(int b = 0; b < 4; ++b) {
+                digest[4 * i + b] = static_cast<uint8_t>(sum[i] >> (24 - 8 * b));
+            }
+        }
+        return digest;
+    }
+
+    static void appendHex(string& out, const uint8_t* bytes, size_t length) {
+        static const char DIGITS[] = "0123456789abcdef";
+        for(size_t i = 0; i < length; ++i) {
+            out += DIGITS[bytes[i] >> 4];
+            out += DIGITS[bytes[i] & 15];
+        }
+    }
+
+    static bool parseHex(string_view text, uint8_t* bytes) {
+        auto nibble = [](char c) {
+            return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        };
+        for(size_t i = 0; i < text.size() / 2; ++i) {
+            int high = nibble(text[2 * i]), low = nibble(text[2 * i + 1]);
+            if(high < 0 || low < 0) {
+                return false;
+            }
+            bytes[i] = static_cast<uint8_t>(high << 4 | low);
+        }
+        return true;
+    }
+
+    static bool parse(string_view text, Parsed& hash) {
+        if(text.substr(0, PREFIX.size()) != PREFIX) {
+            return false;
+        }
+        text.remove_prefix(PREFIX.size());
+        size_t dollar = text.find('$');
+        if(dollar == string_view::npos) {
+            return false;
+        }
+        auto [end, error] = from_chars(text.data(), text.data() + dollar, hash.iterations);
+        if(error != errc() || end != text.data() + dollar || hash.iterations == 0) {
+            return false;
+        }
+        text.remove_prefix(dollar + 1);
+        if(text.size() != 2 * SALT_BYTES + 1 + 2 * hash.digest.size() || text[2 * SALT_BYTES] != '$') {
+            return false;
+        }
+        return parseHex(text.substr(0, 2 * SALT_BYTES), hash.salt) &&
+               parseHex(text.substr(2 * SALT_BYTES + 1), hash.digest.data());
+    }
+};
+
+// Customer Class
+class Customer {
+private:
+    pmr::string username;
+    pmr::string credential; // PasswordHash text, never the password itself
+    pmr::string name;
+    pmr::string email;
+    // Owned by the Bank that opened them
+    pmr::vector<Account*> accounts;
+    CustomerTotals totals;
+    // Windows of the Bank's customer limit rules, counting debits from all of these accounts
+    CustomerLimits limits;
+
+public:
+    // cred is the stored hash of the password (see PasswordHash::create)
+    Customer(const string& uname, const string& cred, const string& nm, const string& mail,
+             pmr::memory_resource* memory = pmr::get_default_resource())
+        : username(uname, memory), credential(cred, memory), name(nm, memory), email(mail, memory), accounts(memory) {}
+
+    Customer(const Customer&) = delete;
+    Customer& operator=(const Customer&) = delete;
+
+    // Check a password against the stored hash
+    bool authenticate(string_view pwd) const {
+        return PasswordHash::verify(credential, pwd);
+    }
+
+    // Getter methods
+    string_view getUsername() const { return username; }
+    string_view getCredential() const { return credential; }
+    string_view getName() const { return name; }
+    string_view getEmail() const { return email; }
+
+    // Add account, counting it in the customer's totals
+    void addAccount(Account* account) {
+        accounts.push_back(account);
+        Account::State state = account->getState();
+        account->setOwnerTotals(&totals);
+        totals.add(BookTotals::of(account->getKind(), state.balance, state.principal));
+    }
+
+    CustomerLimits& getLimits() { return limits; }
+
+    // Running totals of the customer's accounts
+    CustomerTotals& getTotals() { return totals; }
+    const CustomerTotals& getTotals() const { return totals; }
+
+    // Get accounts (by reference, so lookups do not copy the vector)
+    const pmr::vector<Account*>& getAccounts() const {
+        return accounts;
+    }
+
+    // Display customer details
+    void displayCustomer() const {
+        printDetails(name, email, username);
+    }
+
+    static void printDetails(string_view nm, string_view mail, string_view uname) {
+        cout << "Customer Name: " << nm << "\n"
+             << "Email: " << mail << "\n"
+             << "Username: " << uname << "\n";
+    }
+};
+
+// Bounded LRU cache of recent successful logins, so a customer who logs in again skips the
+// key stretching. An entry holds a keyed digest of the username and password, never the
+// password, under a key drawn at startup; it expires after LIFETIME. Stored hashes never
+// change once set, so an entry stays valid for its lifetime. Usernames are spread over
+// SHARDS independently locked LRU lists.
+class SessionCache {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 16384;
+    static constexpr size_t SHARDS = 16;
+    static constexpr int64_t LIFETIME = 15 * 60 * MICROS_PER_SECOND;
+
+private:
+    struct Entry {
+        string username;
+        Sha256::Digest proof;
+        Customer* customer;
+        int64_t expires;
+    };
+
+    struct alignas(64) Shard {
+        mutex mtx;
+        list<Entry> entries; // most recently used first
+        unordered_map<string_view, list<Entry>::iterator> index;
+        size_t capacity = DEFAULT_CAPACITY / SHARDS;
+
+        void trim() {
+            while(entries.size() > capacity) {
+                index.erase(entries.back().username);
+                entries.pop_back();
+            }
+        }
+    };
+
+    HmacSha256 hmac;
+    array<Shard, SHARDS> shards;
+
+    static array<uint8_t, 32> randomKey() {
+        array<uint8_t, 32> key;
+        random_device device;
+        for(size_t i = 0; i < key.size(); i += 4) {
+            uint32_t bits = device();
+            memcpy(key.data() + i, &bits, 4);
+        }
+        return key;
+    }
+
+    Sha256::Digest prove(string_view uname, string_view pwd) const {
+        thread_local string message;
+        message.assign(uname);
+        message += '\0';
+        message += pwd;
+        return hmac.sign(message.data(), message.size());
+    }
+
+    Shard& shardFor(string_view uname) {
+        return shards[hash<string_view>()(uname) % SHARDS];
+    }
+
+public:
+    SessionCache() : hmac(randomKey().data(), 32) {}
+
+    // The customer if uname logged in with pwd within the lifetime, else nullptr
+    Customer* find(string_view uname, string_view pwd) {
+        Sha256::Digest proof = prove(uname, pwd);
+        Shard& shard = shardFor(uname);
+        lock_guard<mutex> lock(shard.mtx);
+        auto it = shard.index.find(uname);
+        if(it == shard.index.end()) {
+            return nullptr;
+        }
+        Entry& entry = *it->second;
+        if(entry.expires <= TimestampClock::now()) {
+            shard.entries.erase(it->second);
+            shard.index.erase(it);
+            return nullptr;
+        }
+        if(!constantTimeEqual(entry.proof.data(), proof.data(), proof.size())) {
+            return nullptr;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return entry.customer;
+    }
+
+    // Record a login that has just been verified, evicting the shard's least recently used entry if full
+    void remember(string_view uname, string_view pwd, Customer* customer) {
+        Sha256::Digest proof = prove(uname, pwd);
+        int64_t expires = TimestampClock::now() + LIFETIME;
+        Shard& shard = shardFor(uname);
+        lock_guard<mutex> lock(shard.mtx);
+        if(shard.capacity == 0) {
+            return;
+        }
+        auto it = shard.index.find(uname);
+        if(it != shard.index.end()) {
+            it->second->proof = proof;
+            it->second->expires = expires;
+            shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+            return;
+        }
+        shard.entries.push_front({string(uname), proof, customer, expires});
+        shard.index.emplace(shard.entries.front().username, shard.entries.begin());
+        shard.trim();
+    }
+
+    // Change the bound (rounded up to a multiple of SHARDS); 0 turns the cache off
+    void setCapacity(size_t capacity) {
+        for(Shard& shard : shards) {
+            lock_guard<mutex> lock(shard.mtx);
+            shard.capacity = (capacity + SHARDS - 1) / SHARDS;
+            shard.trim();
+        }
+    }
+};
+
+// Month-end accrual kernels.
+// These compute amount * rate / Rate::SCALE with the same rounding as Money::applyRate,
+// but over plain int64 columns and without 128-bit math. The loops are scalar: the
+// compiler turns the divisions by the constant Rate::SCALE into multiplications, and
+// 64-bit SIMD lanes have no multiply-high to do the same. The amount is split around
+// Rate::SCALE so no product overflows for rates up to 100%.
+inline int64_t accrueOne(int64_t amount, int64_t rateMicros, RoundingMode mode) {
+    int64_t sign = amount < 0 ? -1 : 1;
+    int64_t magnitude = amount * sign;
+    int64_t low = (magnitude % Rate::SCALE) * rateMicros;
+    int64_t quotient = (magnitude / Rate::SCALE) * rateMicros + low / Rate::SCALE;
+    int64_t twiceRemainder = 2 * (low % Rate::SCALE);
+    int64_t roundUp = mode == RoundingMode::Down ? 0 :
+        (twiceRemainder > Rate::SCALE) |
+        ((twiceRemainder == Rate::SCALE) & (mode == RoundingMode::HalfUp || (quotient & 1)));
+    return sign * (quotient + roundUp);
+}
+
+// Per-row rates: out[i] = amounts[i] * rates[i]
+void accrueColumn(const int64_t* __restrict amounts, const int64_t* __restrict rates,
+                  int64_t* __restrict out, size_t count, RoundingMode mode) {
+    for(size_t i = 0; i < count; ++i) {
+        out[i] = accrueOne(amounts[i], rates[i], mode);
+    }
+}
+
+// One rate for the whole column: out[i] = amounts[i] * rate
+void accrueColumn(const int64_t* __restrict amounts, int64_t rateMicros,
+                  int64_t* __restrict out, size_t count, RoundingMode mode) {
+    for(size_t i = 0; i < count; ++i) {
+        out[i] = accrueOne(amounts[i], rateMicros, mode);
+    }
+}
+
+// Process-wide pool of worker threads for batch jobs.
+// Threads are started the first time a run needs them and then wait for the next run, so
+// month-end and scheduler batches do not start and join threads every time. One run uses
+// the pool at a time; a run that finds it busy, or that starts on a pool thread, runs its
+// tasks on the calling thread instead.
+class WorkerPool {
+private:
+    mutex mtx;
+    mutex runMutex; // held for the length of a run
+    condition_variable wake;
+    condition_variable finished;
+    size_t started = 0; // pool threads running
+    const function<void(unsigned)>* job = nullptr;
+    unsigned jobTasks = 0;
+    atomic<unsigned> nextTask{0};
+    unsigned pendingTasks = 0;
+    unsigned activeWorkers = 0; // pool threads inside the current run
+    uint64_t generation = 0;
+    exception_ptr failure;
+
+    static bool& onWorker() {
+        thread_local bool worker = false;
+        return worker;
+    }
+
+    // Claim and run tasks of the current job until none are left
+    void work(const function<void(unsigned)>& task, unsigned tasks) {
+        for(unsigned i; (i = nextTask.fetch_add(1)) < tasks;) {
+            exception_ptr error;
+            try {
+                task(i);
+            }
+            catch(...) {
+                error = current_exception();
+            }
+            lock_guard<mutex> lock(mtx);
+            if(error && !failure) {
+                failure = error;
+            }
+            if(--pendingTasks == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+
+    void workLoop() {
+        onWorker() = true;
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(mtx);
+        for(;;) {
+            wake.wait(lock, [&]() { return generation != seen; });
+            seen = generation;
+            if(!job) {
+                continue;
+            }
+            const function<void(unsigned)>& task = *job;
+            unsigned tasks = jobTasks;
+            ++activeWorkers;
+            lock.unlock();
+            work(task, tasks);
+            lock.lock();
+            if(--activeWorkers == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+
+    WorkerPool() = default;
+
+public:
+    // Never destroyed: its threads stay parked until the process exits
+    static WorkerPool& instance() {
+        static WorkerPool* pool = new WorkerPool();
+        return *pool;
+    }
+
+    // Run task(0) .. task(count - 1) on up to count threads, the caller's included, and
+    // return when all have finished; rethrows the first exception a task threw
+    void run(unsigned count, const function<void(unsigned)>& task) {
+        unique_lock<mutex> busy(runMutex, try_to_lock);
+        if(count <= 1 || onWorker() || !busy.owns_lock()) {
+            for(unsigned i = 0; i < count; ++i) {
+                task(i);
+            }
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            for(; started < count - 1; ++started) {
+                thread(&WorkerPool::workLoop, this).detach();
+            }
+            job = &task;
+            jobTasks = count;
+            nextTask = 0;
+            pendingTasks = count;
+            failure = nullptr;
+            ++generation;
+        }
+        wake.notify_all();
+        work(task, count);
+        unique_lock<mutex> lock(mtx);
+        finished.wait(lock, [this]() { return pendingTasks == 0 && activeWorkers == 0; });
+        job = nullptr;
+        if(failure) {
+            rethrow_exception(exchange(failure, nullptr));
+        }
+    }
+};
+
+// Split [0, count) into contiguous ranges of at least minimumChunk items and run them on the
+// worker pool
+template<typename Body>
+void parallelFor(size_t count, unsigned threads, Body body, size_t minimumChunk = 4096) {
+    threads = static_cast<unsigned>(min<size_t>(max(1u, threads), (count + minimumChunk - 1) / minimumChunk));
+    if(threads <= 1) {
+        body(size_t(0), count);
+        return;
+    }
+    size_t chunk = (count + threads - 1) / threads;
+    unsigned tasks = static_cast<unsigned>((count + chunk - 1) / chunk);
+    WorkerPool::instance().run(tasks, [&](unsigned t) {
+        size_t begin = t * chunk;
+        body(begin, min(count, begin + chunk));
+    });
+}
+
+// FNV-1a checksum, used to detect torn or corrupt log records and snapshots
+uint32_t checksum(const char* data, size_t size, uint32_t hash = 2166136261u) {
+    for(size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Flush a directory's entries, so files just created or renamed in it survive a crash
+void syncDirectory(const string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0) {
+        throw runtime_error("Cannot open directory " + dir);
+    }
+    int result = ::fsync(fd);
+    ::close(fd);
+    if(result != 0) {
+        throw runtime_error("Cannot sync directory " + dir + ": " + strerror(errno));
+    }
+}
+
+// Encoder for the binary log and snapshot formats (native byte order)
+class BinaryWriter {
+private:
+    string buffer;
+
+public:
+    void clear() { buffer.clear(); }
+    const string& data() const { return buffer; }
+
+    template<typename T>
+    void put(T value) {
+        static_assert(is_trivially_copyable<T>::value, "Only plain values can be written");
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void putString(string_view text) {
+        put<uint32_t>(static_cast<uint32_t>(text.size()));
+        buffer.append(text);
+    }
+};
+
+// Decoder matching BinaryWriter; throws on truncated input
+class BinaryReader {
+private:
+    const char* pos;
+    const char* end;
+
+public:
+    BinaryReader(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    template<typename T>
+    T get() {
+        if(static_cast<size_t>(end - pos) < sizeof(T)) {
+            throw runtime_error("Truncated data.");
+        }
+        T value;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    string getString() {
+        uint32_t size = get<uint32_t>();
+        if(static_cast<size_t>(end - pos) < size) {
+            throw runtime_error("Truncated data.");
+        }
+        string text(pos, size);
+        pos += size;
+        return text;
+    }
+
+    bool atEnd() const { return pos == end; }
+};
+
+// Kind-specific parameter: the interest rate in millionths, or the overdraft limit in cents
+int64_t accountParameter(const Account& account) {
+    switch(account.getKind()) {
+        case AccountKind::Savings:
+            return static_cast<const SavingsAccount&>(account).getInterestRate().getMicros();
+        case AccountKind::Checking:
+            return static_cast<const CheckingAccount&>(account).getOverdraftLimit().getCents();
+        case AccountKind::Loan:
+            return static_cast<const LoanAccount&>(account).getInterestRate().getMicros();
+    }
+    return 0;
+}
+
+// An account's identity and state as stored in the log and snapshots
+struct AccountImage {
+    AccountKind kind;
+    string accountNumber;
+    string accountHolder;
+    int64_t parameter;
+    Account::State state;
+    uint64_t logSequence;
+};
+
+// Write an account's identity, parameters and current state
+void encodeAccount(BinaryWriter& out, const Account& account) {
+    lock_guard<recursive_mutex> lock(account.getMutex());
+    out.put(account.getKind());
+    out.putString(account.getAccountNumber());
+    out.putString(account.getAccountHolder());
+    out.put(accountParameter(account));
+    Account::State state = account.getState();
+    out.put(state.balance.getCents());
+    out.put(state.principal.getCents());
+    out.put(state.payment.getCents());
+    out.put(account.getLogSequence());
+}
+
+// Read an account written by encodeAccount
+AccountImage decodeAccount(BinaryReader& in) {
+    AccountImage image;
+    image.kind = in.get<AccountKind>();
+    image.accountNumber = in.getString();
+    image.accountHolder = in.getString();
+    image.parameter = in.get<int64_t>();
+    image.state.balance = Money::fromCents(in.get<int64_t>());
+    image.state.principal = Money::fromCents(in.get<int64_t>());
+    image.state.payment = Money::fromCents(in.get<int64_t>());
+    image.logSequence = in.get<uint64_t>();
+    if(image.kind != AccountKind::Savings && image.kind != AccountKind::Checking && image.kind != AccountKind::Loan) {
+        throw runtime_error("Unknown account kind in data file.");
+    }
+    return image;
+}
+
+// Columns of a columnar (version 2 and later) snapshot
+enum class SnapshotColumn {
+    CustomerUsername,
+    CustomerCredential, // plain-text password before version 4
+    CustomerName,
+    CustomerEmail,
+    CustomerFirstAccount,
+    CustomerAccountCount,
+    AccountNumber,
+    AccountHolder,
+    AccountKinds,
+    AccountParameter,
+    AccountBalance,
+    AccountPrincipal,
+    AccountPayment,
+    AccountSequence,
+    AccountOwner,
+    AccountFirstTransaction,
+    AccountTransactionCount,
+    AccountSlots,
+    CustomerSlots,
+    Transactions,
+    Descriptions,
+    StringPool,
+    TransactionTransfers, // from version 5; kept last, so older headers simply lack it
+    Count
+};
+
+// Snapshots from version 2 on are columnar so they can be memory-mapped and queried in place.
+// The file is this header followed by 8-byte aligned columns: one array per customer and
+// account field, the transaction records, open-addressing hash indexes over account
+// numbers and usernames, the description table and one pool holding every string.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerChecksum; // of the header with this field zeroed
+    uint64_t fileSize;
+    uint64_t cutSequence;
+    uint64_t customerCount;
+    uint64_t accountCount;
+    uint64_t transactionCount;
+    uint64_t descriptionCount;
+    uint64_t accountSlots;   // power of two
+    uint64_t customerSlots;  // power of two
+    uint64_t columns[static_cast<size_t>(SnapshotColumn::Count)];
+    uint64_t lastTransferId; // from version 5
+    uint64_t stringPoolSize; // from version 6
+    uint64_t bodyChecksum;   // from version 6: bodyChecksum() over every column in order
+};
+
+// A string stored in the snapshot's string pool
+struct StringRef {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+// A journal record as stored in the snapshot
+struct SnapshotTransaction {
+    int64_t timestamp;
+    int64_t cents;
+    uint32_t descriptionId;
+    TransactionType type;
+    uint8_t reserved[3];
+};
+
+const char SNAPSHOT_MAGIC[8] = {'S', 'T', 'S', 'N', 'A', 'P', '\0', '\0'};
+const uint32_t SNAPSHOT_VERSION = 6;
+// Version 2 snapshots are read too; their timestamps are in seconds rather than microseconds
+const uint32_t SECONDS_SNAPSHOT_VERSION = 2;
+// Snapshots before this version hold plain-text passwords, which are hashed as they are loaded
+const uint32_t CREDENTIAL_SNAPSHOT_VERSION = 4;
+// Snapshots before this version have no transfer IDs, and a shorter header
+const uint32_t TRANSFER_SNAPSHOT_VERSION = 5;
+// Snapshots before this version have no body checksum, so only their layout can be checked
+const uint32_t CHECKSUMMED_SNAPSHOT_VERSION = 6;
+
+// Bytes of header in a snapshot of the given version
+size_t snapshotHeaderSize(uint32_t version) {
+    if(version >= CHECKSUMMED_SNAPSHOT_VERSION) {
+        return sizeof(SnapshotHeader);
+    }
+    if(version >= TRANSFER_SNAPSHOT_VERSION) {
+        return offsetof(SnapshotHeader, stringPoolSize);
+    }
+    return offsetof(SnapshotHeader, columns) + sizeof(uint64_t) * static_cast<size_t>(SnapshotColumn::TransactionTransfers);
+}
+
+// Checksum of a snapshot column, eight bytes at a time in four independent lanes so that
+// checking a large snapshot runs at close to memory speed
+uint64_t columnChecksum(const char* data, size_t size) {
+    const uint64_t PRIME = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = {size, PRIME, ~size, ~PRIME};
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        for(int l = 0; l < 4; ++l) {
+            uint64_t word;
+            memcpy(&word, data + i + 8 * l, sizeof(word));
+            lanes[l] = rotl((lanes[l] ^ word) * PRIME, 31);
+        }
+    }
+    uint64_t hash = lanes[0] ^ rotl(lanes[1], 16) ^ rotl(lanes[2], 32) ^ rotl(lanes[3], 48);
+    for(; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * PRIME;
+    }
+    return hash ^ (hash >> 29);
+}
+
+// Fold one column's checksum into a snapshot's body checksum
+uint64_t bodyChecksum(uint64_t body, uint64_t column) {
+    return rotl(body, 7) ^ column;
+}
+
+// FNV-1a 64-bit hash for the snapshot's hash indexes
+uint64_t hashString(string_view text) {
+    uint64_t hash = 14695981039346656037ull;
+    for(char c : text) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Accumulates columns in memory and writes them as a current-version snapshot
+class SnapshotBuilder {
+private:
+    vector<StringRef> usernames, credentials, names, emails;
+    vector<uint32_t> firstAccounts, accountCounts;
+    vector<StringRef> numbers, holders;
+    vector<AccountKind> kinds;
+    vector<int64_t> parameters, balances, principals, payments;
+    vector<uint64_t> sequences;
+    vector<uint32_t> owners;
+    vector<uint64_t> firstTransactions, transactionCounts;
+    vector<SnapshotTransaction> transactions;
+    vector<uint64_t> transferIds; // beside transactions, row for row
+    vector<StringRef> descriptions;
+    string pool;
+
+    StringRef addString(string_view text) {
+        StringRef ref{pool.size(), static_cast<uint32_t>(text.size()), 0};
+        pool.append(text);
+        return ref;
+    }
+
+    // Open-addressing table of row + 1 (0 marks an empty slot), at most half full
+    vector<uint32_t> buildIndex(const vector<StringRef>& keys) const {
+        uint64_t slots = 16;
+        while(slots < keys.size() * 2) {
+            slots *= 2;
+        }
+        vector<uint32_t> table(slots, 0);
+        for(size_t row = 0; row < keys.size(); ++row) {
+            uint64_t slot = hashString(string_view(pool.data() + keys[row].offset, keys[row].length)) & (slots - 1);
+            while(table[slot] != 0) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            table[slot] = static_cast<uint32_t>(row + 1);
+        }
+        return table;
+    }
+
+public:
+    void addDescription(string_view text) {
+        descriptions.push_back(addString(text));
+    }
+
+    void addCustomer(string_view uname, string_view cred, string_view nm, string_view mail) {
+        usernames.push_back(addString(uname));
+        credentials.push_back(addString(cred));
+        names.push_back(addString(nm));
+        emails.push_back(addString(mail));
+        firstAccounts.push_back(static_cast<uint32_t>(numbers.size()));
+        accountCounts.push_back(0);
+    }
+
+    // Add an account to the most recently added customer
+    void addAccount(AccountKind kind, string_view number, string_view holder, int64_t parameter,
+                    const Account::State& state, uint64_t sequence) {
+        numbers.push_back(addString(number));
+        holders.push_back(addString(holder));
+        kinds.push_back(kind);
+        parameters.push_back(parameter);
+        balances.push_back(state.balance.getCents());
+        principals.push_back(state.principal.getCents());
+        payments.push_back(state.payment.getCents());
+        sequences.push_back(sequence);
+        owners.push_back(static_cast<uint32_t>(usernames.size() - 1));
+        firstTransactions.push_back(transactions.size());
+        transactionCounts.push_back(0);
+        ++accountCounts.back();
+    }
+
+    // Add a journal record to the most recently added account
+    void addTransaction(const SnapshotTransaction& txn, uint64_t transferId) {
+        transactions.push_back(txn);
+        transferIds.push_back(transferId);
+        ++transactionCounts.back();
+    }
+
+    // Write the snapshot to path, atomically replacing any existing file
+    void write(const string& path, uint64_t cutSequence, uint64_t lastTransferId) const {
+        vector<uint32_t> accountIndex = buildIndex(numbers);
+        vector<uint32_t> customerIndex = buildIndex(usernames);
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.cutSequence = cutSequence;
+        header.customerCount = usernames.size();
+        header.accountCount = numbers.size();
+        header.transactionCount = transactions.size();
+        header.descriptionCount = descriptions.size();
+        header.accountSlots = accountIndex.size();
+        header.customerSlots = customerIndex.size();
+        header.lastTransferId = lastTransferId;
+
+        // Lay the columns out in enum order
+        vector<pair<const void*, size_t>> sections(static_cast<size_t>(SnapshotColumn::Count));
+        auto place = [&](SnapshotColumn column, const auto& values) {
+            sections[static_cast<size_t>(column)] = {values.data(), values.size() * sizeof(values[0])};
+        };
+        place(SnapshotColumn::CustomerUsername, usernames);
+        place(SnapshotColumn::CustomerCredential, credentials);
+        place(SnapshotColumn::CustomerName, names);
+        place(SnapshotColumn::CustomerEmail, emails);
+        place(SnapshotColumn::CustomerFirstAccount, firstAccounts);
+        place(SnapshotColumn::CustomerAccountCount, accountCounts);
+        place(SnapshotColumn::AccountNumber, numbers);
+        place(SnapshotColumn::AccountHolder, holders);
+        place(SnapshotColumn::AccountKinds, kinds);
+        place(SnapshotColumn::AccountParameter, parameters);
+        place(SnapshotColumn::AccountBalance, balances);
+        place(SnapshotColumn::AccountPrincipal, principals);
+        place(SnapshotColumn::AccountPayment, payments);
+        place(SnapshotColumn::AccountSequence, sequences);
+        place(SnapshotColumn::AccountOwner, owners);
+        place(SnapshotColumn::AccountFirstTransaction, firstTransactions);
+        place(SnapshotColumn::AccountTransactionCount, transactionCounts);
+        place(SnapshotColumn::AccountSlots, accountIndex);
+        place(SnapshotColumn::CustomerSlots, customerIndex);
+        place(SnapshotColumn::Transactions, transactions);
+        place(SnapshotColumn::Descriptions, descriptions);
+        place(SnapshotColumn::StringPool, pool);
+        place(SnapshotColumn::TransactionTransfers, transferIds);
+        uint64_t cursor = sizeof(SnapshotHeader);
+        for(size_t c = 0; c < sections.size(); ++c) {
+            cursor = (cursor + 7) & ~uint64_t(7);
+            header.columns[c] = cursor;
+            cursor += sections[c].second;
+        }
+        header.fileSize = cursor;
+        header.stringPoolSize = pool.size();
+        for(const auto& section : sections) {
+            header.bodyChecksum = bodyChecksum(header.bodyChecksum, columnChecksum(static_cast<const char*>(section.first), section.second));
+        }
+        header.headerChecksum = checksum(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            throw runtime_error("Cannot write snapshot " + temp);
+        }
+        uint64_t written = 0;
+        auto emit = [&](const void* data, size_t size) {
+            const char* bytes = static_cast<const char*>(data);
+            while(size > 0) {
+                ssize_t n = ::write(fd, bytes, size);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n < 0) {
+                    ::close(fd);
+                    throw runtime_error("Snapshot write failed.");
+                }
+                bytes += n;
+                size -= static_cast<size_t>(n);
+                written += static_cast<uint64_t>(n);
+            }
+        };
+        emit(&header, sizeof(header));
+        const char padding[8] = {};
+        for(size_t c = 0; c < sections.size(); ++c) {
+            emit(padding, header.columns[c] - written);
+            emit(sections[c].first, sections[c].second);
+        }
+        if(::fsync(fd) != 0) {
+            ::close(fd);
+            throw runtime_error("Snapshot write failed.");
+        }
+        ::close(fd);
+        filesystem::rename(temp, path);
+        syncDirectory(filesystem::path(path).parent_path().string());
+    }
+};
+
+// A columnar snapshot mapped read-only into memory.
+// Lookups and display read the columns in place; nothing is deserialised until an
+// account is materialised onto the heap to be changed.
+class MappedSnapshot {
+private:
+    const char* base = nullptr;
+    size_t size = 0;
+    SnapshotHeader header = {}; // copied, as older versions have a shorter one
+
+    MappedSnapshot() {}
+
+    template<typename T>
+    const T* column(SnapshotColumn c) const {
+        return reinterpret_cast<const T*>(base + header.columns[static_cast<size_t>(c)]);
+    }
+
+    // Probe a hash index for key; returns the row or -1
+    int64_t probe(SnapshotColumn slotColumn, uint64_t slots, SnapshotColumn keyColumn, string_view key) const {
+        const uint32_t* table = column<uint32_t>(slotColumn);
+        const StringRef* keys = column<StringRef>(keyColumn);
+        for(uint64_t slot = hashString(key) & (slots - 1); table[slot] != 0; slot = (slot + 1) & (slots - 1)) {
+            uint32_t row = table[slot] - 1;
+            if(text(keys[row]) == key) {
+                return row;
+            }
+        }
+        return -1;
+    }
+
+    // Whether every column lies inside the file and every string, row and index stored in
+    // them points inside its target, so that no later read can leave the mapping. From
+    // version 6 on the columns must also match the body checksum.
+    bool isIntact(size_t headerSize) const {
+        using C = SnapshotColumn;
+        const size_t COLUMNS = static_cast<size_t>(C::Count);
+        const SnapshotHeader& h = header;
+        for(uint64_t count : {h.customerCount, h.accountCount, h.transactionCount, h.descriptionCount, h.accountSlots, h.customerSlots}) {
+            if(count > size) {
+                return false;
+            }
+        }
+        auto validSlots = [](uint64_t slots, uint64_t rows) { return slots > rows && (slots & (slots - 1)) == 0; };
+        if(!validSlots(h.accountSlots, h.accountCount) || !validSlots(h.customerSlots, h.customerCount)) {
+            return false;
+        }
+        size_t columns = h.version >= TRANSFER_SNAPSHOT_VERSION ? COLUMNS : static_cast<size_t>(C::TransactionTransfers);
+        auto at = [&](C c) { return h.columns[static_cast<size_t>(c)]; };
+        uint64_t poolEnd = columns > static_cast<size_t>(C::StringPool) + 1 ? at(C::TransactionTransfers) : size;
+        if(at(C::StringPool) > poolEnd) {
+            return false;
+        }
+        uint64_t poolSize = h.version >= CHECKSUMMED_SNAPSHOT_VERSION ? h.stringPoolSize : poolEnd - at(C::StringPool);
+
+        uint64_t bytes[COLUMNS] = {};
+        for(C c : {C::CustomerUsername, C::CustomerCredential, C::CustomerName, C::CustomerEmail}) {
+            bytes[static_cast<size_t>(c)] = h.customerCount * sizeof(StringRef);
+        }
+        bytes[static_cast<size_t>(C::CustomerFirstAccount)] = h.customerCount * sizeof(uint32_t);
+        bytes[static_cast<size_t>(C::CustomerAccountCount)] = h.customerCount * sizeof(uint32_t);
+        bytes[static_cast<size_t>(C::AccountNumber)] = h.accountCount * sizeof(StringRef);
+        bytes[static_cast<size_t>(C::AccountHolder)] = h.accountCount * sizeof(StringRef);
+        bytes[static_cast<size_t>(C::AccountKinds)] = h.accountCount * sizeof(AccountKind);
+        for(C c : {C::AccountParameter, C::AccountBalance, C::AccountPrincipal, C::AccountPayment, C::AccountSequence,
+                   C::AccountFirstTransaction, C::AccountTransactionCount}) {
+            bytes[static_cast<size_t>(c)] = h.accountCount * sizeof(uint64_t);
+        }
+        bytes[static_cast<size_t>(C::AccountOwner)] = h.accountCount * sizeof(uint32_t);
+        bytes[static_cast<size_t>(C::AccountSlots)] = h.accountSlots * sizeof(uint32_t);
+        bytes[static_cast<size_t>(C::CustomerSlots)] = h.customerSlots * sizeof(uint32_t);
+        bytes[static_cast<size_t>(C::Transactions)] = h.transactionCount * sizeof(SnapshotTransaction);
+        bytes[static_cast<size_t>(C::Descriptions)] = h.descriptionCount * sizeof(StringRef);
+        bytes[static_cast<size_t>(C::StringPool)] = poolSize;
+        bytes[static_cast<size_t>(C::TransactionTransfers)] = h.transactionCount * sizeof(uint64_t);
+        uint64_t body = 0;
+        for(size_t c = 0; c < columns; ++c) {
+            if(h.columns[c] < headerSize || h.columns[c] % 8 != 0 || h.columns[c] > size || bytes[c] > size - h.columns[c]) {
+                return false;
+            }
+            if(h.version >= CHECKSUMMED_SNAPSHOT_VERSION) {
+                body = bodyChecksum(body, columnChecksum(base + h.columns[c], bytes[c]));
+            }
+        }
+        if(h.version >= CHECKSUMMED_SNAPSHOT_VERSION && body != h.bodyChecksum) {
+            return false;
+        }
+
+        auto stringsValid = [&](C c, uint64_t rows) {
+            const StringRef* refs = column<StringRef>(c);
+            for(uint64_t row = 0; row < rows; ++row) {
+                if(refs[row].offset > poolSize || refs[row].length > poolSize - refs[row].offset) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto slotsValid = [&](C c, uint64_t slots, uint64_t rows) {
+            const uint32_t* table = column<uint32_t>(c);
+            return all_of(table, table + slots, [&](uint32_t entry) { return entry <= rows; });
+        };
+        for(C c : {C::CustomerUsername, C::CustomerCredential, C::CustomerName, C::CustomerEmail}) {
+            if(!stringsValid(c, h.customerCount)) {
+                return false;
+            }
+        }
+        if(!stringsValid(C::AccountNumber, h.accountCount) || !stringsValid(C::AccountHolder, h.accountCount) ||
+           !stringsValid(C::Descriptions, h.descriptionCount) ||
+           !slotsValid(C::AccountSlots, h.accountSlots, h.accountCount) ||
+           !slotsValid(C::CustomerSlots, h.customerSlots, h.customerCount)) {
+            return false;
+        }
+        for(uint64_t row = 0; row < h.customerCount; ++row) {
+            if(firstAccount(row) > h.accountCount || accountsOf(row) > h.accountCount - firstAccount(row)) {
+                return false;
+            }
+        }
+        const uint64_t* firstTransactions = column<uint64_t>(C::AccountFirstTransaction);
+        const uint64_t* transactionCounts = column<uint64_t>(C::AccountTransactionCount);
+        for(uint64_t row = 0; row < h.accountCount; ++row) {
+            AccountKind k = kind(row);
+            if(owner(row) >= h.customerCount ||
+               (k != AccountKind::Savings && k != AccountKind::Checking && k != AccountKind::Loan) ||
+               firstTransactions[row] > h.transactionCount || transactionCounts[row] > h.transactionCount - firstTransactions[row]) {
+                return false;
+            }
+        }
+        const SnapshotTransaction* records = column<SnapshotTransaction>(C::Transactions);
+        return all_of(records, records + h.transactionCount,
+                      [&](const SnapshotTransaction& txn) { return txn.descriptionId < h.descriptionCount; });
+    }
+
+public:
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    ~MappedSnapshot() {
+        if(base) {
+            ::munmap(const_cast<char*>(base), size);
+        }
+    }
+
+    // Map path; returns nullptr if there is no file or it predates version 2
+    static unique_ptr<MappedSnapshot> open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return nullptr;
+        }
+        struct stat info;
+        if(::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < snapshotHeaderSize(SECONDS_SNAPSHOT_VERSION)) {
+            ::close(fd);
+            throw runtime_error("Snapshot is truncated: " + path);
+        }
+        void* addr = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(addr == MAP_FAILED) {
+            throw runtime_error("Cannot map snapshot " + path);
+        }
+        unique_ptr<MappedSnapshot> snapshot(new MappedSnapshot());
+        snapshot->base = static_cast<const char*>(addr);
+        snapshot->size = info.st_size;
+
+        const SnapshotHeader* stored = reinterpret_cast<const SnapshotHeader*>(addr);
+        if(memcmp(stored->magic, SNAPSHOT_MAGIC, sizeof(stored->magic)) != 0) {
+            throw runtime_error("Not a snapshot file: " + path);
+        }
+        if(stored->version < SECONDS_SNAPSHOT_VERSION) {
+            return nullptr;
+        }
+        size_t headerSize = snapshotHeaderSize(stored->version);
+        if(stored->version > SNAPSHOT_VERSION || snapshot->size < headerSize) {
+            throw runtime_error("Snapshot is corrupt or from a newer version: " + path);
+        }
+        SnapshotHeader& check = snapshot->header;
+        memcpy(&check, addr, headerSize);
+        uint32_t storedChecksum = check.headerChecksum;
+        check.headerChecksum = 0;
+        if(checksum(reinterpret_cast<const char*>(&check), headerSize) != storedChecksum || check.fileSize != snapshot->size) {
+            throw runtime_error("Snapshot is corrupt or from a newer version: " + path);
+        }
+        if(!snapshot->isIntact(headerSize)) {
+            throw runtime_error("Snapshot is corrupt: " + path);
+        }
+        ::madvise(addr, info.st_size, MADV_RANDOM);
+        return snapshot;
+    }
+
+    uint64_t getCutSequence() const { return header.cutSequence; }
+    uint64_t getLastTransferId() const { return header.version >= TRANSFER_SNAPSHOT_VERSION ? header.lastTransferId : 0; }
+    bool hasPlainTextPasswords() const { return header.version < CREDENTIAL_SNAPSHOT_VERSION; }
+
+    // A stored transaction's timestamp in microseconds, whatever the snapshot version
+    int64_t timestamp(const SnapshotTransaction& txn) const {
+        return header.version == SECONDS_SNAPSHOT_VERSION ? txn.timestamp * MICROS_PER_SECOND : txn.timestamp;
+    }
+    uint64_t customerCount() const { return header.customerCount; }
+    uint64_t accountCount() const { return header.accountCount; }
+    uint64_t descriptionCount() const { return header.descriptionCount; }
+
+    string_view text(const StringRef& ref) const {
+        return string_view(base + header.columns[static_cast<size_t>(SnapshotColumn::StringPool)] + ref.offset, ref.length);
+    }
+
+    int64_t findAccount(string_view accNum) const {
+        return probe(SnapshotColumn::AccountSlots, header.accountSlots, SnapshotColumn::AccountNumber, accNum);
+    }
+
+    int64_t findCustomer(string_view uname) const {
+        return probe(SnapshotColumn::CustomerSlots, header.customerSlots, SnapshotColumn::CustomerUsername, uname);
+    }
+
+    // Customer rows
+    string_view username(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::CustomerUsername)[row]); }
+    string_view credential(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::CustomerCredential)[row]); }
+    string_view name(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::CustomerName)[row]); }
+    string_view email(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::CustomerEmail)[row]); }
+    uint32_t firstAccount(uint64_t row) const { return column<uint32_t>(SnapshotColumn::CustomerFirstAccount)[row]; }
+    uint32_t accountsOf(uint64_t row) const { return column<uint32_t>(SnapshotColumn::CustomerAccountCount)[row]; }
+
+    // Account rows
+    string_view accountNumber(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::AccountNumber)[row]); }
+    string_view accountHolder(uint64_t row) const { return text(column<StringRef>(SnapshotColumn::AccountHolder)[row]); }
+    AccountKind kind(uint64_t row) const { return column<AccountKind>(SnapshotColumn::AccountKinds)[row]; }
+    int64_t parameter(uint64_t row) const { return column<int64_t>(SnapshotColumn::AccountParameter)[row]; }
+    uint64_t sequence(uint64_t row) const { return column<uint64_t>(SnapshotColumn::AccountSequence)[row]; }
+    uint32_t owner(uint64_t row) const { return column<uint32_t>(SnapshotColumn::AccountOwner)[row]; }
+
+    Account::State state(uint64_t row) const {
+        return {Money::fromCents(column<int64_t>(SnapshotColumn::AccountBalance)[row]),
+                Money::fromCents(column<int64_t>(SnapshotColumn::AccountPrincipal)[row]),
+                Money::fromCents(column<int64_t>(SnapshotColumn::AccountPayment)[row])};
+    }
+
+    const SnapshotTransaction* transactions(uint64_t row, uint64_t& count) const {
+        count = column<uint64_t>(SnapshotColumn::AccountTransactionCount)[row];
+        return column<SnapshotTransaction>(SnapshotColumn::Transactions) + column<uint64_t>(SnapshotColumn::AccountFirstTransaction)[row];
+    }
+
+    // Transfer ID of the i-th of an account row's transactions; 0 before version 5
+    uint64_t transferId(uint64_t row, uint64_t i) const {
+        if(header.version < TRANSFER_SNAPSHOT_VERSION) {
+            return 0;
+        }
+        return column<uint64_t>(SnapshotColumn::TransactionTransfers)[column<uint64_t>(SnapshotColumn::AccountFirstTransaction)[row] + i];
+    }
+
+    string_view description(uint64_t id) const { return text(column<StringRef>(SnapshotColumn::Descriptions)[id]); }
+
+    // Print an account straight from the columns, in the same format as Account::display
+    void displayAccount(uint64_t row) const {
+        Account::State current = state(row);
+        switch(kind(row)) {
+            case AccountKind::Savings:
+                SavingsAccount::printDetails(accountNumber(row), accountHolder(row), current.balance, Rate::fromMicros(parameter(row)));
+                break;
+            case AccountKind::Checking:
+                CheckingAccount::printDetails(accountNumber(row), accountHolder(row), current.balance, Money::fromCents(parameter(row)));
+                break;
+            case AccountKind::Loan:
+                LoanAccount::printDetails(accountNumber(row), accountHolder(row), current.principal, Rate::fromMicros(parameter(row)), current.payment);
+                break;
+        }
+    }
+
+    AccountImage accountImage(uint64_t row) const {
+        return {kind(row), string(accountNumber(row)), string(accountHolder(row)), parameter(row), state(row), sequence(row)};
+    }
+};
+
+// Write-ahead log with group commit.
+// Records are appended to an in-memory buffer and a flusher thread writes whatever has
+// accumulated under a single fdatasync, so concurrent writers share each sync. The log
+// is split into segment files named after their first sequence number; a checkpoint
+// rotates to a new segment and deletes the ones its snapshot covers. A failed write or
+// sync is sticky: nothing after it is reported durable, and every later append and wait
+// rethrows it.
+class WriteAheadLog {
+private:
+    string directory;
+    int fd = -1;
+    uint64_t nextSequence;
+    uint64_t durableSequence;
+    string pending;
+    bool stopping = false;
+    exception_ptr failure;
+    mutex mtx;     // guards pending, the sequence numbers, stopping and failure
+    mutex ioMutex; // serialises file writes with segment rotation
+    condition_variable workReady;
+    condition_variable durable;
+    thread flusher;
+
+    // Highest sequence appended by the calling thread
+    static uint64_t& lastAppended() {
+        thread_local uint64_t sequence = 0;
+        return sequence;
+    }
+
+    static string segmentName(uint64_t firstSequence) {
+        char name[64];
+        snprintf(name, sizeof(name), "wal-%020llu.log", static_cast<unsigned long long>(firstSequence));
+        return name;
+    }
+
+    // Segment files in the directory, ordered by first sequence
+    static vector<pair<uint64_t, string>> segments(const string& dir) {
+        vector<pair<uint64_t, string>> found;
+        if(!filesystem::exists(dir)) {
+            return found;
+        }
+        for(const auto& entry : filesystem::directory_iterator(dir)) {
+            string name = entry.path().filename().string();
+            if(name.size() == 28 && name.compare(0, 4, "wal-") == 0 && name.compare(24, 4, ".log") == 0) {
+                found.emplace_back(stoull(name.substr(4, 20)), entry.path().string());
+            }
+        }
+        sort(found.begin(), found.end());
+        return found;
+    }
+
+    void openSegment(uint64_t firstSequence) {
+        string path = directory + "/" + segmentName(firstSequence);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(fd < 0) {
+            throw runtime_error("Cannot open log segment " + path);
+        }
+        syncDirectory(directory);
+    }
+
+    // Write and sync a batch; caller holds ioMutex
+    void writeBatch(const string& batch) {
+        size_t written = 0;
+        while(written < batch.size()) {
+            ssize_t n = ::write(fd, batch.data() + written, batch.size() - written);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw runtime_error(string("Write-ahead log write failed: ") + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+        if(::fdatasync(fd) != 0) {
+            throw runtime_error(string("Write-ahead log sync failed: ") + strerror(errno));
+        }
+    }
+
+    // Record the first failure and wake every waiter; caller holds mtx
+    void fail(exception_ptr error) {
+        if(!failure) {
+            failure = error;
+        }
+        durable.notify_all();
+    }
+
+    // Caller holds mtx
+    void throwIfFailed() const {
+        if(failure) {
+            rethrow_exception(failure);
+        }
+    }
+
+    void flushLoop() {
+        string batch;
+        for(;;) {
+            {
+                unique_lock<mutex> lock(mtx);
+                workReady.wait(lock, [this]() { return stopping || !pending.empty(); });
+                if(stopping && pending.empty()) {
+                    return;
+                }
+            }
+            // A rotation may have taken the batch meanwhile; then this writes nothing
+            lock_guard<mutex> io(ioMutex);
+            uint64_t covered;
+            {
+                lock_guard<mutex> lock(mtx);
+                batch.swap(pending);
+                covered = nextSequence - 1;
+            }
+            try {
+                if(!batch.empty()) {
+                    writeBatch(batch);
+                    batch.clear();
+                }
+            }
+            catch(...) {
+                // The file's contents are now unknown, so stop writing altogether
+                lock_guard<mutex> lock(mtx);
+                fail(current_exception());
+                return;
+            }
+            lock_guard<mutex> lock(mtx);
+            durableSequence = max(durableSequence, covered);
+            durable.notify_all();
+        }
+    }
+
+public:
+    WriteAheadLog(const string& dir, uint64_t firstSequence)
+        : directory(dir), nextSequence(firstSequence), durableSequence(firstSequence - 1) {
+        openSegment(firstSequence);
+        flusher = thread(&WriteAheadLog::flushLoop, this);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        workReady.notify_one();
+        flusher.join();
+        if(fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    // Queue a record and return its sequence number; it is durable once waitDurable returns
+    uint64_t append(const string& payload) {
+        uint64_t sequence;
+        {
+            lock_guard<mutex> lock(mtx);
+            throwIfFailed();
+            sequence = nextSequence++;
+            uint32_t size = static_cast<uint32_t>(payload.size());
+            uint32_t sum = checksum(payload.data(), payload.size());
+            pending.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            pending.append(reinterpret_cast<const char*>(&sum), sizeof(sum));
+            pending.append(reinterpret_cast<const char*>(&sequence), sizeof(sequence));
+            pending.append(payload);
+        }
+        lastAppended() = sequence;
+        workReady.notify_one();
+        return sequence;
+    }
+
+    void waitDurable(uint64_t sequence) {
+        unique_lock<mutex> lock(mtx);
+        durable.wait(lock, [&]() { return durableSequence >= sequence || failure; });
+        if(durableSequence < sequence) {
+            throwIfFailed();
+        }
+    }
+
+    // Wait for everything the calling thread has appended
+    void waitForThread() {
+        waitDurable(lastAppended());
+    }
+
+    // Flush, start a new segment and return its first sequence number
+    uint64_t rotate() {
+        lock_guard<mutex> io(ioMutex);
+        string batch;
+        uint64_t first;
+        {
+            lock_guard<mutex> lock(mtx);
+            throwIfFailed();
+            batch.swap(pending);
+            first = nextSequence;
+        }
+        try {
+            writeBatch(batch);
+            ::close(fd);
+            fd = -1;
+            openSegment(first);
+        }
+        catch(...) {
+            lock_guard<mutex> lock(mtx);
+            fail(current_exception());
+            throw;
+        }
+        lock_guard<mutex> lock(mtx);
+        durableSequence = max(durableSequence, first - 1);
+        durable.notify_all();
+        return first;
+    }
+
+    // Delete segments whose records all precede the given sequence
+    void removeSegmentsBefore(uint64_t sequence) {
+        auto found = segments(directory);
+        for(size_t i = 0; i + 1 < found.size() && found[i + 1].first <= sequence; ++i) {
+            filesystem::remove(found[i].second);
+        }
+    }
+
+    // Feed every intact record in the directory to apply, in order; returns the highest
+    // sequence seen. Replay stops at the first torn or corrupt record (normally the tail of
+    // the last segment, from a crash mid-write): that segment is cut back to its last good
+    // record and any later segments are set aside as *.discarded, so the log appended
+    // after recovery carries on from the last record replayed.
+    static uint64_t replay(const string& dir, const function<void(uint64_t, BinaryReader&)>& apply) {
+        uint64_t last = 0;
+        auto found = segments(dir);
+        for(size_t s = 0; s < found.size(); ++s) {
+            ifstream file(found[s].second, ios::binary);
+            string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            size_t pos = 0;
+            const size_t headerSize = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+            while(data.size() - pos >= headerSize) {
+                uint32_t size, sum;
+                uint64_t sequence;
+                memcpy(&size, data.data() + pos, sizeof(size));
+                memcpy(&sum, data.data() + pos + 4, sizeof(sum));
+                memcpy(&sequence, data.data() + pos + 8, sizeof(sequence));
+                if(data.size() - pos - headerSize < size || checksum(data.data() + pos + headerSize, size) != sum) {
+                    break;
+                }
+                BinaryReader record(data.data() + pos + headerSize, size);
+                apply(sequence, record);
+                last = max(last, sequence);
+                pos += headerSize + size;
+            }
+            if(pos != data.size()) {
+                filesystem::resize_file(found[s].second, pos);
+                int truncated = ::open(found[s].second.c_str(), O_WRONLY);
+                if(truncated < 0 || ::fsync(truncated) != 0) {
+                    if(truncated >= 0) {
+                        ::close(truncated);
+                    }
+                    throw runtime_error("Cannot truncate log segment " + found[s].second);
+                }
+                ::close(truncated);
+                for(size_t later = s + 1; later < found.size(); ++later) {
+                    filesystem::rename(found[later].second, found[later].second + ".discarded");
+                }
+                syncDirectory(dir);
+                break;
+            }
+        }
+        return last;
+    }
+};
+
+// Record types in the write-ahead log
+enum class LogRecord : uint8_t {
+    SecondsPosting = 1,    // written before timestamps were in microseconds; replayed only
+    PlainTextCustomer = 2, // written before passwords were hashed; replayed only
+    Account = 3,
+    Posting = 4,
+    Customer = 5,
+    Transfer = 6 // both legs of a transfer, so recovery applies both or neither
+};
+
+// Totals from a month-end accrual run
+struct AccrualSummary {
+    size_t savingsAccounts = 0;
+    size_t loanAccounts = 0;
+    Money interestCredited;
+    Money loanInterestCharged;
+};
+
+// Statement export.
+// A statement covers a period [from, to): each account's opening and closing balance and the
+// transactions in between, with a running balance. StatementRenderer appends statements as
+// CSV rows or JSON objects to a reusable buffer, formatting numbers with to_chars and
+// timestamps through the per-day cache, so rendering allocates only when a buffer grows.
+enum class StatementFormat { Csv, Json };
+
+struct StatementPeriod {
+    int64_t from; // microseconds since the epoch
+    int64_t to;
+};
+
+// Totals from a statement export
+struct StatementSummary {
+    size_t customers = 0;
+    size_t accounts = 0;
+    size_t transactions = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+};
+
+// Growable output buffer written through raw pointers: reserve room, write, then commit.
+// clear() keeps the storage, so a buffer reused across runs stops allocating once it has
+// reached its working size.
+class OutputBuffer {
+private:
+    unique_ptr<char[]> storage;
+    size_t used = 0;
+    size_t capacity = 0;
+
+public:
+    // Room for at least bytes more chars, starting at the returned pointer
+    char* reserve(size_t bytes) {
+        if(used + bytes > capacity) {
+            size_t grown = max(capacity * 2, used + bytes + 4096);
+            unique_ptr<char[]> fresh(new char[grown]);
+            if(used) {
+                memcpy(fresh.get(), storage.get(), used);
+            }
+            storage = move(fresh);
+            capacity = grown;
+        }
+        return storage.get() + used;
+    }
+
+    // Keep everything written up to end
+    void commit(char* end) { used = end - storage.get(); }
+
+    void append(string_view text) {
+        char* out = reserve(text.size());
+        memcpy(out, text.data(), text.size());
+        used += text.size();
+    }
+
+    char* data() { return storage.get(); }
+    size_t size() const { return used; }
+    bool empty() const { return used == 0; }
+    void clear() { used = 0; }
+};
+
+class StatementRenderer {
+private:
+    OutputBuffer& out;
+    StatementFormat format;
+    // Escaped customer, account and holder fields, rendered once per account
+    string prefix;
+
+    static char* copy(char* out, string_view text) {
+        memcpy(out, text.data(), text.size());
+        return out + text.size();
+    }
+
+    static char* time(char* out, int64_t micros) {
+        formatTimestamp(micros, out);
+        return out + TIMESTAMP_TEXT_LENGTH;
+    }
+
+    // Room needed for an escaped field: a quote or control char can grow six-fold in JSON
+    static size_t escapedSize(string_view text) { return text.size() * 6 + 2; }
+
+    // A CSV field, quoted only if it needs to be
+    static char* csvField(char* out, string_view value) {
+        if(value.find_first_of(",\"\r\n") == string_view::npos) {
+            return copy(out, value);
+        }
+        *out++ = '"';
+        for(char c : value) {
+            if(c == '"') {
+                *out++ = '"';
+            }
+            *out++ = c;
+        }
+        *out++ = '"';
+        return out;
+    }
+
+    // A JSON string literal
+    static char* jsonString(char* out, string_view value) {
+        static const char HEX[] = "0123456789abcdef";
+        *out++ = '"';
+        for(char c : value) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if(c == '"' || c == '\\') {
+                *out++ = '\\';
+                *out++ = c;
+            }
+            else if(u < 0x20) {
+                out = copy(out, "\\u00");
+                *out++ = HEX[u >> 4];
+                *out++ = HEX[u & 15];
+            }
+            else {
+                *out++ = c;
+            }
+        }
+        *out++ = '"';
+        return out;
+    }
+
+    void csvRow(string_view entry, int64_t when, string_view description, const Money* amount, Money balance) {
+        char* p = out.reserve(prefix.size() + escapedSize(description) + 96);
+        p = copy(p, prefix);
+        p = copy(p, entry);
+        *p++ = ',';
+        p = time(p, when);
+        *p++ = ',';
+        p = csvField(p, description);
+        *p++ = ',';
+        if(amount) {
+            p = amount->format(p);
+        }
+        *p++ = ',';
+        p = balance.format(p);
+        *p++ = '\n';
+        out.commit(p);
+    }
+
+public:
+    StatementRenderer(OutputBuffer& buffer, StatementFormat statementFormat) : out(buffer), format(statementFormat) {}
+
+    // Text written before the first statement and after the last
+    static string_view header(StatementFormat format) {
+        return format == StatementFormat::Csv ? "customer,account,holder,entry,time,description,amount,balance\n" : "[";
+    }
+    static string_view footer(StatementFormat format) {
+        return format == StatementFormat::Csv ? "" : "\n]\n";
+    }
+
+    // Append one account's statement; returns the number of transactions in it. JSON
+    // statements start with ",\n", and the writer drops the comma before the first one.
+    size_t render(const Customer& customer, const Account& account, const StatementPeriod& period) {
+        lock_guard<recursive_mutex> lock(account.getMutex());
+        Account::PeriodRange range = account.periodRange(period.from, period.to);
+        const TransactionJournal& journal = account.getTransactions();
+        Money balance = range.opening;
+        string_view username = customer.getUsername();
+        string_view number = account.getAccountNumber();
+        string_view holder = account.getAccountHolder();
+        prefix.resize(escapedSize(username) + escapedSize(number) + escapedSize(holder) + 64);
+        char* p = prefix.data();
+        if(format == StatementFormat::Csv) {
+            p = csvField(p, username);
+            *p++ = ',';
+            p = csvField(p, number);
+            *p++ = ',';
+            p = csvField(p, holder);
+            *p++ = ',';
+            prefix.resize(p - prefix.data());
+            csvRow("opening", period.from, "", nullptr, balance);
+            for(size_t i = range.first; i < range.last; ++i) {
+                const Transaction& txn = journal[i];
+                Money amount = balanceEffect(txn);
+                balance += amount;
+                csvRow("transaction", txn.timestamp, txn.description(), &amount, balance);
+            }
+            csvRow("closing", period.to, "", nullptr, range.closing);
+        }
+        else {
+            static const string_view KIND_NAMES[] = {"savings", "checking", "loan"};
+            p = copy(p, ",\n{\"customer\":");
+            p = jsonString(p, username);
+            p = copy(p, ",\"account\":");
+            p = jsonString(p, number);
+            p = copy(p, ",\"holder\":");
+            p = jsonString(p, holder);
+            prefix.resize(p - prefix.data());
+
+            p = out.reserve(prefix.size() + 160);
+            p = copy(p, prefix);
+            p = copy(p, ",\"kind\":\"");
+            p = copy(p, KIND_NAMES[account.getKind() == AccountKind::Savings ? 0 : account.getKind() == AccountKind::Checking ? 1 : 2]);
+            p = copy(p, "\",\"from\":\"");
+            p = time(p, period.from);
+            p = copy(p, "\",\"to\":\"");
+            p = time(p, period.to);
+            p = copy(p, "\",\"opening\":");
+            p = balance.format(p);
+            p = copy(p, ",\"transactions\":[");
+            out.commit(p);
+            for(size_t i = range.first; i < range.last; ++i) {
+                const Transaction& txn = journal[i];
+                Money amount = balanceEffect(txn);
+                balance += amount;
+                string_view description = txn.description();
+                p = out.reserve(escapedSize(description) + 128);
+                p = copy(p, i == range.first ? "{\"time\":\"" : ",{\"time\":\"");
+                p = time(p, txn.timestamp);
+                p = copy(p, "\",\"description\":");
+                p = jsonString(p, description);
+                p = copy(p, ",\"amount\":");
+                p = amount.format(p);
+                p = copy(p, ",\"balance\":");
+                p = balance.format(p);
+                *p++ = '}';
+                out.commit(p);
+            }
+            p = out.reserve(48);
+            p = copy(p, "],\"closing\":");
+            p = range.closing.format(p);
+            *p++ = '}';
+            out.commit(p);
+        }
+        return range.last - range.first;
+    }
+};
+
+// Write every buffer to fd with as few writev calls as possible, resuming after short writes
+void writeBuffers(int fd, vector<iovec>& buffers) {
+    size_t done = 0;
+    while(done < buffers.size()) {
+        int count = static_cast<int>(min<size_t>(buffers.size() - done, IOV_MAX));
+        ssize_t written = ::writev(fd, buffers.data() + done, count);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw runtime_error(string("Statement write failed: ") + strerror(errno));
+        }
+        size_t remaining = static_cast<size_t>(written);
+        while(done < buffers.size() && remaining >= buffers[done].iov_len) {
+            remaining -= buffers[done].iov_len;
+            ++done;
+        }
+        if(remaining > 0) {
+            buffers[done].iov_base = static_cast<char*>(buffers[done].iov_base) + remaining;
+            buffers[done].iov_len -= remaining;
+        }
+    }
+}
+
+// Scheduled operations.
+// A Bank runs recurring jobs as they fall due: loan installments, interest postings and
+// standing transfers. Jobs wait in a hierarchical timing wheel of one-second ticks, four
+// levels of 256 slots. Level L holds the jobs due in the current block of 256^(L+1) ticks
+// that are not in the current block of the level below; jobs further out wait in one
+// overflow list. Adding and cancelling a job are O(1) list operations. As time passes, a
+// job moves down at most four times before it runs, and empty slots are skipped through
+// per-level occupancy bitmaps, so a long jump in time costs little more than a short one.
+enum class ScheduledKind : uint8_t { LoanInstallment, InterestPosting, StandingTransfer };
+
+// What a job does when it runs
+struct ScheduledOperation {
+    ScheduledKind kind = ScheduledKind::LoanInstallment;
+    Account* account = nullptr;      // the loan, the savings account, or the transfer's source
+    Account* counterparty = nullptr; // the transfer's destination
+    Money amount = Money();          // the transfer's amount
+};
+
+// Handle of a scheduled job, for cancelling it; never 0
+using ScheduleId = uint64_t;
+
+constexpr int64_t SCHEDULE_TICK_MICROS = MICROS_PER_SECOND;
+
+// Totals from running the scheduled jobs due by some time
+struct ScheduleSummary {
+    size_t rounds = 0;     // batches run; a job is run at most once per batch
+    size_t operations = 0; // jobs run
+    size_t declined = 0;   // standing transfers refused, e.g. for insufficient funds
+};
+
+// Not synchronized; a Bank guards its wheel with a mutex
+class TimingWheel {
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t OVERFLOW_SLOT = LEVELS * SLOTS;
+
+    // 56 bytes per job, all in one vector; free entries are chained through next
+    struct Job {
+        Account* account;
+        Account* counterparty;
+        Money amount;
+        int64_t due;         // tick
+        uint32_t period;     // ticks between runs; 0 runs once
+        uint32_t next;
+        uint32_t prev;
+        uint32_t generation; // advanced when the entry is freed, so stale ids cancel nothing
+        uint16_t slot;       // level * SLOTS + slot, or OVERFLOW_SLOT
+        ScheduledKind kind;
+    };
+
+    vector<Job> jobs;
+    uint32_t freeList = NONE;
+    size_t jobCount = 0;
+    int64_t current; // next tick to run; everything due earlier has run
+    uint32_t heads[LEVELS * SLOTS + 1];
+    uint64_t occupied[LEVELS][SLOTS / 64] = {};
+
+    static int64_t blockOf(int64_t tick, int level) { return tick >> (SLOT_BITS * level); }
+
+    void push(uint32_t slot, uint32_t index) {
+        Job& job = jobs[index];
+        job.slot = static_cast<uint16_t>(slot);
+        job.prev = NONE;
+        job.next = heads[slot];
+        if(job.next != NONE) {
+            jobs[job.next].prev = index;
+        }
+        heads[slot] = index;
+        if(slot != OVERFLOW_SLOT) {
+            occupied[slot / SLOTS][slot % SLOTS / 64] |= uint64_t(1) << (slot % 64);
+        }
+    }
+
+    // Put a job in the slot for its due tick, relative to current
+    void link(uint32_t index) {
+        Job& job = jobs[index];
+        job.due = max(job.due, current);
+        for(int level = 0; level < LEVELS; ++level) {
+            if(blockOf(job.due, level + 1) == blockOf(current, level + 1)) {
+                push(level * SLOTS + (blockOf(job.due, level) & (SLOTS - 1)), index);
+                return;
+            }
+        }
+        push(OVERFLOW_SLOT, index);
+    }
+
+    void unlink(uint32_t index) {
+        Job& job = jobs[index];
+        if(job.prev != NONE) {
+            jobs[job.prev].next = job.next;
+        }
+        else {
+            heads[job.slot] = job.next;
+        }
+        if(job.next != NONE) {
+            jobs[job.next].prev = job.prev;
+        }
+        if(heads[job.slot] == NONE && job.slot != OVERFLOW_SLOT) {
+            occupied[job.slot / SLOTS][job.slot % SLOTS / 64] &= ~(uint64_t(1) << (job.slot % 64));
+        }
+    }
+
+    // Free an unlinked job's entry for reuse
+    void release(uint32_t index) {
+        Job& job = jobs[index];
+        if(++job.generation == 0) {
+            job.generation = 1;
+        }
+        job.next = freeList;
+        freeList = index;
+        --jobCount;
+    }
+
+    // Detach a whole slot, returning its first job
+    uint32_t take(uint32_t slot) {
+        uint32_t first = heads[slot];
+        heads[slot] = NONE;
+        if(slot != OVERFLOW_SLOT) {
+            occupied[slot / SLOTS][slot % SLOTS / 64] &= ~(uint64_t(1) << (slot % 64));
+        }
+        return first;
+    }
+
+    // Move current forward to tick, sending down the slots of every level whose block starts
+    // there; the caller has made sure no occupied slot was skipped on the way
+    void moveTo(int64_t tick) {
+        current = tick;
+        for(int level = LEVELS; level >= 1; --level) {
+            if(tick & ((int64_t(1) << (SLOT_BITS * level)) - 1)) {
+                continue;
+            }
+            uint32_t slot = level == LEVELS ? OVERFLOW_SLOT : level * SLOTS + (blockOf(tick, level) & (SLOTS - 1));
+            for(uint32_t index = take(slot); index != NONE;) {
+                uint32_t next = jobs[index].next;
+                link(index);
+                index = next;
+            }
+        }
+    }
+
+    // First occupied slot of level at or after from, or SLOTS
+    uint32_t firstOccupied(int level, uint32_t from) const {
+        for(uint32_t word = from / 64; word < SLOTS / 64; ++word) {
+            uint64_t bits = occupied[level][word];
+            if(word == from / 64) {
+                bits &= ~uint64_t(0) << (from % 64);
+            }
+            if(bits) {
+                return word * 64 + countr_zero(bits);
+            }
+        }
+        return SLOTS;
+    }
+
+    // The next tick at which a slot has to be run or sent down, or -1 if no job is waiting
+    int64_t nextEvent() const {
+        for(int level = 0; level < LEVELS; ++level) {
+            // The current slot of a level above 0 has already been sent down
+            uint32_t from = (blockOf(current, level) & (SLOTS - 1)) + (level > 0);
+            uint32_t slot = from < SLOTS ? firstOccupied(level, from) : SLOTS;
+            if(slot < SLOTS) {
+                return (blockOf(current, level + 1) << (SLOT_BITS * (level + 1))) | (int64_t(slot) << (SLOT_BITS * level));
+            }
+        }
+        return heads[OVERFLOW_SLOT] == NONE ? -1 : (blockOf(current, LEVELS) + 1) << (SLOT_BITS * LEVELS);
+    }
+
+public:
+    explicit TimingWheel(int64_t startTick) : current(startTick) {
+        fill(begin(heads), end(heads), NONE);
+    }
+
+    int64_t now() const { return current; }
+    size_t size() const { return jobCount; }
+    size_t memoryBytes() const { return sizeof(*this) + jobs.capacity() * sizeof(Job); }
+
+    // Add a job first due at dueTick (at once if that has passed), then every periodTicks
+    ScheduleId add(const ScheduledOperation& operation, int64_t dueTick, uint32_t periodTicks) {
+        uint32_t index;
+        if(freeList != NONE) {
+            index = freeList;
+            freeList = jobs[index].next;
+        }
+        else {
+            if(jobs.size() == NONE) {
+                throw length_error("Too many scheduled jobs.");
+            }
+            index = static_cast<uint32_t>(jobs.size());
+            jobs.push_back({});
+            jobs.back().generation = 1;
+        }
+        Job& job = jobs[index];
+        job.account = operation.account;
+        job.counterparty = operation.counterparty;
+        job.amount = operation.amount;
+        job.kind = operation.kind;
+        job.due = dueTick;
+        job.period = periodTicks;
+        link(index);
+        ++jobCount;
+        return (uint64_t(job.generation) << 32) | index;
+    }
+
+    // Remove a job; false if it has already run its last time or been cancelled
+    bool cancel(ScheduleId id) {
+        uint32_t index = static_cast<uint32_t>(id);
+        if(index >= jobs.size() || jobs[index].generation != static_cast<uint32_t>(id >> 32)) {
+            return false;
+        }
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    // Detach the jobs due up to tick last into due and move the wheel past them. Collection
+    // stops early at the first tick a collected job is due again, so each job is taken at
+    // most once and none of its runs is lost. Each must then be handed to reschedule.
+    void collectDue(int64_t last, vector<uint32_t>& due) {
+        int64_t end = last + 1;
+        while(current < end) {
+            int64_t tick = nextEvent();
+            if(tick < 0 || tick >= end) {
+                moveTo(end);
+                return;
+            }
+            if(tick > current) {
+                moveTo(tick);
+                continue;
+            }
+            for(uint32_t index = take(static_cast<uint32_t>(current & (SLOTS - 1))); index != NONE; index = jobs[index].next) {
+                due.push_back(index);
+                if(jobs[index].period) {
+                    end = min(end, jobs[index].due + jobs[index].period);
+                }
+            }
+            moveTo(current + 1);
+        }
+    }
+
+    ScheduledOperation operation(uint32_t index) const {
+        const Job& job = jobs[index];
+        return {job.kind, job.account, job.counterparty, job.amount};
+    }
+
+    // Put a collected job back for its next run, or free it if it runs only once
+    void reschedule(uint32_t index) {
+        Job& job = jobs[index];
+        if(job.period) {
+            job.due += job.period;
+            link(index);
+        }
+        else {
+            release(index);
+        }
+    }
+};
+
+// Bank Class
+class Bank : public AccountListener {
+private:
+    // All of the bank's memory comes from heapMemory, which counts it. Accounts and customers
+    // live in slab pools (by type, in opening order); their strings, account lists and
+    // journals are carved from the arena, and the lookup indexes use indexMemory.
+    CountingResource heapMemory;
+    ArenaResource arena{&heapMemory};
+    SlabPool<SavingsAccount> savingsAccounts{&heapMemory};
+    SlabPool<CheckingAccount> checkingAccounts{&heapMemory};
+    SlabPool<LoanAccount> loanAccounts{&heapMemory};
+    SlabPool<Customer> customers{&heapMemory};
+    pmr::unsynchronized_pool_resource indexMemory{&heapMemory}; // used under bankMutex only
+
+    // Account number -> account and username -> customer, kept in sync by addCustomer/openAccount.
+    // Keys view the objects' own strings, which never move.
+    pmr::unordered_map<string_view, Account*> accountIndex{&indexMemory};
+    pmr::unordered_map<string_view, Customer*> customerIndex{&indexMemory};
+    // Guards the customer, account and snapshot maps and the accrual columns; account state has its own locks
+    mutable shared_mutex bankMutex;
+
+    // Latest snapshot, mapped read-only. Its customers are served from the mapping until
+    // one of their accounts is looked up for a change, when the customer is copied onto
+    // the heap and the heap copy is used from then on.
+    unique_ptr<MappedSnapshot> mapped;
+    vector<uint32_t> mappedDescriptionIds;                                // snapshot id -> pool id
+    unordered_map<uint32_t, Customer*> materializedCustomers;            // snapshot row -> heap copy
+
+    // Month-end columns: rates beside the savings and loan pools, row for row
+    vector<int64_t> savingsRates;
+    vector<int64_t> loanRates;
+    // Scratch columns reused by each accrual run
+    vector<int64_t> amountColumn;
+    vector<int64_t> interestColumn;
+    vector<int64_t> principalColumn;
+    vector<int64_t> paymentColumn;
+    mutex accrualMutex;
+
+    // Durability: write-ahead log and snapshot directory, when persistence is enabled
+    string dataDirectory;
+    unique_ptr<WriteAheadLog> wal;
+    mutex checkpointMutex;
+    mutex checkpointWakeMutex;
+    condition_variable checkpointWake;
+    bool stopCheckpoints = false;
+    thread checkpointer;
+
+    static constexpr uint32_t LEGACY_SNAPSHOT_VERSION = 1;
+
+    // Credentials: key-stretching rounds for new hashes, recent logins, and the hash that
+    // unknown usernames are checked against
+    uint32_t passwordIterations = PasswordHash::DEFAULT_ITERATIONS;
+    SessionCache sessions;
+    string unknownUserCredential;
+    once_flag unknownUserOnce;
+
+    // Running totals over every account, including those still in the mapped snapshot
+    BankTotals totals;
+
+    // Last transfer ID handed out; IDs are never reused, across restarts included
+    atomic<uint64_t> lastTransferId{0};
+
+    // Debit limit rules, or null when debits are not limited; windows point into it, so it is
+    // only replaced under bankMutex once every window has been moved to the new one
+    unique_ptr<LimitPolicy> limitPolicy;
+
+    // Scheduled jobs, guarded by scheduleMutex. runMutex keeps runs one at a time, and guards
+    // their scratch lists. Once requested, the scheduler thread is started with the first job
+    // and then runs due jobs every tick.
+    TimingWheel schedule{TimestampClock::now() / SCHEDULE_TICK_MICROS};
+    mutex scheduleMutex;
+    mutex scheduleRunMutex;
+    vector<uint32_t> dueJobs;
+    vector<ScheduledOperation> dueOperations;
+    mutex schedulerWakeMutex;
+    condition_variable schedulerWake;
+    bool stopScheduler = false;
+    atomic<bool> schedulerRequested{false};
+    atomic<bool> schedulerStarted{false};
+    thread scheduler;
+
+    // Add a job to the wheel; times are in microseconds, as TimestampClock gives them
+    ScheduleId addScheduled(const ScheduledOperation& operation, int64_t firstDue, int64_t period) {
+        if(period < 0 || (period > 0 && period < SCHEDULE_TICK_MICROS) || period / SCHEDULE_TICK_MICROS > UINT32_MAX) {
+            throw invalid_argument("A schedule period must be zero (run once) or between a second and 136 years.");
+        }
+        // Round the first run up to a whole tick, so a job never runs early
+        int64_t dueTick = firstDue / SCHEDULE_TICK_MICROS + (firstDue % SCHEDULE_TICK_MICROS > 0);
+        ScheduleId id;
+        {
+            lock_guard<mutex> lock(scheduleMutex);
+            id = schedule.add(operation, dueTick, static_cast<uint32_t>(period / SCHEDULE_TICK_MICROS));
+        }
+        if(schedulerRequested.load(memory_order_relaxed) && !schedulerStarted.load(memory_order_acquire)) {
+            launchScheduler();
+        }
+        return id;
+    }
+
+    // Start the scheduler thread if it was requested and has not started yet
+    void launchScheduler() {
+        lock_guard<mutex> lock(schedulerWakeMutex);
+        if(schedulerRequested.load() && !scheduler.joinable() && !stopScheduler) {
+            scheduler = thread(&Bank::schedulerLoop, this);
+            schedulerStarted.store(true, memory_order_release);
+        }
+    }
+
+    // Run due jobs every tick until the bank is destroyed
+    void schedulerLoop() {
+        unique_lock<mutex> lock(schedulerWakeMutex);
+        while(!schedulerWake.wait_for(lock, chrono::microseconds(SCHEDULE_TICK_MICROS), [this]() { return stopScheduler; })) {
+            lock.unlock();
+            runScheduled();
+            lock.lock();
+        }
+    }
+
+    // Gathers the two legs of a transfer posted on this thread, so that they reach the running
+    // totals as one change and the log as one record
+    class TransferBatch {
+    private:
+        Bank& bank;
+        BookTotals change;
+        pair<CustomerTotals*, BookTotals> owners[2];
+        size_t ownerCount = 0;
+        Account* legs[2];
+        size_t legCount = 0;
+
+        // The log record under construction, reused by each transfer on this thread
+        static BinaryWriter& record() {
+            thread_local BinaryWriter out;
+            return out;
+        }
+
+    public:
+        static inline thread_local TransferBatch* current = nullptr;
+
+        explicit TransferBatch(Bank& owner) : bank(owner) {
+            current = this;
+        }
+
+        TransferBatch(const TransferBatch&) = delete;
+        TransferBatch& operator=(const TransferBatch&) = delete;
+
+        ~TransferBatch() { current = nullptr; }
+
+        bool isFor(const Bank& owner) const { return &bank == &owner; }
+
+        void add(Account& account, const Transaction& txn, const BookTotals& posting) {
+            if(legCount == 2) {
+                throw logic_error("A transfer posts two legs.");
+            }
+            if(bank.wal && legCount == 0) {
+                // The debit comes first and carries the transfer's ID
+                record().clear();
+                record().put(LogRecord::Transfer);
+                record().put(txn.transferId);
+            }
+            legs[legCount++] = &account;
+            if(bank.wal) {
+                bank.encodePosting(record(), account, txn);
+            }
+            change += posting;
+            CustomerTotals* owner = account.getOwnerTotals();
+            if(!owner) {
+                return;
+            }
+            for(size_t i = 0; i < ownerCount; ++i) {
+                if(owners[i].first == owner) {
+                    owners[i].second += posting;
+                    return;
+                }
+            }
+            owners[ownerCount++] = {owner, posting};
+        }
+
+        // Apply both legs to the totals and log them; called with both accounts still locked
+        void publish() {
+            bank.totals.add(change);
+            for(size_t i = 0; i < ownerCount; ++i) {
+                owners[i].first->add(owners[i].second);
+            }
+            if(bank.wal && legCount > 0) {
+                uint64_t sequence = bank.wal->append(record().data());
+                for(size_t i = 0; i < legCount; ++i) {
+                    legs[i]->setLogSequence(sequence);
+                }
+            }
+        }
+    };
+
+    // A posting as the log stores it: the transaction and the account's state after it
+    static void encodePosting(BinaryWriter& out, Account& account, const Transaction& txn) {
+        out.putString(account.getAccountNumber());
+        out.put(txn.timestamp);
+        out.put(txn.amount.getCents());
+        out.put(txn.type);
+        out.putString(txn.description());
+        Account::State state = account.getState();
+        out.put(state.balance.getCents());
+        out.put(state.principal.getCents());
+        out.put(state.payment.getCents());
+    }
+
+    // Apply one logged posting unless the account already reflects it
+    void replayPosting(uint64_t sequence, BinaryReader& in, int64_t timeUnit, uint64_t transferId) {
+        string accNum = in.getString();
+        Transaction txn;
+        txn.timestamp = in.get<int64_t>() * timeUnit;
+        txn.amount = Money::fromCents(in.get<int64_t>());
+        txn.type = in.get<TransactionType>();
+        txn.descriptionId = DescriptionPool::instance().intern(in.getString());
+        txn.transferId = transferId;
+        Account::State state;
+        state.balance = Money::fromCents(in.get<int64_t>());
+        state.principal = Money::fromCents(in.get<int64_t>());
+        state.payment = Money::fromCents(in.get<int64_t>());
+        auto account = findAccount(accNum);
+        // Skip postings the snapshot already reflects
+        if(account && sequence > account->getLogSequence()) {
+            account->restoreState(state);
+            account->restoreTransaction(txn);
+            account->setLogSequence(sequence);
+        }
+    }
+
+    // Recompute every running total from the accounts, after recovery has set their balances
+    // directly. Snapshot accounts not yet copied out are counted from the mapped columns.
+    void recountTotals() {
+        unique_lock<shared_mutex> lock(bankMutex);
+        BookTotals all;
+        for(size_t c = 0; c < customers.size(); ++c) {
+            BookTotals mine;
+            for(Account* account : customers[c].getAccounts()) {
+                Account::State state = account->getState();
+                mine += BookTotals::of(account->getKind(), state.balance, state.principal);
+            }
+            customers[c].getTotals().reset(mine);
+            all += mine;
+        }
+        if(mapped) {
+            for(uint64_t row = 0; row < mapped->accountCount(); ++row) {
+                if(!materializedCustomers.count(mapped->owner(row))) {
+                    Account::State state = mapped->state(row);
+                    all += BookTotals::of(mapped->kind(row), state.balance, state.principal);
+                }
+            }
+        }
+        totals.reset(all);
+    }
+
+    void logCustomer(const Customer& customer) {
+        BinaryWriter out;
+        out.put(LogRecord::Customer);
+        out.putString(customer.getUsername());
+        out.putString(customer.getCredential());
+        out.putString(customer.getName());
+        out.putString(customer.getEmail());
+        wal->append(out.data());
+    }
+
+    void logAccount(const Customer& owner, const Account& account) {
+        BinaryWriter out;
+        out.put(LogRecord::Account);
+        out.putString(owner.getUsername());
+        encodeAccount(out, account);
+        wal->append(out.data());
+    }
+
+    // Apply one write-ahead log record during recovery
+    void replayRecord(uint64_t sequence, BinaryReader& in) {
+        LogRecord record = in.get<LogRecord>();
+        switch(record) {
+            case LogRecord::SecondsPosting:
+            case LogRecord::Posting:
+                replayPosting(sequence, in, record == LogRecord::SecondsPosting ? MICROS_PER_SECOND : 1, 0);
+                break;
+            case LogRecord::Transfer: {
+                uint64_t transferId = in.get<uint64_t>();
+                lastTransferId = max(lastTransferId.load(), transferId);
+                replayPosting(sequence, in, 1, transferId);
+                replayPosting(sequence, in, 1, transferId);
+                break;
+            }
+            case LogRecord::PlainTextCustomer:
+            case LogRecord::Customer: {
+                string uname = in.getString();
+                string cred = in.getString();
+                string nm = in.getString();
+                string mail = in.getString();
+                if(!findCustomer(uname)) {
+                    if(record == LogRecord::PlainTextCustomer) {
+                        cred = PasswordHash::create(cred, passwordIterations);
+                    }
+                    unique_lock<shared_mutex> lock(bankMutex);
+                    createCustomer(uname, cred, nm, mail);
+                }
+                break;
+            }
+            case LogRecord::Account: {
+                string owner = in.getString();
+                AccountImage image = decodeAccount(in);
+                auto customer = findCustomer(owner);
+                if(customer && !findAccount(image.accountNumber)) {
+                    image.logSequence = sequence;
+                    unique_lock<shared_mutex> lock(bankMutex);
+                    restoreAccount(*customer, image);
+                }
+                break;
+            }
+            default:
+                throw runtime_error("Unknown write-ahead log record.");
+        }
+    }
+
+    // Write every customer, account and journal to path as a columnar snapshot.
+    // Snapshot customers that were never changed are copied across column by column.
+    void writeSnapshot(const string& path, uint64_t cutSequence) const {
+        SnapshotBuilder builder;
+        DescriptionPool& pool = DescriptionPool::instance();
+        uint32_t descriptions = pool.size();
+        for(uint32_t id = 0; id < descriptions; ++id) {
+            builder.addDescription(pool.lookup(id));
+        }
+
+        auto addHeapCustomer = [&](const Customer& customer) {
+            builder.addCustomer(customer.getUsername(), customer.getCredential(), customer.getName(), customer.getEmail());
+            for(const auto& account : customer.getAccounts()) {
+                lock_guard<recursive_mutex> accountLock(account->getMutex());
+                builder.addAccount(account->getKind(), account->getAccountNumber(), account->getAccountHolder(),
+                                   accountParameter(*account), account->getState(), account->getLogSequence());
+                uint64_t count = account->getTransactions().size();
+                uint64_t written = 0;
+                account->getTransactions().forEach([&](const Transaction& txn) {
+                    if(written++ < count) {
+                        builder.addTransaction({txn.timestamp, txn.amount.getCents(), txn.descriptionId, txn.type, {}}, txn.transferId);
+                    }
+                });
+            }
+        };
+
+        shared_lock<shared_mutex> lock(bankMutex);
+        unordered_set<const Customer*> fromSnapshot;
+        if(mapped) {
+            for(uint64_t row = 0; row < mapped->customerCount(); ++row) {
+                auto it = materializedCustomers.find(static_cast<uint32_t>(row));
+                if(it != materializedCustomers.end()) {
+                    addHeapCustomer(*it->second);
+                    fromSnapshot.insert(it->second);
+                    continue;
+                }
+                builder.addCustomer(mapped->username(row), mapped->credential(row), mapped->name(row), mapped->email(row));
+                uint32_t first = mapped->firstAccount(row);
+                for(uint32_t a = first; a < first + mapped->accountsOf(row); ++a) {
+                    builder.addAccount(mapped->kind(a), mapped->accountNumber(a), mapped->accountHolder(a),
+                                       mapped->parameter(a), mapped->state(a), mapped->sequence(a));
+                    uint64_t count;
+                    const SnapshotTransaction* records = mapped->transactions(a, count);
+                    for(uint64_t t = 0; t < count; ++t) {
+                        SnapshotTransaction txn = records[t];
+                        txn.timestamp = mapped->timestamp(txn);
+                        txn.descriptionId = mappedDescriptionIds.at(txn.descriptionId);
+                        builder.addTransaction(txn, mapped->transferId(a, t));
+                    }
+                }
+            }
+        }
+        for(size_t c = 0; c < customers.size(); ++c) {
+            if(!fromSnapshot.count(&customers[c])) {
+                addHeapCustomer(customers[c]);
+            }
+        }
+        lock.unlock();
+        builder.write(path, cutSequence, lastTransferId.load());
+    }
+
+    // Load a version 1 (stream format) snapshot; the next checkpoint rewrites it in the current format
+    bool loadLegacySnapshot(const string& path, uint64_t& cutSequence) {
+        ifstream file(path, ios::binary);
+        if(!file) {
+            return false;
+        }
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        uint32_t stored;
+        if(data.size() < sizeof(SNAPSHOT_MAGIC) + sizeof(stored) ||
+           memcmp(data.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            throw runtime_error("Not a snapshot file: " + path);
+        }
+        memcpy(&stored, data.data() + data.size() - sizeof(stored), sizeof(stored));
+        if(checksum(data.data(), data.size() - sizeof(stored)) != stored) {
+            throw runtime_error("Snapshot is corrupt: " + path);
+        }
+
+        BinaryReader in(data.data() + sizeof(SNAPSHOT_MAGIC), data.size() - sizeof(SNAPSHOT_MAGIC) - sizeof(stored));
+        if(in.get<uint32_t>() != LEGACY_SNAPSHOT_VERSION) {
+            throw runtime_error("Unsupported snapshot version: " + path);
+        }
+        cutSequence = in.get<uint64_t>();
+        vector<uint32_t> descriptionIds(in.get<uint32_t>());
+        for(auto& id : descriptionIds) {
+            id = DescriptionPool::instance().intern(in.getString());
+        }
+
+        uint64_t customerCount = in.get<uint64_t>();
+        unique_lock<shared_mutex> lock(bankMutex);
+        accountIndex.reserve(accountIndex.size() + customerCount);
+        customerIndex.reserve(customerIndex.size() + customerCount);
+        for(uint64_t c = 0; c < customerCount; ++c) {
+            string uname = in.getString();
+            string cred = PasswordHash::create(in.getString(), passwordIterations);
+            string nm = in.getString();
+            string mail = in.getString();
+            Customer& customer = createCustomer(uname, cred, nm, mail);
+            uint32_t accountCount = in.get<uint32_t>();
+            for(uint32_t a = 0; a < accountCount; ++a) {
+                Account& account = restoreAccount(customer, decodeAccount(in));
+                uint64_t transactionCount = in.get<uint64_t>();
+                for(uint64_t t = 0; t < transactionCount; ++t) {
+                    Transaction txn;
+                    txn.timestamp = in.get<int64_t>() * MICROS_PER_SECOND;
+                    txn.amount = Money::fromCents(in.get<int64_t>());
+                    txn.descriptionId = descriptionIds.at(in.get<uint32_t>());
+                    txn.type = in.get<TransactionType>();
+                    account.restoreTransaction(txn);
+                }
+            }
+        }
+        return true;
+    }
+
+    void checkpointLoop(chrono::seconds interval) {
+        unique_lock<mutex> lock(checkpointWakeMutex);
+        while(!checkpointWake.wait_for(lock, interval, [this]() { return stopCheckpoints; })) {
+            lock.unlock();
+            try {
+                checkpoint();
+            }
+            catch(const exception& e) {
+                cerr << "Checkpoint failed: " << e.what() << "\n";
+            }
+            lock.lock();
+        }
+    }
+
+    // Construct and index a customer with a stored password hash; caller holds bankMutex exclusively
+    Customer& createCustomer(const string& uname, const string& cred, const string& nm, const string& mail) {
+        Customer& customer = customers.emplace(uname, cred, nm, mail, &arena);
+        customerIndex.emplace(customer.getUsername(), &customer);
+        if(limitPolicy) {
+            customer.getLimits().windows.reset(limitPolicy->customerRules, &heapMemory);
+        }
+        return customer;
+    }
+
+    // Construct an account in the pool for its type; caller holds bankMutex exclusively
+    template<typename T, typename... Args>
+    T& createAccount(Args&&... args) {
+        if constexpr(is_same_v<T, SavingsAccount>) {
+            return savingsAccounts.emplace(forward<Args>(args)..., &arena);
+        }
+        else if constexpr(is_same_v<T, CheckingAccount>) {
+            return checkingAccounts.emplace(forward<Args>(args)..., &arena);
+        }
+        else {
+            return loanAccounts.emplace(forward<Args>(args)..., &arena);
+        }
+    }
+
+    // Recreate a logged or snapshotted account for owner; caller holds bankMutex exclusively
+    Account& restoreAccount(Customer& owner, const AccountImage& image) {
+        if(accountIndex.count(image.accountNumber)) {
+            throw invalid_argument("Duplicate account number: " + image.accountNumber);
+        }
+        Account* account;
+        switch(image.kind) {
+            case AccountKind::Savings:
+                account = &createAccount<SavingsAccount>(image.accountNumber, image.accountHolder, Money(), Rate::fromMicros(image.parameter));
+                break;
+            case AccountKind::Checking:
+                account = &createAccount<CheckingAccount>(image.accountNumber, image.accountHolder, Money(), Money::fromCents(image.parameter));
+                break;
+            default:
+                account = &createAccount<LoanAccount>(image.accountNumber, image.accountHolder, Money(), Rate::fromMicros(image.parameter));
+                break;
+        }
+        account->restoreState(image.state);
+        account->setLogSequence(image.logSequence);
+        indexAccount(*account);
+        owner.addAccount(account);
+        if(limitPolicy) {
+            account->attachLimits(limitPolicy.get(), &owner.getLimits(), &heapMemory);
+        }
+        return *account;
+    }
+
+    // Copy a snapshot customer and its accounts onto the heap; caller holds bankMutex exclusively
+    Customer* materializeCustomer(uint32_t row) {
+        auto it = materializedCustomers.find(row);
+        if(it != materializedCustomers.end()) {
+            return it->second;
+        }
+        string cred = mapped->hasPlainTextPasswords() ? PasswordHash::create(mapped->credential(row), passwordIterations)
+                                                      : string(mapped->credential(row));
+        Customer* customer = &createCustomer(string(mapped->username(row)), cred, string(mapped->name(row)),
+                                             string(mapped->email(row)));
+        uint32_t first = mapped->firstAccount(row);
+        for(uint32_t a = first; a < first + mapped->accountsOf(row); ++a) {
+            Account& account = restoreAccount(*customer, mapped->accountImage(a));
+            uint64_t count;
+            const SnapshotTransaction* records = mapped->transactions(a, count);
+            for(uint64_t t = 0; t < count; ++t) {
+                account.restoreTransaction({mapped->timestamp(records[t]), Money::fromCents(records[t].cents),
+                                            mappedDescriptionIds.at(records[t].descriptionId), records[t].type,
+                                            mapped->transferId(a, t)});
+            }
+        }
+        materializedCustomers.emplace(row, customer);
+        return customer;
+    }
+
+    // Copy every remaining snapshot customer onto the heap
+    void materializeAll() {
+        unique_lock<shared_mutex> lock(bankMutex);
+        if(!mapped) {
+            return;
+        }
+        accountIndex.reserve(accountIndex.size() + mapped->accountCount());
+        customerIndex.reserve(customerIndex.size() + mapped->customerCount());
+        for(uint64_t row = 0; row < mapped->customerCount(); ++row) {
+            materializeCustomer(static_cast<uint32_t>(row));
+        }
+    }
+
+    // Reject a new username or account number already in use, on the heap or in the mapped snapshot
+    void checkNewCustomer(const string& uname) const {
+        if(customerIndex.count(uname) || (mapped && mapped->findCustomer(uname) >= 0)) {
+            throw invalid_argument("Duplicate username: " + uname);
+        }
+    }
+
+    void checkNewAccount(const string& accNum) const {
+        if(accountIndex.count(accNum) || (mapped && mapped->findAccount(accNum) >= 0)) {
+            throw invalid_argument("Duplicate account number: " + accNum);
+        }
+    }
+
+    // Register a newly created account in the lookup index and the accrual columns
+    void indexAccount(Account& account) {
+        accountIndex.emplace(account.getAccountNumber(), &account);
+        account.setListener(this);
+        if(auto sav = accountAs<SavingsAccount>(&account)) {
+            savingsRates.push_back(sav->getInterestRate().getMicros());
+        }
+        else if(auto loan = accountAs<LoanAccount>(&account)) {
+            loanRates.push_back(loan->getInterestRate().getMicros());
+        }
+    }
+
+public:
+    Bank() {}
+    Bank(const Bank&) = delete;
+    Bank& operator=(const Bank&) = delete;
+
+    ~Bank() {
+        {
+            lock_guard<mutex> lock(schedulerWakeMutex);
+            stopScheduler = true;
+        }
+        if(scheduler.joinable()) {
+            schedulerWake.notify_one();
+            scheduler.join();
+        }
+        if(checkpointer.joinable()) {
+            {
+                lock_guard<mutex> lock(checkpointWakeMutex);
+                stopCheckpoints = true;
+            }
+            checkpointWake.notify_one();
+            checkpointer.join();
+        }
+    }
+
+    // Add customer; accounts are then opened with openAccount. The customer is owned by the bank.
+    // Only a salted hash of pwd is kept; it is computed before the bank is locked.
+    Customer& addCustomer(const string& uname, const string& pwd, const string& nm, const string& mail) {
+        return addHashedCustomer(uname, PasswordHash::create(pwd, passwordIterations), nm, mail);
+    }
+
+    // Add a customer whose password is already hashed, such as a record copied from another bank
+    Customer& addHashedCustomer(const string& uname, const string& cred, const string& nm, const string& mail) {
+        if(!PasswordHash::isEncoded(cred)) {
+            throw invalid_argument("Not a password hash for " + uname);
+        }
+        unique_lock<shared_mutex> lock(bankMutex);
+        checkNewCustomer(uname);
+        Customer& customer = createCustomer(uname, cred, nm, mail);
+        if(wal) {
+            logCustomer(customer);
+        }
+        return customer;
+    }
+
+    // Find a customer by username, copying it out of the snapshot if needed
+    Customer* findCustomer(const string& uname) {
+        {
+            shared_lock<shared_mutex> lock(bankMutex);
+            auto it = customerIndex.find(uname);
+            if(it != customerIndex.end()) {
+                return it->second;
+            }
+            if(!mapped) {
+                return nullptr;
+            }
+        }
+        unique_lock<shared_mutex> lock(bankMutex);
+        int64_t row = mapped->findCustomer(uname);
+        if(row < 0) {
+            return nullptr;
+        }
+        return materializeCustomer(static_cast<uint32_t>(row));
+    }
+
+    // Open an account of type T (constructed from args) for a customer of this bank.
+    // The account lives in the bank's pool for T and is owned by the bank.
+    template<typename T, typename... Args>
+    T& openAccount(Customer& customer, const string& accNum, Args&&... args) {
+        unique_lock<shared_mutex> lock(bankMutex);
+        checkNewAccount(accNum);
+        T& account = createAccount<T>(accNum, forward<Args>(args)...);
+        indexAccount(account);
+        customer.addAccount(&account);
+        if(limitPolicy) {
+            account.attachLimits(limitPolicy.get(), &customer.getLimits(), &heapMemory);
+        }
+        Account::State state = account.getState();
+        totals.add(BookTotals::of(T::KIND, state.balance, state.principal));
+        if(wal) {
+            logAccount(customer, account);
+        }
+        return account;
+    }
+
+    // Restore state from dir (latest snapshot plus log replay), then log every change there
+    // and checkpoint periodically. Returns false if the directory held nothing to restore.
+    bool enablePersistence(const string& dir, chrono::seconds checkpointInterval = chrono::seconds(60)) {
+        if(wal) {
+            throw logic_error("Persistence is already enabled.");
+        }
+        filesystem::create_directories(dir);
+        dataDirectory = dir;
+        uint64_t cutSequence = 1;
+        string path = dir + "/snapshot.bin";
+        bool restored;
+        unique_ptr<MappedSnapshot> snapshot = MappedSnapshot::open(path);
+        if(snapshot) {
+            // Only the header has been read; rows are paged in as they are used
+            unique_lock<shared_mutex> lock(bankMutex);
+            cutSequence = snapshot->getCutSequence();
+            lastTransferId = snapshot->getLastTransferId();
+            mappedDescriptionIds.resize(snapshot->descriptionCount());
+            for(uint64_t id = 0; id < mappedDescriptionIds.size(); ++id) {
+                mappedDescriptionIds[id] = DescriptionPool::instance().intern(string(snapshot->description(id)));
+            }
+            mapped = move(snapshot);
+            restored = true;
+        }
+        else {
+            restored = loadLegacySnapshot(path, cutSequence);
+        }
+        // Passwords in an older snapshot are plain text: copy every customer out, hashing as it
+        // goes, and the next checkpoint writes only hashes
+        if(mapped && mapped->hasPlainTextPasswords()) {
+            materializeAll();
+        }
+
+        uint64_t lastSequence = WriteAheadLog::replay(dir, [&](uint64_t sequence, BinaryReader& in) {
+            replayRecord(sequence, in);
+            restored = true;
+        });
+
+        recountTotals();
+        wal = make_unique<WriteAheadLog>(dir, max(cutSequence, lastSequence + 1));
+        if(checkpointInterval.count() > 0) {
+            checkpointer = thread(&Bank::checkpointLoop, this, checkpointInterval);
+        }
+        return restored;
+    }
+
+    // Write a snapshot of all accounts and drop the log segments it covers
+    void checkpoint() {
+        if(!wal) {
+            return;
+        }
+        lock_guard<mutex> lock(checkpointMutex);
+        uint64_t cutSequence = wal->rotate();
+        writeSnapshot(dataDirectory + "/snapshot.bin", cutSequence);
+        wal->removeSegmentsBefore(cutSequence);
+    }
+
+    // Wait until every change made by the calling thread is durable
+    void commit() {
+        if(wal) {
+            wal->waitForThread();
+        }
+    }
+
+    // Count a posting in the running totals and log it (AccountListener); runs with the account locked
+    // The legs of a transfer are held back by its TransferBatch and published together.
+    void onPosting(Account& account, const Transaction& txn, Money balance, Money principalChange) override {
+        BookTotals change = BookTotals::of(account.getKind(), balance, principalChange);
+        change -= BookTotals::of(account.getKind(), balance - balanceEffect(txn), Money());
+        TransferBatch* batch = TransferBatch::current;
+        if(batch && batch->isFor(*this)) {
+            batch->add(account, txn, change);
+            return;
+        }
+        totals.add(change);
+        if(CustomerTotals* owner = account.getOwnerTotals()) {
+            owner->add(change);
+        }
+        if(!wal) {
+            return;
+        }
+        thread_local BinaryWriter out;
+        out.clear();
+        out.put(LogRecord::Posting);
+        encodePosting(out, account, txn);
+        account.setLogSequence(wal->append(out.data()));
+    }
+
+    // Authenticate customer. A login repeated within the session lifetime is answered by the
+    // session cache; otherwise the username is looked up in the hash index and the password
+    // checked against its salted hash, outside the bank lock. Unknown usernames are checked
+    // against a dummy hash, so they take as long as a wrong password.
+    Customer* authenticateCustomer(const string& uname, const string& pwd) {
+        if(Customer* customer = sessions.find(uname, pwd)) {
+            return customer;
+        }
+        Customer* customer = nullptr;
+        string_view cred; // a heap customer's hash or the mapping's; neither changes once written
+        {
+            shared_lock<shared_mutex> lock(bankMutex);
+            auto it = customerIndex.find(uname);
+            if(it != customerIndex.end()) {
+                customer = it->second;
+                cred = customer->getCredential();
+            }
+            else if(mapped) {
+                int64_t row = mapped->findCustomer(uname);
+                if(row >= 0) {
+                    cred = mapped->credential(row);
+                }
+            }
+        }
+        if(cred.empty()) {
+            call_once(unknownUserOnce, [this]() { unknownUserCredential = PasswordHash::create("", passwordIterations); });
+            PasswordHash::verify(unknownUserCredential, pwd);
+            return nullptr;
+        }
+        if(!PasswordHash::verify(cred, pwd)) {
+            return nullptr;
+        }
+        if(!customer) {
+            customer = findCustomer(uname);
+        }
+        sessions.remember(uname, pwd, customer);
+        return customer;
+    }
+
+    // Key-stretching rounds for passwords hashed from now on (existing hashes keep their own)
+    void setPasswordIterations(uint32_t iterations) {
+        if(iterations == 0) {
+            throw invalid_argument("Password hashing needs at least one iteration.");
+        }
+        passwordIterations = iterations;
+    }
+
+    // Replace the debit limit rules; an empty list lifts all limits. Every window starts
+    // empty, and customers still only in the mapped snapshot get theirs when first copied.
+    void setLimits(const vector<LimitRule>& rules) {
+        auto policy = make_unique<LimitPolicy>();
+        for(const LimitRule& rule : rules) {
+            if(rule.windowMicros <= 0 || rule.maxAmount < Money() || (rule.maxAmount == Money() && rule.maxCount == 0)) {
+                throw invalid_argument("A limit needs a positive window and an amount or count cap.");
+            }
+            (rule.scope == LimitScope::Account ? policy->accountRules : policy->customerRules).push_back(rule);
+        }
+        if(rules.empty()) {
+            policy.reset();
+        }
+        unique_lock<shared_mutex> lock(bankMutex);
+        for(size_t c = 0; c < customers.size(); ++c) {
+            CustomerLimits& owner = customers[c].getLimits();
+            {
+                lock_guard<mutex> ownerLock(owner.mtx);
+                if(policy) {
+                    owner.windows.reset(policy->customerRules, &heapMemory);
+                }
+                else {
+                    owner.windows.clear();
+                }
+            }
+            for(Account* account : customers[c].getAccounts()) {
+                account->attachLimits(policy.get(), &owner, &heapMemory);
+            }
+        }
+        limitPolicy = move(policy);
+    }
+
+    // Bound on cached logins; 0 turns the session cache off
+    void setSessionCacheCapacity(size_t capacity) {
+        sessions.setCapacity(capacity);
+    }
+
+    // Find account by account number. An account still in the mapped snapshot is copied
+    // onto the heap (with the rest of its customer) so the caller can change it.
+    Account* findAccount(const string& accNum) {
+        {
+            shared_lock<shared_mutex> lock(bankMutex);
+            auto it = accountIndex.find(accNum);
+            if(it != accountIndex.end()) {
+                return it->second;
+            }
+            if(!mapped) {
+                return nullptr;
+            }
+        }
+        unique_lock<shared_mutex> lock(bankMutex);
+        int64_t row = mapped->findAccount(accNum);
+        if(row < 0) {
+            return nullptr;
+        }
+        materializeCustomer(mapped->owner(row));
+        return accountIndex.at(accNum);
+    }
+
+    // One page of an account's history (see Account::queryHistory); nullopt if there is no such account.
+    // An account still in the mapped snapshot is copied out first, as by findAccount.
+    optional<size_t> queryHistory(const string& accNum, const HistoryQuery& query, vector<Transaction>& page) {
+        Account* account = findAccount(accNum);
+        if(!account) {
+            return nullopt;
+        }
+        return account->queryHistory(query, page);
+    }
+
+    // Running totals over every account in the bank. Reading them costs the same however many
+    // accounts there are, and they reflect each deposit, withdrawal, interest posting, loan
+    // payment and transfer either wholly or not at all.
+    BookTotals bookTotals() const {
+        return totals.read();
+    }
+
+    // Running totals of one customer's accounts; nullopt if there is no such customer.
+    // A customer still in the mapped snapshot is counted from its rows.
+    optional<BookTotals> customerTotals(const string& uname) const {
+        shared_lock<shared_mutex> lock(bankMutex);
+        auto it = customerIndex.find(uname);
+        if(it != customerIndex.end()) {
+            return it->second->getTotals().read();
+        }
+        int64_t row = mapped ? mapped->findCustomer(uname) : -1;
+        if(row < 0) {
+            return nullopt;
+        }
+        BookTotals mine;
+        uint32_t first = mapped->firstAccount(row);
+        for(uint32_t a = first; a < first + mapped->accountsOf(row); ++a) {
+            Account::State state = mapped->state(a);
+            mine += BookTotals::of(mapped->kind(a), state.balance, state.principal);
+        }
+        return mine;
+    }
+
+    // Write the bank-wide totals as Prometheus gauges
+    void dumpTotalsPrometheus(ostream& out) const {
+        static const char* KIND_NAMES[BookTotals::KINDS] = {"savings", "checking", "loan"};
+        BookTotals book = bookTotals();
+        out << "# HELP safetransact_accounts Open accounts, by account type.\n"
+            << "# TYPE safetransact_accounts gauge\n";
+        for(int k = 0; k < BookTotals::KINDS; ++k) {
+            out << "safetransact_accounts{account=\"" << KIND_NAMES[k] << "\"} " << book.accounts[k] << "\n";
+        }
+        out << "# HELP safetransact_balance_dollars Sum of account balances, by account type.\n"
+            << "# TYPE safetransact_balance_dollars gauge\n";
+        for(int k = 0; k < BookTotals::KINDS; ++k) {
+            out << "safetransact_balance_dollars{account=\"" << KIND_NAMES[k] << "\"} " << book.balance[k] << "\n";
+        }
+        out << "# HELP safetransact_deposits_dollars Savings and checking funds held, overdrawn accounts counting as zero.\n"
+            << "# TYPE safetransact_deposits_dollars gauge\n"
+            << "safetransact_deposits_dollars " << book.deposits() << "\n"
+            << "# HELP safetransact_loan_principal_dollars Outstanding loan principal.\n"
+            << "# TYPE safetransact_loan_principal_dollars gauge\n"
+            << "safetransact_loan_principal_dollars " << book.loanPrincipal << "\n"
+            << "# HELP safetransact_overdraft_dollars How far checking accounts are overdrawn in total.\n"
+            << "# TYPE safetransact_overdraft_dollars gauge\n"
+            << "safetransact_overdraft_dollars " << book.overdraft << "\n";
+    }
+
+    // Display an account without copying it out of the snapshot; returns false if unknown
+    bool displayAccount(const string& accNum) const {
+        shared_lock<shared_mutex> lock(bankMutex);
+        auto it = accountIndex.find(accNum);
+        if(it != accountIndex.end()) {
+            it->second->display();
+            return true;
+        }
+        int64_t row = mapped ? mapped->findAccount(accNum) : -1;
+        if(row < 0) {
+            return false;
+        }
+        mapped->displayAccount(row);
+        return true;
+    }
+
+    // Resolve many account numbers with one shared lock. Numbers that miss the heap index
+    // are retried through findAccount (copying snapshot-backed accounts onto the heap).
+    // Empty and unknown numbers resolve to nullptr.
+    void findAccounts(const vector<string_view>& numbers, vector<Account*>& accounts) {
+        accounts.assign(numbers.size(), nullptr);
+        bool missed = false;
+        {
+            shared_lock<shared_mutex> lock(bankMutex);
+            for(size_t i = 0; i < numbers.size(); ++i) {
+                auto it = accountIndex.find(numbers[i]);
+                if(it != accountIndex.end()) {
+                    accounts[i] = it->second;
+                }
+                else {
+                    missed |= !numbers[i].empty();
+                }
+            }
+        }
+        for(size_t i = 0; missed && mapped && i < numbers.size(); ++i) {
+            if(!accounts[i] && !numbers[i].empty()) {
+                accounts[i] = findAccount(string(numbers[i]));
+            }
+        }
+    }
+
+    // Atomically move funds between two accounts of any type, safe to call from many threads.
+    // A decline is returned as a status; nothing has moved unless it is Ok. A transfer posts
+    // one debit and one credit, linked by a new transfer ID, and costs the same however
+    // long the accounts' histories are.
+    TxnStatus tryTransfer(const string& fromAcc, const string& toAcc, Money amount) {
+        Account* source = findAccount(fromAcc);
+        Account* destination = findAccount(toAcc);
+
+        if(!source || !destination) {
+            Metrics::instance().recordFailure(MetricOp::Transfer, source ? source->getKind() : UNRESOLVED_ACCOUNT,
+                                              TxnStatus::AccountNotFound, 0);
+            return TxnStatus::AccountNotFound;
+        }
+        return tryTransfer(*source, *destination, amount);
+    }
+
+    TxnStatus tryTransfer(Account& source, Account& destination, Money amount) {
+        return metered(MetricOp::Transfer, source.getKind(), [&] {
+            if(&source == &destination) {
+                return TxnStatus::SameAccount;
+            }
+            if(amount <= Money()) {
+                return TxnStatus::InvalidAmount;
+            }
+
+            // Always lock in account-number order so opposing transfers cannot deadlock
+            Account* first = &source;
+            Account* second = &destination;
+            if(second->getAccountNumber() < first->getAccountNumber()) {
+                swap(first, second);
+            }
+            lock_guard<recursive_mutex> firstLock(first->getMutex());
+            lock_guard<recursive_mutex> secondLock(second->getMutex());
+
+            // The debit is the only leg that can be refused, so it goes first and nothing needs
+            // undoing. It takes the next transfer ID only once it is allowed, so a declined
+            // transfer leaves no gap in the IDs.
+            uint64_t transferId = 0;
+            TransferBatch batch(*this);
+            TxnStatus status = visitAccount(source, [&](auto& account) {
+                return account.debitTransfer(amount, [&]() {
+                    return transferId = lastTransferId.fetch_add(1, memory_order_relaxed) + 1;
+                });
+            });
+            if(status != TxnStatus::Ok) {
+                return status;
+            }
+            visitAccount(destination, [&](auto& account) { account.creditTransfer(amount, transferId); });
+            batch.publish();
+            return TxnStatus::Ok;
+        });
+    }
+
+    // Throwing forms of tryTransfer
+    void applyTransfer(const string& fromAcc, const string& toAcc, Money amount) {
+        throwIfFailed(tryTransfer(fromAcc, toAcc, amount), "Withdrawal");
+    }
+
+    void applyTransfer(Account& source, Account& destination, Money amount) {
+        throwIfFailed(tryTransfer(source, destination, amount), "Withdrawal");
+    }
+
+    // Transfer funds between accounts
+    void transferFunds(const string& fromAcc, const string& toAcc, Money amount) {
+        applyTransfer(fromAcc, toAcc, amount);
+        cout << "Transferred $" << amount 
+             << " from " << fromAcc << " to " << toAcc << " successfully.\n";
+    }
+
+    // Month-end batch: apply interest to every savings account and process every loan payment.
+    // Balances are gathered into columns, run through the accrual kernels and posted back,
+    // one journal entry per account, with the work split across the worker pool. Only the
+    // rates are kept as columns; balances are read and posted under each account's lock, so
+    // the posting, not the arithmetic, sets the pace.
+    AccrualSummary runMonthEndAccrual(unsigned threads = thread::hardware_concurrency()) {
+        // Every account is about to change, so nothing can stay in the mapped snapshot
+        materializeAll();
+        lock_guard<mutex> runLock(accrualMutex);
+        shared_lock<shared_mutex> lock(bankMutex);
+        AccrualSummary summary;
+        summary.savingsAccounts = savingsAccounts.size();
+        summary.loanAccounts = loanAccounts.size();
+        mutex totalsMutex;
+
+        size_t rows = max(savingsAccounts.size(), loanAccounts.size());
+        amountColumn.resize(rows);
+        interestColumn.resize(rows);
+        principalColumn.resize(rows);
+        paymentColumn.resize(rows);
+
+        parallelFor(savingsAccounts.size(), threads, [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; ++i) {
+                amountColumn[i] = savingsAccounts[i].getBalance().getCents();
+            }
+            accrueColumn(amountColumn.data() + begin, savingsRates.data() + begin, interestColumn.data() + begin,
+                         end - begin, RoundingMode::HalfEven);
+            Money credited;
+            for(size_t i = begin; i < end; ++i) {
+                credited += savingsAccounts[i].postInterest(Money::fromCents(amountColumn[i]), Money::fromCents(interestColumn[i]));
+            }
+            lock_guard<mutex> totalsLock(totalsMutex);
+            summary.interestCredited += credited;
+        });
+
+        parallelFor(loanAccounts.size(), threads, [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; ++i) {
+                amountColumn[i] = loanAccounts[i].getLoanAmount().getCents();
+            }
+            accrueColumn(amountColumn.data() + begin, loanRates.data() + begin, interestColumn.data() + begin,
+                         end - begin, RoundingMode::HalfEven);
+            for(size_t i = begin; i < end; ++i) {
+                principalColumn[i] = amountColumn[i] + interestColumn[i];
+            }
+            accrueColumn(principalColumn.data() + begin, LoanAccount::MONTHLY_PAYMENT_RATE.getMicros(), paymentColumn.data() + begin,
+                         end - begin, RoundingMode::HalfUp);
+            Money charged;
+            for(size_t i = begin; i < end; ++i) {
+                charged += loanAccounts[i].postMonthlyPayment(Money::fromCents(amountColumn[i]),
+                    Money::fromCents(interestColumn[i]), Money::fromCents(paymentColumn[i]));
+            }
+            lock_guard<mutex> totalsLock(totalsMutex);
+            summary.loanInterestCharged += charged;
+        });
+        return summary;
+    }
+
+    // Schedule a loan's monthly installment (see LoanAccount::processMonthlyPayment), first at
+    // firstDue and then every period microseconds, or once if period is 0
+    ScheduleId scheduleLoanInstallment(const string& loanAcc, int64_t firstDue, int64_t period) {
+        LoanAccount* loan = accountAs<LoanAccount>(findAccount(loanAcc));
+        if(!loan) {
+            throw invalid_argument("No loan account " + loanAcc);
+        }
+        return scheduleLoanInstallment(*loan, firstDue, period);
+    }
+
+    ScheduleId scheduleLoanInstallment(LoanAccount& loan, int64_t firstDue, int64_t period) {
+        return addScheduled({ScheduledKind::LoanInstallment, &loan}, firstDue, period);
+    }
+
+    // Schedule interest postings to a savings account, as scheduleLoanInstallment
+    ScheduleId scheduleInterest(const string& savingsAcc, int64_t firstDue, int64_t period) {
+        SavingsAccount* savings = accountAs<SavingsAccount>(findAccount(savingsAcc));
+        if(!savings) {
+            throw invalid_argument("No savings account " + savingsAcc);
+        }
+        return scheduleInterest(*savings, firstDue, period);
+    }
+
+    ScheduleId scheduleInterest(SavingsAccount& savings, int64_t firstDue, int64_t period) {
+        return addScheduled({ScheduledKind::InterestPosting, &savings}, firstDue, period);
+    }
+
+    // Schedule a standing transfer, as scheduleLoanInstallment. Each run goes through
+    // tryTransfer, and one the source cannot pay is skipped until its next run.
+    ScheduleId scheduleTransfer(const string& fromAcc, const string& toAcc, Money amount, int64_t firstDue, int64_t period) {
+        Account* source = findAccount(fromAcc);
+        Account* destination = findAccount(toAcc);
+        if(!source || !destination) {
+            throw invalid_argument(statusMessage(TxnStatus::AccountNotFound));
+        }
+        return scheduleTransfer(*source, *destination, amount, firstDue, period);
+    }
+
+    ScheduleId scheduleTransfer(Account& source, Account& destination, Money amount, int64_t firstDue, int64_t period) {
+        if(&source == &destination) {
+            throw invalid_argument(statusMessage(TxnStatus::SameAccount));
+        }
+        if(amount <= Money()) {
+            throw invalid_argument(statusMessage(TxnStatus::InvalidAmount, "Transfer"));
+        }
+        return addScheduled({ScheduledKind::StandingTransfer, &source, &destination, amount}, firstDue, period);
+    }
+
+    // Stop a scheduled job; false if it has run its last time or was already cancelled
+    bool cancelScheduled(ScheduleId id) {
+        lock_guard<mutex> lock(scheduleMutex);
+        return schedule.cancel(id);
+    }
+
+    size_t scheduledCount() {
+        lock_guard<mutex> lock(scheduleMutex);
+        return schedule.size();
+    }
+
+    // Memory held by the scheduled jobs and the wheel
+    size_t scheduleMemory() {
+        lock_guard<mutex> lock(scheduleMutex);
+        return schedule.memoryBytes();
+    }
+
+    // Run every job due by now, in parallel batches. A batch holds all the jobs due before the
+    // first time one of them is due again, so when runs have been missed (the bank was down,
+    // or now is far ahead) they are caught up one period per batch. Jobs can be added and
+    // cancelled while a batch runs.
+    ScheduleSummary runScheduled(int64_t now = TimestampClock::now(), unsigned threads = thread::hardware_concurrency()) {
+        lock_guard<mutex> runLock(scheduleRunMutex);
+        ScheduleSummary summary;
+        while(true) {
+            dueJobs.clear();
+            dueOperations.clear();
+            {
+                lock_guard<mutex> lock(scheduleMutex);
+                schedule.collectDue(now / SCHEDULE_TICK_MICROS, dueJobs);
+                for(uint32_t index : dueJobs) {
+                    dueOperations.push_back(schedule.operation(index));
+                    schedule.reschedule(index);
+                }
+            }
+            if(dueOperations.empty()) {
+                return summary;
+            }
+            atomic<size_t> declined{0};
+            parallelFor(dueOperations.size(), threads, [&](size_t begin, size_t end) {
+                size_t refused = 0;
+                for(size_t i = begin; i < end; ++i) {
+                    const ScheduledOperation& operation = dueOperations[i];
+                    switch(operation.kind) {
+                        case ScheduledKind::LoanInstallment:
+                            static_cast<LoanAccount*>(operation.account)->processMonthlyPayment();
+                            break;
+                        case ScheduledKind::InterestPosting:
+                            static_cast<SavingsAccount*>(operation.account)->applyInterest();
+                            break;
+                        case ScheduledKind::StandingTransfer:
+                            refused += tryTransfer(*operation.account, *operation.counterparty, operation.amount) != TxnStatus::Ok;
+                            break;
+                    }
+                }
+                declined.fetch_add(refused, memory_order_relaxed);
+            });
+            ++summary.rounds;
+            summary.operations += dueOperations.size();
+            summary.declined += declined.load();
+        }
+    }
+
+    // Run due jobs in the background, every tick, until the bank is destroyed. The thread
+    // starts with the first scheduled job, so a bank that schedules nothing has none.
+    void startScheduler() {
+        schedulerRequested = true;
+        if(scheduledCount() > 0) {
+            launchScheduler();
+        }
+    }
+
+    // Write statements for period for every account to path, one customer after another.
+    // Workers render runs of customers into reusable buffers a round at a time. Each round's
+    // buffers go to the file in customer order with writev on a writer thread, while the
+    // workers render the next round into a second set of buffers.
+    StatementSummary exportStatements(const string& path, StatementFormat format, const StatementPeriod& period,
+                                      unsigned threads = thread::hardware_concurrency()) {
+        auto start = chrono::steady_clock::now();
+        // Statements read every account, so take them all out of the mapped snapshot first
+        materializeAll();
+        shared_lock<shared_mutex> lock(bankMutex);
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            throw runtime_error("Cannot create " + path + ": " + strerror(errno));
+        }
+
+        const size_t customersPerRun = 256;
+        threads = max(1u, threads);
+        size_t runs = (customers.size() + customersPerRun - 1) / customersPerRun;
+        size_t window = min<size_t>(threads * 8, IOV_MAX - 2);
+        vector<OutputBuffer> buffers(2 * window);
+        vector<iovec> pending;
+        atomic<size_t> accountCount{0};
+        atomic<size_t> transactionCount{0};
+        StatementSummary summary;
+        summary.customers = customers.size();
+        bool first = true;
+
+        // Round by round: the worker pool renders one set of buffers while one of its tasks
+        // writes the set rendered the round before
+        vector<iovec> writing;
+        auto takePending = [&]() {
+            for(const auto& buffer : pending) {
+                summary.bytes += buffer.iov_len;
+            }
+            writing.swap(pending);
+            pending.clear();
+        };
+
+        try {
+            string_view header = StatementRenderer::header(format);
+            pending.push_back({const_cast<char*>(header.data()), header.size()});
+            for(size_t base = 0, round = 0; base < runs; base += window, ++round) {
+                size_t roundRuns = min(window, runs - base);
+                OutputBuffer* set = buffers.data() + (round % 2) * window;
+                takePending();
+                // Item 0 is the write, item r + 1 renders run r
+                parallelFor(roundRuns + 1, threads, [&](size_t begin, size_t end) {
+                    size_t accounts = 0, transactions = 0;
+                    for(size_t item = begin; item < end; ++item) {
+                        if(item == 0) {
+                            writeBuffers(fd, writing);
+                            continue;
+                        }
+                        OutputBuffer& out = set[item - 1];
+                        out.clear();
+                        StatementRenderer renderer(out, format);
+                        size_t firstCustomer = (base + item - 1) * customersPerRun;
+                        size_t lastCustomer = min(customers.size(), firstCustomer + customersPerRun);
+                        for(size_t c = firstCustomer; c < lastCustomer; ++c) {
+                            for(Account* account : customers[c].getAccounts()) {
+                                transactions += renderer.render(customers[c], *account, period);
+                                ++accounts;
+                            }
+                        }
+                    }
+                    accountCount += accounts;
+                    transactionCount += transactions;
+                }, 1);
+                for(size_t r = 0; r < roundRuns; ++r) {
+                    OutputBuffer& out = set[r];
+                    size_t skip = first && format == StatementFormat::Json && !out.empty() ? 1 : 0;
+                    first = first && out.empty();
+                    if(out.size() > skip) {
+                        pending.push_back({out.data() + skip, out.size() - skip});
+                    }
+                }
+            }
+            string_view footer = StatementRenderer::footer(format);
+            pending.push_back({const_cast<char*>(footer.data()), footer.size()});
+            takePending();
+            writeBuffers(fd, writing);
+        }
+        catch(...) {
+            ::close(fd);
+            throw;
+        }
+        if(::close(fd) != 0) {
+            throw runtime_error("Cannot write " + path + ": " + strerror(errno));
+        }
+        summary.accounts = accountCount;
+        summary.transactions = transactionCount;
+        summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return summary;
+    }
+
+    // Report the bank's object pools, arena and heap usage
+    // Allocations the bank has made from the heap, for checking that a path does not allocate
+    AllocationStats memoryStats() const { return heapMemory.stats(); }
+
+    void printMemoryStats(ostream& out) {
+        shared_lock<shared_mutex> lock(bankMutex);
+        size_t slabs = savingsAccounts.chunkCount() + checkingAccounts.chunkCount() + loanAccounts.chunkCount() + customers.chunkCount();
+        size_t slabBytes = savingsAccounts.bytesReserved() + checkingAccounts.bytesReserved() +
+                           loanAccounts.bytesReserved() + customers.bytesReserved();
+        AllocationStats heap = heapMemory.stats();
+        out << "Memory: " << savingsAccounts.size() << " savings, " << checkingAccounts.size() << " checking and "
+            << loanAccounts.size() << " loan accounts, " << customers.size() << " customers in "
+            << slabs << " slabs (" << slabBytes / 1024 << " KiB)\n"
+            << "Memory: arena has handed out " << arena.used() / 1024 << " KiB for strings, account lists and journals\n"
+            << "Memory: " << heap.allocations << " heap allocations, " << heap.deallocations << " frees, "
+            << heap.bytesInUse / 1024 << " KiB in use, peak " << heap.peakBytes / 1024 << " KiB\n";
+    }
+
+    // Display all customers
+    void displayAllCustomers() const {
+        shared_lock<shared_mutex> lock(bankMutex);
+        auto show = [](const Customer& customer) {
+            customer.displayCustomer();
+            cout << "Accounts:\n";
+            for(const auto& account : customer.getAccounts()) {
+                account->display();
+                cout << "\n";
+            }
+            cout << "-----------------------------\n";
+        };
+        // Snapshot customers first, straight from the mapping unless they have been copied out
+        unordered_set<const Customer*> fromSnapshot;
+        if(mapped) {
+            for(uint64_t row = 0; row < mapped->customerCount(); ++row) {
+                auto it = materializedCustomers.find(static_cast<uint32_t>(row));
+                if(it != materializedCustomers.end()) {
+                    show(*it->second);
+                    fromSnapshot.insert(it->second);
+                    continue;
+                }
+                Customer::printDetails(mapped->name(row), mapped->email(row), mapped->username(row));
+                cout << "Accounts:\n";
+                uint32_t first = mapped->firstAccount(row);
+                for(uint32_t a = first; a < first + mapped->accountsOf(row); ++a) {
+                    mapped->displayAccount(a);
+                    cout << "\n";
+                }
+                cout << "-----------------------------\n";
+            }
+        }
+        for(size_t c = 0; c < customers.size(); ++c) {
+            if(!fromSnapshot.count(&customers[c])) {
+                show(customers[c]);
+            }
+        }
+    }
+};
+
+// Function to process transactions
+void processTransaction(Account& account, char type, Money amount, const string& description = "") {
+    try {
+        switch(type) {
+            case 'D':
+                if(TxnStatus status = account.tryDeposit(amount); status != TxnStatus::Ok) {
+                    cerr << "Transaction failed: "
+                         << statusMessage(status, account.getKind() == AccountKind::Loan ? "Repayment" : "Deposit") << "\n";
+                    return;
+                }
+                cout << "Deposited $" << amount << " successfully.\n";
+                break;
+            case 'W':
+                if(TxnStatus status = account.tryWithdraw(amount); status != TxnStatus::Ok) {
+                    cerr << "Transaction failed: " << statusMessage(status, "Withdrawal") << "\n";
+                    return;
+                }
+                cout << "Withdrew $" << amount << " successfully.\n";
+                break;
+            case 'T':
+                // Transfer handled separately
+                break;
+            default:
+                throw invalid_argument("Invalid transaction type.");
+        }
+    }
+    catch(const exception& e) {
+        cerr << "Transaction failed: " << e.what() << "\n";
+    }
+}
+
+// Batched, pipelined ingestion of command files.
+// A command file has one command per line:
+//   D,<account>,<amount>       deposit
+//   W,<account>,<amount>       withdrawal
+//   T,<from>,<to>,<amount>     transfer
+// Blank lines and lines starting with '#' are skipped. Three threads run the stages:
+// parsing, resolving account numbers to accounts a batch at a time, and applying. Bounded
+// queues of batches sit between them, so a file of any size streams through in constant
+// memory. Each command's result goes to an output file as "line,OK" or "line,FAILED,reason".
+
+// Fixed-capacity blocking queue between pipeline stages; close() ends the stream
+template<typename T>
+class BoundedQueue {
+private:
+    mutex mtx;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t maxItems) : capacity(maxItems) {}
+
+    // Blocks while the queue is full; returns false, dropping item, once the queue is closed
+    bool push(T item) {
+        unique_lock<mutex> lock(mtx);
+        notFull.wait(lock, [this]() { return items.size() < capacity || closed; });
+        if(closed) {
+            return false;
+        }
+        items.push_back(move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty; returns false once it is closed and drained
+    bool pop(T& item) {
+        unique_lock<mutex> lock(mtx);
+        notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+        if(items.empty()) {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// One parsed command on its way through the pipeline
+struct IngestCommand {
+    uint64_t line = 0;
+    char type = 0;
+    string from;
+    string to;
+    Money amount;
+    string error; // set when the line could not be parsed or resolved
+    Account* source = nullptr;
+    Account* destination = nullptr;
+};
+
+using IngestBatch = vector<IngestCommand>;
+
+// Totals from an ingestion run
+struct IngestSummary {
+    uint64_t commands = 0;
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint64_t errors = 0; // commands the bank could not process, as opposed to declined
+    double seconds = 0;
+};
+
+// Parse one command line into cmd; returns false for blank and comment lines
+bool parseIngestLine(string_view text, IngestCommand& cmd) {
+    while(!text.empty() && (text.back() == '\r' || text.back() == ' ')) {
+        text.remove_suffix(1);
+    }
+    if(text.empty() || text[0] == '#') {
+        return false;
+    }
+    string_view fields[4];
+    size_t count = 0;
+    while(count < 4) {
+        size_t comma = text.find(',');
+        fields[count++] = text.substr(0, comma);
+        if(comma == string_view::npos) {
+            text = string_view();
+            break;
+        }
+        text.remove_prefix(comma + 1);
+    }
+    try {
+        if(!text.empty() || fields[0].size() != 1) {
+            throw invalid_argument("Malformed command.");
+        }
+        cmd.type = fields[0][0];
+        if((cmd.type == 'D' || cmd.type == 'W') && count == 3) {
+            cmd.from = fields[1];
+            cmd.amount = Money::parse(fields[2]);
+        }
+        else if(cmd.type == 'T' && count == 4) {
+            cmd.from = fields[1];
+            cmd.to = fields[2];
+            cmd.amount = Money::parse(fields[3]);
+        }
+        else {
+            throw invalid_argument("Malformed command.");
+        }
+    }
+    catch(const exception& e) {
+        cmd.error = e.what();
+    }
+    return true;
+}
+
+// Stream the commands in inputPath through bank, writing one result line per command
+IngestSummary runIngestion(Bank& bank, const string& inputPath, const string& outputPath, size_t batchSize = 1024) {
+    ifstream input(inputPath);
+    if(!input) {
+        throw runtime_error("Cannot open command file " + inputPath);
+    }
+    ofstream output(outputPath);
+    if(!output) {
+        throw runtime_error("Cannot write results to " + outputPath);
+    }
+
+    const size_t QUEUE_BATCHES = 8;
+    BoundedQueue<IngestBatch> parsed(QUEUE_BATCHES);
+    BoundedQueue<IngestBatch> resolved(QUEUE_BATCHES);
+    IngestSummary summary;
+    auto start = chrono::steady_clock::now();
+
+    // Stage 1: parse lines into batches
+    thread parser([&]() {
+        IngestBatch batch;
+        batch.reserve(batchSize);
+        string line;
+        uint64_t lineNumber = 0;
+        while(getline(input, line)) {
+            IngestCommand cmd;
+            cmd.line = ++lineNumber;
+            if(!parseIngestLine(line, cmd)) {
+                continue;
+            }
+            batch.push_back(move(cmd));
+            if(batch.size() == batchSize) {
+                if(!parsed.push(move(batch))) {
+                    return;
+                }
+                batch = IngestBatch();
+                batch.reserve(batchSize);
+            }
+        }
+        if(!batch.empty()) {
+            parsed.push(move(batch));
+        }
+        parsed.close();
+    });
+
+    // Stage 2: resolve every account number in a batch under one lookup
+    thread resolver([&]() {
+        IngestBatch batch;
+        vector<string_view> numbers;
+        vector<Account*> accounts;
+        while(parsed.pop(batch)) {
+            numbers.clear();
+            for(const auto& cmd : batch) {
+                numbers.push_back(cmd.from);
+                numbers.push_back(cmd.to);
+            }
+            bank.findAccounts(numbers, accounts);
+            for(size_t i = 0; i < batch.size(); ++i) {
+                IngestCommand& cmd = batch[i];
+                cmd.source = accounts[2 * i];
+                cmd.destination = accounts[2 * i + 1];
+                if(cmd.error.empty() && (!cmd.source || (cmd.type == 'T' && !cmd.destination))) {
+                    cmd.error = "Account not found.";
+                }
+            }
+            if(!resolved.push(move(batch))) {
+                break;
+            }
+        }
+        resolved.close();
+    });
+
+    // Stage 3 (this thread): apply in file order and record the results. If applying or
+    // committing throws, the queues are closed so the other stages stop, and both are
+    // joined before the error propagates.
+    try {
+        string results;
+        IngestBatch batch;
+        while(resolved.pop(batch)) {
+            for(auto& cmd : batch) {
+                bool fault = false;
+                if(cmd.error.empty()) {
+                    try {
+                        TxnStatus status;
+                        const char* amountName = "Withdrawal";
+                        switch(cmd.type) {
+                            case 'D':
+                                status = cmd.source->tryDeposit(cmd.amount);
+                                amountName = cmd.source->getKind() == AccountKind::Loan ? "Repayment" : "Deposit";
+                                break;
+                            case 'W': status = cmd.source->tryWithdraw(cmd.amount); break;
+                            default: status = bank.tryTransfer(*cmd.source, *cmd.destination, cmd.amount); break;
+                        }
+                        if(status != TxnStatus::Ok) {
+                            cmd.error = statusMessage(status, amountName);
+                        }
+                    }
+                    catch(const exception& e) {
+                        // Declines come back as a status; an exception is a fault in the bank
+                        cerr << "Command on line " << cmd.line << " failed: " << e.what() << "\n";
+                        fault = true;
+                    }
+                }
+                results += to_string(cmd.line);
+                if(fault) {
+                    results += ",ERROR,internal_error\n";
+                    ++summary.errors;
+                }
+                else if(cmd.error.empty()) {
+                    results += ",OK\n";
+                    ++summary.succeeded;
+                }
+                else {
+                    results += ",FAILED,";
+                    results += cmd.error;
+                    results += '\n';
+                    ++summary.failed;
+                }
+            }
+            summary.commands += batch.size();
+            // One durability wait per batch, so the log's group commit covers the whole batch
+            bank.commit();
+            output << results;
+            results.clear();
+        }
+    }
+    catch(...) {
+        parsed.close();
+        resolved.close();
+        parser.join();
+        resolver.join();
+        throw;
+    }
+    parser.join();
+    resolver.join();
+    output.flush();
+    if(!output) {
+        throw runtime_error("Failed writing results to " + outputPath);
+    }
+    summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return summary;
+}
+
+// Write a random command file for load testing: commands over accounts ST0..ST<accounts-1>
+// (as created by buildStressBank), or over the demo accounts when accounts is 0
+void writeIngestFile(const string& path, uint64_t count, int accounts) {
+    ofstream out(path);
+    if(!out) {
+        throw runtime_error("Cannot write " + path);
+    }
+    vector<string> numbers;
+    if(accounts > 0) {
+        for(int i = 0; i < accounts; ++i) {
+            numbers.push_back("ST" + to_string(i));
+        }
+    }
+    else {
+        numbers = {"SA1001", "CA1001", "SA2001"};
+    }
+    mt19937_64 rng(2024);
+    uniform_int_distribution<size_t> pick(0, numbers.size() - 1);
+    uniform_int_distribution<int64_t> cents(100, 50000);
+    uniform_int_distribution<int> kind(0, 9);
+    out << "# SafeTransact command file: " << count << " commands\n";
+    for(uint64_t i = 0; i < count; ++i) {
+        Money amount = Money::fromCents(cents(rng));
+        int k = kind(rng);
+        if(k < 4) {
+            out << "D," << numbers[pick(rng)] << "," << amount << "\n";
+        }
+        else if(k < 7) {
+            out << "W," << numbers[pick(rng)] << "," << amount << "\n";
+        }
+        else {
+            out << "T," << numbers[pick(rng)] << "," << numbers[pick(rng)] << "," << amount << "\n";
+        }
+    }
+}
+
+// Sharded bank.
+// Customers and accounts are hash-partitioned over N independent Bank shards, each with its
+// own pools, arena and indexes. Every shard is driven by one worker thread pinned to a core;
+// all of a shard's memory is first touched by that worker, and only the worker touches the
+// shard's accounts, so operations on one shard share no state with the others. An account lives on
+// the shard its number hashes to, so routing needs no directory. The owner's record is
+// copied to each shard that holds one of their accounts, and logins go to the shard the
+// username hashes to (checked on the caller's thread, since hashing is slow and the Bank is
+// thread-safe).
+//
+// Clients submit deposits, withdrawals and transfers in batches. A transfer between two
+// shards runs a two-phase protocol over the workers' inboxes: the source shard reserves the
+// funds by debiting the source account and asks the destination shard to credit them; the
+// destination answers with the outcome, and the source commits or, if the credit was
+// refused, releases the reservation back to the source account. Until the answer arrives
+// the reserved funds are counted as in flight on the source shard.
+
+// A deposit ('D'), withdrawal ('W') or transfer ('T') submitted to a sharded bank
+struct ShardCommand {
+    char type = 0;
+    string from; // the account for deposits and withdrawals
+    string to;
+    Money amount;
+};
+
+// Counts the outstanding operations of one or more submissions; wait() returns when none are left.
+// The count only changes under mtx: the waiter usually owns the completion on its stack and
+// destroys it as soon as wait() returns, so the last finish() must be done with the mutex and
+// condition variable before the waiter can see the count reach zero.
+class ShardCompletion {
+private:
+    uint64_t outstanding = 0;
+    mutex mtx;
+    condition_variable finished;
+
+public:
+    void expect(uint64_t operations) {
+        lock_guard<mutex> lock(mtx);
+        outstanding += operations;
+    }
+
+    void finish() {
+        lock_guard<mutex> lock(mtx);
+        if(--outstanding == 0) {
+            finished.notify_all();
+        }
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(mtx);
+        finished.wait(lock, [this]() { return outstanding == 0; });
+    }
+};
+
+enum class ShardOp : uint8_t {
+    Deposit,
+    Withdraw,
+    Transfer,
+    Credit, // phase two, to the destination shard: credit funds reserved on the origin shard
+    Settle, // back to the origin shard: the credit's outcome
+    Run     // run a task against the shard's bank
+};
+
+struct ShardMessage {
+    ShardOp op;
+    uint32_t origin = 0;       // Credit: shard to settle with
+    uint64_t transferId = 0;   // Credit, Settle; carried by both legs, qualified by the origin shard
+    string account;            // Deposit, Withdraw and Transfer source; Credit destination
+    string counterparty;       // Transfer destination
+    Money amount;
+    TxnStatus status = TxnStatus::Ok; // Settle
+    TxnStatus* result = nullptr;
+    ShardCompletion* completion = nullptr;
+    function<void(Bank&)> task; // Run
+};
+
+// Unbounded inbox of a shard worker. Producers (clients and other workers) append under a
+// lock; the worker takes everything queued at once. It is unbounded so two workers
+// exchanging transfer messages can never block on each other.
+class ShardInbox {
+private:
+    mutex mtx;
+    condition_variable ready;
+    vector<ShardMessage> messages;
+    bool closed = false;
+
+public:
+    void push(ShardMessage message) {
+        lock_guard<mutex> lock(mtx);
+        messages.push_back(move(message));
+        if(messages.size() == 1) {
+            ready.notify_one();
+        }
+    }
+
+    // Append and empty batch
+    void pushAll(vector<ShardMessage>& batch) {
+        if(batch.empty()) {
+            return;
+        }
+        lock_guard<mutex> lock(mtx);
+        bool wasEmpty = messages.empty();
+        move(batch.begin(), batch.end(), back_inserter(messages));
+        batch.clear();
+        if(wasEmpty) {
+            ready.notify_one();
+        }
+    }
+
+    // Swap everything queued into batch (which must be empty), blocking while there is nothing;
+    // returns false once the inbox is closed and drained
+    bool takeAll(vector<ShardMessage>& batch) {
+        unique_lock<mutex> lock(mtx);
+        ready.wait(lock, [this]() { return !messages.empty() || closed; });
+        if(messages.empty()) {
+            return false;
+        }
+        swap(batch, messages);
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        ready.notify_one();
+    }
+};
+
+class ShardedBank {
+private:
+    // A transfer whose funds are reserved on this shard, awaiting the destination's answer
+    struct PendingTransfer {
+        Account* source;
+        Money amount;
+        TxnStatus* result;
+        ShardCompletion* completion;
+        chrono::steady_clock::time_point start;
+    };
+
+    struct Shard {
+        uint32_t index;
+        unique_ptr<Bank> bank; // built by the worker
+        ShardInbox inbox;
+        thread worker;
+        // Worker-only state
+        unordered_map<uint64_t, PendingTransfer> pending;
+        uint64_t nextTransferId = 1; // sequence part of this shard's cross-shard transfer IDs
+        atomic<int64_t> inFlightCents{0}; // reserved and not yet settled; read by reserved()
+    };
+
+    vector<unique_ptr<Shard>> shards;
+
+    static uint64_t crossShardTransferId(uint32_t origin, uint64_t sequence) {
+        return (uint64_t(origin) + 1) << ORIGIN_SHIFT | sequence;
+    }
+
+    static void finish(TxnStatus* result, ShardCompletion* completion, TxnStatus status) {
+        if(result) {
+            *result = status;
+        }
+        if(completion) {
+            completion->finish();
+        }
+    }
+
+    static void pinToCore(thread& worker, uint32_t core) {
+        unsigned cores = thread::hardware_concurrency();
+        if(cores == 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core % cores, &set);
+        pthread_setaffinity_np(worker.native_handle(), sizeof(set), &set);
+    }
+
+    void run(Shard& shard) {
+        shard.bank = make_unique<Bank>();
+        vector<ShardMessage> batch;
+        while(shard.inbox.takeAll(batch)) {
+            for(ShardMessage& message : batch) {
+                handle(shard, message);
+            }
+            batch.clear();
+        }
+    }
+
+    void handle(Shard& shard, ShardMessage& message) {
+        Bank& bank = *shard.bank;
+        switch(message.op) {
+            case ShardOp::Deposit:
+            case ShardOp::Withdraw: {
+                Account* account = bank.findAccount(message.account);
+                TxnStatus status = TxnStatus::AccountNotFound;
+                if(account) {
+                    status = message.op == ShardOp::Deposit ? account->tryDeposit(message.amount)
+                                                            : account->tryWithdraw(message.amount);
+                }
+                else {
+                    Metrics::instance().recordFailure(message.op == ShardOp::Deposit ? MetricOp::Deposit : MetricOp::Withdraw,
+                                                      UNRESOLVED_ACCOUNT, status, 0);
+                }
+                finish(message.result, message.completion, status);
+                break;
+            }
+            case ShardOp::Transfer: {
+                uint32_t target = shardOf(message.counterparty);
+                if(target == shard.index) {
+                    finish(message.result, message.completion, bank.tryTransfer(message.account, message.counterparty, message.amount));
+                    break;
+                }
+                Account* source = bank.findAccount(message.account);
+                if(!source) {
+                    Metrics::instance().recordFailure(MetricOp::Transfer, UNRESOLVED_ACCOUNT, TxnStatus::AccountNotFound, 0);
+                    finish(message.result, message.completion, TxnStatus::AccountNotFound);
+                    break;
+                }
+                // Phase one: reserve the funds here by posting the debit leg
+                auto start = chrono::steady_clock::now();
+                Money amount = message.amount;
+                uint64_t id = crossShardTransferId(shard.index, shard.nextTransferId);
+                TxnStatus status = amount <= Money() ? TxnStatus::InvalidAmount
+                    : visitAccount(*source, [&](auto& account) {
+                          return account.debitTransfer(amount, [id]() { return id; });
+                      });
+                if(status != TxnStatus::Ok) {
+                    Metrics::instance().recordFailure(MetricOp::Transfer, source->getKind(), status,
+                        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                    finish(message.result, message.completion, status);
+                    break;
+                }
+                ++shard.nextTransferId;
+                shard.pending.emplace(id, PendingTransfer{source, amount, message.result, message.completion, start});
+                shard.inFlightCents.fetch_add(amount.getCents(), memory_order_relaxed);
+                ShardMessage credit;
+                credit.op = ShardOp::Credit;
+                credit.origin = shard.index;
+                credit.transferId = id;
+                credit.account = move(message.counterparty);
+                credit.amount = amount;
+                shards[target]->inbox.push(move(credit));
+                break;
+            }
+            case ShardOp::Credit: {
+                Account* destination = bank.findAccount(message.account);
+                ShardMessage settle;
+                settle.op = ShardOp::Settle;
+                settle.transferId = message.transferId;
+                settle.status = TxnStatus::AccountNotFound;
+                if(destination) {
+                    visitAccount(*destination, [&](auto& account) { account.creditTransfer(message.amount, message.transferId); });
+                    settle.status = TxnStatus::Ok;
+                }
+                shards[message.origin]->inbox.push(move(settle));
+                break;
+            }
+            case ShardOp::Settle: {
+                // Phase two: commit, or if the credit was refused release the reservation with a
+                // reversal leg under the same transfer ID
+                auto it = shard.pending.find(message.transferId);
+                PendingTransfer transfer = it->second;
+                shard.pending.erase(it);
+                if(message.status != TxnStatus::Ok) {
+                    visitAccount(*transfer.source, [&](auto& account) {
+                        account.creditTransfer(transfer.amount, message.transferId, DESC_TRANSFER_REVERSAL);
+                    });
+                }
+                shard.inFlightCents.fetch_sub(transfer.amount.getCents(), memory_order_relaxed);
+                uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - transfer.start).count();
+                if(message.status == TxnStatus::Ok) {
+                    Metrics::instance().record(MetricOp::Transfer, transfer.source->getKind(), ns);
+                }
+                else {
+                    Metrics::instance().recordFailure(MetricOp::Transfer, transfer.source->getKind(), message.status, ns);
+                }
+                finish(transfer.result, transfer.completion, message.status);
+                break;
+            }
+            case ShardOp::Run:
+                message.task(bank);
+                finish(nullptr, message.completion, TxnStatus::Ok);
+                break;
+        }
+    }
+
+public:
+    // Cross-shard transfer IDs carry the origin shard above this bit, so they never collide with
+    // one another or with the IDs a shard's bank gives its own transfers
+    static constexpr int ORIGIN_SHIFT = 48;
+
+    explicit ShardedBank(uint32_t shardCount = max(1u, thread::hardware_concurrency())) {
+        if(shardCount == 0) {
+            throw invalid_argument("A sharded bank needs at least one shard.");
+        }
+        for(uint32_t i = 0; i < shardCount; ++i) {
+            shards.push_back(make_unique<Shard>());
+            shards.back()->index = i;
+        }
+        for(auto& shard : shards) {
+            shard->worker = thread(&ShardedBank::run, this, ref(*shard));
+            pinToCore(shard->worker, shard->index);
+        }
+        // Each worker builds its bank before taking its first message
+        for(uint32_t i = 0; i < shardCount; ++i) {
+            runOn(i, [](Bank&) {});
+        }
+    }
+
+    ShardedBank(const ShardedBank&) = delete;
+    ShardedBank& operator=(const ShardedBank&) = delete;
+
+    ~ShardedBank() {
+        for(auto& shard : shards) {
+            shard->inbox.close();
+        }
+        for(auto& shard : shards) {
+            shard->worker.join();
+        }
+    }
+
+    uint32_t shardCount() const { return static_cast<uint32_t>(shards.size()); }
+
+    // The shard an account number or username belongs to
+    uint32_t shardOf(string_view key) const {
+        return static_cast<uint32_t>(hashString(key) % shards.size());
+    }
+
+    // Run task on shard's worker and wait for it
+    void runOn(uint32_t shard, function<void(Bank&)> task) {
+        ShardCompletion completion;
+        completion.expect(1);
+        ShardMessage message;
+        message.op = ShardOp::Run;
+        message.task = move(task);
+        message.completion = &completion;
+        shards.at(shard)->inbox.push(move(message));
+        completion.wait();
+    }
+
+    // A shard's bank, for reading while no operations are in flight
+    Bank& shardBank(uint32_t shard) {
+        return *shards.at(shard)->bank;
+    }
+
+    // Add a customer on the shard their username hashes to (the login shard)
+    Customer& addCustomer(const string& uname, const string& pwd, const string& nm, const string& mail) {
+        Customer* customer = nullptr;
+        exception_ptr error;
+        runOn(shardOf(uname), [&](Bank& bank) {
+            try {
+                customer = &bank.addCustomer(uname, pwd, nm, mail);
+            }
+            catch(...) {
+                error = current_exception();
+            }
+        });
+        if(error) {
+            rethrow_exception(error);
+        }
+        return *customer;
+    }
+
+    // Open an account of type T on the shard its number hashes to, copying the owner's
+    // record there first if the owner lives on another shard
+    template<typename T, typename... Args>
+    T& openAccount(Customer& owner, const string& accNum, Args&&... args) {
+        T* account = nullptr;
+        exception_ptr error;
+        runOn(shardOf(accNum), [&](Bank& bank) {
+            try {
+                string uname(owner.getUsername());
+                Customer* local = bank.findCustomer(uname);
+                if(!local) {
+                    local = &bank.addHashedCustomer(uname, string(owner.getCredential()), string(owner.getName()),
+                                                    string(owner.getEmail()));
+                }
+                account = &bank.openAccount<T>(*local, accNum, forward<Args>(args)...);
+            }
+            catch(...) {
+                error = current_exception();
+            }
+        });
+        if(error) {
+            rethrow_exception(error);
+        }
+        return *account;
+    }
+
+    // Check a login on the username's shard
+    Customer* authenticateCustomer(const string& uname, const string& pwd) {
+        return shards[shardOf(uname)]->bank->authenticateCustomer(uname, pwd);
+    }
+
+    // Queue commands, each routed to the shard of its first account. results[i] receives the
+    // status of commands[i], and completion finishes once per command as it is done.
+    void submit(const vector<ShardCommand>& commands, vector<TxnStatus>& results, ShardCompletion& completion) {
+        thread_local vector<vector<ShardMessage>> outgoing;
+        outgoing.resize(shards.size());
+        results.assign(commands.size(), TxnStatus::Ok);
+        completion.expect(commands.size());
+        for(size_t i = 0; i < commands.size(); ++i) {
+            const ShardCommand& cmd = commands[i];
+            ShardMessage message;
+            message.op = cmd.type == 'D' ? ShardOp::Deposit : cmd.type == 'W' ? ShardOp::Withdraw : ShardOp::Transfer;
+            message.account = cmd.from;
+            if(message.op == ShardOp::Transfer) {
+                message.counterparty = cmd.to;
+            }
+            message.amount = cmd.amount;
+            message.result = &results[i];
+            message.completion = &completion;
+            outgoing[shardOf(cmd.from)].push_back(move(message));
+        }
+        for(size_t s = 0; s < shards.size(); ++s) {
+            shards[s]->inbox.pushAll(outgoing[s]);
+        }
+    }
+
+    // Blocking single operations
+    TxnStatus tryDeposit(const string& accNum, Money amount) { return apply({'D', accNum, string(), amount}); }
+    TxnStatus tryWithdraw(const string& accNum, Money amount) { return apply({'W', accNum, string(), amount}); }
+    TxnStatus tryTransfer(const string& fromAcc, const string& toAcc, Money amount) { return apply({'T', fromAcc, toAcc, amount}); }
+
+    TxnStatus apply(const ShardCommand& command) {
+        vector<ShardCommand> commands{command};
+        vector<TxnStatus> results;
+        ShardCompletion completion;
+        submit(commands, results, completion);
+        completion.wait();
+        return results[0];
+    }
+
+    // Funds reserved by cross-shard transfers that have not yet settled
+    Money reserved() const {
+        int64_t cents = 0;
+        for(const auto& shard : shards) {
+            cents += shard->inFlightCents.load(memory_order_relaxed);
+        }
+        return Money::fromCents(cents);
+    }
+};
+
+// Request server.
+// --serve runs the bank for many concurrent sessions over a TCP port or a Unix socket. A
+// few event-loop threads each wait on epoll, and every connection is a C++20 coroutine that
+// suspends whenever its socket would block, so thousands of sessions share those threads.
+// The protocol is one request per line, answered by one line starting with "OK" or with
+// "ERR <reason>"; ACCOUNTS and HISTORY answer "OK <n>" followed by n lines.
+//
+//   LOGIN <username> <password>     OK <name>
+//   ACCOUNTS                        <number> <kind> <balance> per account
+//   DEPOSIT <account> <amount>      OK <balance>
+//   WITHDRAW <account> <amount>     OK <balance>
+//   TRANSFER <from> <to> <amount>   OK <balance of from>
+//   HISTORY <account> [limit]       <time> <type> <amount> <description> [#<transfer id>], newest first
+//   INTEREST                        OK <savings accounts credited>
+//   REPAY <loan account> <amount>   OK <balance>
+//   QUIT                            OK bye
+//
+// Every request but LOGIN needs a logged-in session, and the account it names (the source,
+// for a transfer) must belong to the session's customer. Password checks run on a helper
+// pool so key stretching does not stall a loop. Changes are durable before they are
+// answered: after each pass over its ready sockets a loop commits the log once for all
+// the sessions that changed something.
+
+// A coroutine that starts at once and frees itself when it returns
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Threads that run blocking work for event loops
+class OffloadPool {
+private:
+    BoundedQueue<function<void()>> jobs{1 << 16};
+    vector<thread> workers;
+
+public:
+    explicit OffloadPool(unsigned threads) {
+        for(unsigned t = 0; t < max(1u, threads); ++t) {
+            workers.emplace_back([this]() {
+                function<void()> job;
+                while(jobs.pop(job)) {
+                    job();
+                }
+            });
+        }
+    }
+
+    ~OffloadPool() {
+        close();
+    }
+
+    void submit(function<void()> job) {
+        jobs.push(move(job));
+    }
+
+    // Run the jobs already queued, then stop
+    void close() {
+        jobs.close();
+        for(auto& worker : workers) {
+            if(worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+};
+
+class EventLoop;
+
+// A non-blocking socket registered with a loop for reads and writes, edge-triggered. The
+// coroutine using it co_awaits ready() when the socket would block.
+class LoopSocket {
+private:
+    EventLoop& loop;
+    int fd;
+    bool owned;
+    coroutine_handle<> waiter;
+
+    friend class EventLoop;
+
+public:
+    // shared: fd is registered with several loops (a listening socket) and is not closed here
+    LoopSocket(EventLoop& eventLoop, int socketFd, bool shared = false);
+    ~LoopSocket();
+    LoopSocket(const LoopSocket&) = delete;
+    LoopSocket& operator=(const LoopSocket&) = delete;
+
+    int get() const { return fd; }
+
+    struct ReadyAwaiter {
+        LoopSocket& socket;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) { socket.waiter = handle; }
+        void await_resume() const noexcept {}
+    };
+
+    // Suspend until the socket may be readable or writable again
+    ReadyAwaiter ready() { return {*this}; }
+};
+
+class EventLoop {
+private:
+    int epollFd;
+    int wakeFd;
+    atomic<bool> stopRequested{false};
+    unordered_set<LoopSocket*> sockets;
+    vector<coroutine_handle<>> commitWaiters;
+    bool commitFailed = false; // the last commit threw; told to its waiters
+    mutex postedMutex;
+    vector<coroutine_handle<>> posted; // resumed on this loop, from other threads
+    multimap<chrono::steady_clock::time_point, coroutine_handle<>> sleepers; // by wake-up time
+    function<void()> commit;
+
+    friend class LoopSocket;
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = ::write(wakeFd, &one, sizeof(one));
+        (void)written;
+    }
+
+    // Milliseconds epoll_wait may block: until the first sleeper is due, or for ever
+    int waitTimeout() const {
+        if(sleepers.empty()) {
+            return -1;
+        }
+        auto delay = sleepers.begin()->first - chrono::steady_clock::now();
+        return static_cast<int>(max<int64_t>(0, chrono::ceil<chrono::milliseconds>(delay).count()));
+    }
+
+public:
+    // onCommit makes the changes of the loop's sessions durable (Bank::commit)
+    explicit EventLoop(function<void()> onCommit = nullptr) : commit(move(onCommit)) {
+        epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epollFd < 0 || wakeFd < 0) {
+            throw runtime_error("Cannot create event loop: " + string(strerror(errno)));
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Destroys the coroutines still suspended on this loop, which closes their sockets
+    ~EventLoop() {
+        vector<coroutine_handle<>> frames = move(commitWaiters);
+        frames.insert(frames.end(), posted.begin(), posted.end());
+        for(const auto& sleeper : sleepers) {
+            frames.push_back(sleeper.second);
+        }
+        for(LoopSocket* socket : sockets) {
+            if(socket->waiter) {
+                frames.push_back(socket->waiter);
+            }
+        }
+        for(auto frame : frames) {
+            frame.destroy();
+        }
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    // Resume the coroutines that become ready until stop() is called
+    void run() {
+        epoll_event events[256];
+        while(!stopRequested.load(memory_order_acquire)) {
+            int count = ::epoll_wait(epollFd, events, 256, commitWaiters.empty() ? waitTimeout() : 0);
+            if(count < 0 && errno != EINTR) {
+                throw runtime_error("epoll_wait failed: " + string(strerror(errno)));
+            }
+            for(int i = 0; i < count; ++i) {
+                if(events[i].data.ptr == nullptr) {
+                    uint64_t ignored;
+                    ssize_t drained = ::read(wakeFd, &ignored, sizeof(ignored));
+                    (void)drained;
+                    vector<coroutine_handle<>> ready;
+                    {
+                        lock_guard<mutex> lock(postedMutex);
+                        ready.swap(posted);
+                    }
+                    for(auto handle : ready) {
+                        handle.resume();
+                    }
+                    continue;
+                }
+                LoopSocket* socket = static_cast<LoopSocket*>(events[i].data.ptr);
+                if(auto handle = exchange(socket->waiter, nullptr)) {
+                    handle.resume();
+                }
+            }
+            auto now = chrono::steady_clock::now();
+            while(!sleepers.empty() && sleepers.begin()->first <= now) {
+                coroutine_handle<> handle = sleepers.begin()->second;
+                sleepers.erase(sleepers.begin());
+                handle.resume();
+            }
+            // One log commit for every session that changed something in this pass
+            while(!commitWaiters.empty()) {
+                commitFailed = false;
+                try {
+                    if(commit) {
+                        commit();
+                    }
+                }
+                catch(const exception& e) {
+                    commitFailed = true;
+                    cerr << "Commit failed: " << e.what() << "\n";
+                }
+                vector<coroutine_handle<>> committed;
+                committed.swap(commitWaiters);
+                for(auto handle : committed) {
+                    handle.resume();
+                }
+            }
+        }
+    }
+
+    // Ask run() to return; safe from any thread
+    void stop() {
+        stopRequested.store(true, memory_order_release);
+        wake();
+    }
+
+    struct CommitAwaiter {
+        EventLoop& loop;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) { loop.commitWaiters.push_back(handle); }
+        bool await_resume() const noexcept { return !loop.commitFailed; }
+    };
+
+    // Suspend until this pass's changes are durable; false if they could not be made so
+    CommitAwaiter committed() { return {*this}; }
+
+    struct SleepAwaiter {
+        EventLoop& loop;
+        chrono::steady_clock::time_point until;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) { loop.sleepers.emplace(until, handle); }
+        void await_resume() const noexcept {}
+    };
+
+    // Suspend for delay while the loop serves everything else; needs no descriptor
+    SleepAwaiter sleepFor(chrono::milliseconds delay) { return {*this, chrono::steady_clock::now() + delay}; }
+
+    struct OffloadAwaiter {
+        EventLoop& loop;
+        OffloadPool& pool;
+        function<void()> job;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) {
+            pool.submit([this, handle]() {
+                job();
+                loop.resumeLater(handle);
+            });
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Run job on pool, resuming on this loop when it is done
+    OffloadAwaiter offload(OffloadPool& pool, function<void()> job) { return {*this, pool, move(job)}; }
+
+    // Resume handle on this loop's thread; safe from any thread
+    void resumeLater(coroutine_handle<> handle) {
+        {
+            lock_guard<mutex> lock(postedMutex);
+            posted.push_back(handle);
+        }
+        wake();
+    }
+};
+
+inline LoopSocket::LoopSocket(EventLoop& eventLoop, int socketFd, bool shared) : loop(eventLoop), fd(socketFd), owned(!shared) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLET | (shared ? EPOLLEXCLUSIVE : EPOLLOUT | EPOLLRDHUP);
+    event.data.ptr = this;
+    if(::epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        throw runtime_error("Cannot watch socket: " + string(strerror(errno)));
+    }
+    loop.sockets.insert(this);
+}
+
+inline LoopSocket::~LoopSocket() {
+    loop.sockets.erase(this);
+    ::epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    if(owned) {
+        ::close(fd);
+    }
+}
+
+// Handle one request line (other than LOGIN) for a session whose customer is customer,
+// appending the reply to out. Returns false once the session should close; sets changed when
+// the request may have posted to an account.
+bool handleServerRequest(Bank& bank, Customer* customer, string_view line, string& out, bool& changed) {
+    string_view fields[5];
+    size_t count = 0;
+    while(!line.empty() && count < 5) {
+        size_t space = line.find(' ');
+        if(space != 0) {
+            fields[count++] = line.substr(0, space);
+        }
+        line.remove_prefix(space == string_view::npos ? line.size() : space + 1);
+    }
+    auto reply = [&](TxnStatus status, Money balance) {
+        if(status == TxnStatus::Ok) {
+            out += "OK ";
+            out += balance.toString();
+        }
+        else {
+            out += "ERR ";
+            out += statusName(status);
+        }
+        out += '\n';
+    };
+    // Accounts of other customers are reported as not found, so sessions cannot probe for them
+    auto ownAccount = [&](string_view number) -> Account* {
+        for(Account* account : customer->getAccounts()) {
+            if(account->getAccountNumber() == number) {
+                return account;
+            }
+        }
+        return nullptr;
+    };
+
+    string_view command = count ? fields[0] : string_view();
+    if(command == "QUIT") {
+        out += "OK bye\n";
+        return false;
+    }
+    if(!customer) {
+        out += count ? "ERR not_logged_in\n" : "ERR bad_request\n";
+        return true;
+    }
+    // Money::parse refuses malformed and out-of-range amounts
+    auto parseAmount = [&](string_view text, Money& amount) {
+        try {
+            amount = Money::parse(text);
+            return true;
+        }
+        catch(const exception&) {
+            reply(TxnStatus::InvalidAmount, Money());
+            return false;
+        }
+    };
+    size_t replyStart = out.size();
+    try {
+        if(command == "ACCOUNTS" && count == 1) {
+            const auto& accounts = customer->getAccounts();
+            out += "OK " + to_string(accounts.size()) + "\n";
+            for(Account* account : accounts) {
+                AccountKind kind = account->getKind();
+                out += account->getAccountNumber();
+                out += kind == AccountKind::Savings ? " savings " : kind == AccountKind::Checking ? " checking " : " loan ";
+                out += account->getBalance().toString();
+                out += '\n';
+            }
+        }
+        else if((command == "DEPOSIT" || command == "WITHDRAW" || command == "REPAY") && count == 3) {
+            Account* account = ownAccount(fields[1]);
+            Money amount;
+            if(!parseAmount(fields[2], amount)) {
+                return true;
+            }
+            if(!account) {
+                reply(TxnStatus::AccountNotFound, Money());
+            }
+            else if(command == "REPAY" && account->getKind() != AccountKind::Loan) {
+                reply(TxnStatus::NotPermitted, Money());
+            }
+            else {
+                changed = true;
+                TxnStatus status = command == "WITHDRAW" ? account->tryWithdraw(amount) : account->tryDeposit(amount);
+                reply(status, account->getBalance());
+            }
+        }
+        else if(command == "TRANSFER" && count == 4) {
+            Account* source = ownAccount(fields[1]);
+            Money amount;
+            if(!parseAmount(fields[3], amount)) {
+                return true;
+            }
+            Account* destination = source ? bank.findAccount(string(fields[2])) : nullptr;
+            if(!source || !destination) {
+                reply(TxnStatus::AccountNotFound, Money());
+            }
+            else {
+                changed = true;
+                TxnStatus status = bank.tryTransfer(*source, *destination, amount);
+                reply(status, source->getBalance());
+            }
+        }
+        else if(command == "HISTORY" && (count == 2 || count == 3)) {
+            Account* account = ownAccount(fields[1]);
+            if(!account) {
+                reply(TxnStatus::AccountNotFound, Money());
+                return true;
+            }
+            HistoryQuery query;
+            query.newestFirst = true;
+            query.limit = 20;
+            if(count == 3) {
+                size_t limit = 0;
+                auto [end, error] = from_chars(fields[2].data(), fields[2].data() + fields[2].size(), limit);
+                if(error != errc() || end != fields[2].data() + fields[2].size() || limit == 0) {
+                    out += "ERR bad_request\n";
+                    return true;
+                }
+                query.limit = min<size_t>(limit, 1000);
+            }
+            thread_local vector<Transaction> page;
+            account->queryHistory(query, page);
+            out += "OK " + to_string(page.size()) + "\n";
+            for(const Transaction& txn : page) {
+                char time[TIMESTAMP_TEXT_LENGTH];
+                formatTimestamp(txn.timestamp, time);
+                out.append(time, TIMESTAMP_TEXT_LENGTH);
+                switch(txn.type) {
+                    case TransactionType::Deposit: out += " deposit "; break;
+                    case TransactionType::Withdrawal: out += " withdrawal "; break;
+                    case TransactionType::Transfer: out += " transfer "; break;
+                    default: out += " loan "; break;
+                }
+                out += txn.amount.toString();
+                out += ' ';
+                out += txn.description();
+                if(txn.transferId) {
+                    out += " #" + to_string(txn.transferId);
+                }
+                out += '\n';
+            }
+        }
+        else if(command == "INTEREST" && count == 1) {
+            changed = true;
+            size_t credited = 0;
+            for(Account* account : customer->getAccounts()) {
+                if(auto sav = accountAs<SavingsAccount>(account)) {
+                    sav->applyInterest();
+                    ++credited;
+                }
+            }
+            out += "OK " + to_string(credited) + "\n";
+        }
+        else {
+            out += "ERR bad_request\n";
+        }
+    }
+    catch(const exception& e) {
+        // Anything else is a fault, possibly after a posting was made (a failed log append,
+        // say), so it is not reported as a refusal; the partial reply is dropped
+        out.resize(replyStart);
+        out += "ERR internal_error\n";
+        cerr << "Request failed: " << e.what() << "\n";
+    }
+    return true;
+}
+
+// Serve one connection until the client quits or disconnects
+DetachedTask serveSession(EventLoop& loop, int fd, Bank& bank, OffloadPool& pool) {
+    static constexpr size_t MAX_REQUEST = 4096;
+    LoopSocket socket(loop, fd);
+    Customer* customer = nullptr;
+    string in, out;
+    char buffer[4096];
+    bool open = true;
+    while(open) {
+        ssize_t received = ::read(fd, buffer, sizeof(buffer));
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await socket.ready();
+            continue;
+        }
+        if(received < 0 && errno == EINTR) {
+            continue;
+        }
+        if(received <= 0) {
+            break;
+        }
+        in.append(buffer, received);
+
+        // Answer every complete line received so far, then send the replies together
+        bool changed = false;
+        size_t start = 0, end;
+        while(open && (end = in.find('\n', start)) != string::npos) {
+            string_view line(in.data() + start, end - start);
+            start = end + 1;
+            if(!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if(line.substr(0, 6) == "LOGIN ") {
+                string_view rest = line.substr(6);
+                size_t space = rest.find(' ');
+                if(space == string_view::npos) {
+                    out += "ERR bad_request\n";
+                    continue;
+                }
+                string uname(rest.substr(0, space)), pwd(rest.substr(space + 1));
+                Customer* verified = nullptr;
+                co_await loop.offload(pool, [&]() { verified = bank.authenticateCustomer(uname, pwd); });
+                if(verified) {
+                    customer = verified;
+                    out += "OK ";
+                    out += customer->getName();
+                    out += '\n';
+                }
+                else {
+                    out += "ERR authentication_failed\n";
+                }
+                continue;
+            }
+            open = handleServerRequest(bank, customer, line, out, changed);
+        }
+        in.erase(0, start);
+        if(in.size() > MAX_REQUEST) {
+            out += "ERR bad_request\n";
+            open = false;
+        }
+        if(changed && !co_await loop.committed()) {
+            // Nothing this pass answered can be promised durable
+            out = "ERR internal_error\n";
+            open = false;
+        }
+
+        size_t sent = 0;
+        while(sent < out.size()) {
+            ssize_t written = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if(written > 0) {
+                sent += written;
+            }
+            else if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await socket.ready();
+            }
+            else if(written < 0 && errno == EINTR) {
+                continue;
+            }
+            else {
+                open = false;
+                break;
+            }
+        }
+        out.clear();
+    }
 }
 
-// Transaction Structure
-struct Transaction {
-    char type; // 'D' for deposit, 'W' for withdrawal, 'T' for transfer, 'L' for loan
-    double amount;
-    string date;
-    string description;
+// Accept connections on a listening socket shared by every loop, serving each on this loop.
+// When the process runs out of descriptors, connections already queued will not raise another
+// edge on the listener, so waiting for one would stall accepting. Instead the loop frees a
+// descriptor it holds in reserve, accepts and closes one queued connection to shed it, and
+// takes the reserve back; without a reserve it sleeps on the loop's timer for a moment and
+// retries, leaving the loop free to serve its other sessions meanwhile.
+DetachedTask acceptSessions(EventLoop& loop, int listenFd, Bank& bank, OffloadPool& pool) {
+    struct ReserveDescriptor {
+        int fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        ~ReserveDescriptor() {
+            if(fd >= 0) {
+                ::close(fd);
+            }
+        }
+    } reserve;
+    LoopSocket listener(loop, listenFd, true);
+    for(;;) {
+        int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd >= 0) {
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+            serveSession(loop, fd, bank, pool);
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_await listener.ready();
+        }
+        else if(errno == EMFILE || errno == ENFILE) {
+            if(reserve.fd < 0) {
+                co_await loop.sleepFor(chrono::milliseconds(10));
+                reserve.fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            ::close(reserve.fd);
+            int shed = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            int shedError = errno;
+            if(shed >= 0) {
+                ::close(shed);
+            }
+            reserve.fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if(shed < 0 && (shedError == EAGAIN || shedError == EWOULDBLOCK)) {
+                co_await listener.ready();
+            }
+        }
+        else if(errno != EINTR && errno != ECONNABORTED) {
+            cerr << "accept failed: " << strerror(errno) << "\n";
+            co_return;
+        }
+    }
+}
+
+// Serves a bank on address (a TCP port, host:port, or a Unix socket path) with threads
+// event loops until stop() is called
+class BankServer {
+private:
+    int listenFd = -1;
+    string socketPath;
+    OffloadPool pool{2};
+    vector<unique_ptr<EventLoop>> loops;
+    vector<thread> threads;
+
+    static int listenOn(const string& address, string& socketPath) {
+        bool tcp = address.find('/') == string::npos;
+        int fd = ::socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd < 0) {
+            throw runtime_error("Cannot create socket: " + string(strerror(errno)));
+        }
+        int result;
+        if(tcp) {
+            size_t colon = address.rfind(':');
+            string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(stoi(address.substr(colon == string::npos ? 0 : colon + 1))));
+            if(::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+                ::close(fd);
+                throw invalid_argument("Invalid listen address: " + address);
+            }
+            int one = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            result = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        else {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if(address.size() >= sizeof(addr.sun_path)) {
+                ::close(fd);
+                throw invalid_argument("Socket path is too long: " + address);
+            }
+            memcpy(addr.sun_path, address.c_str(), address.size() + 1);
+            ::unlink(address.c_str());
+            result = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            socketPath = address;
+        }
+        if(result != 0 || ::listen(fd, SOMAXCONN) != 0) {
+            string error = strerror(errno);
+            ::close(fd);
+            throw runtime_error("Cannot listen on " + address + ": " + error);
+        }
+        return fd;
+    }
+
+public:
+    BankServer(Bank& bank, const string& address, unsigned threadCount) {
+        listenFd = listenOn(address, socketPath);
+        for(unsigned t = 0; t < max(1u, threadCount); ++t) {
+            loops.push_back(make_unique<EventLoop>([&bank]() { bank.commit(); }));
+            acceptSessions(*loops.back(), listenFd, bank, pool);
+        }
+        for(auto& loop : loops) {
+            threads.emplace_back([&loop]() { loop->run(); });
+        }
+    }
+
+    BankServer(const BankServer&) = delete;
+    BankServer& operator=(const BankServer&) = delete;
+
+    ~BankServer() {
+        stop();
+        loops.clear();
+        ::close(listenFd);
+        if(!socketPath.empty()) {
+            ::unlink(socketPath.c_str());
+        }
+    }
 
-    Transaction(char t, double amt, const string& desc)
-        : type(t), amount(amt), date(getCurrentDate()), description(desc) {}
+    // Stop the loops and wait for them; the sessions still open are closed when the server is destroyed
+    void stop() {
+        for(auto& loop : loops) {
+            loop->stop();
+        }
+        for(auto& thread : threads) {
+            if(thread.joinable()) {
+                thread.join();
+            }
+        }
+        pool.close();
+    }
 };
 
-// Base Account Class
-class Account {
+// Key-stretching rounds for the generated customers of the stress test and benchmarks, so
+// banks of hundreds of thousands of customers build in seconds
+const uint32_t SYNTHETIC_PASSWORD_ITERATIONS = 1;
+
+// Create a bank of single-account customers for the stress test
+void buildStressBank(Bank& bank, int accountCount, Money openingBalance) {
+    bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    for(int i = 0; i < accountCount; ++i) {
+        string id = to_string(i);
+        Customer& customer = bank.addCustomer("user" + id, "pwd" + id, "Customer " + id, "user" + id + "@example.com");
+        bank.openAccount<CheckingAccount>(customer, "ST" + id, "Customer " + id, openingBalance, Money());
+    }
+}
+
+// The same, spread over the shards of a sharded bank
+void buildStressBank(ShardedBank& bank, int accountCount, Money openingBalance) {
+    for(uint32_t s = 0; s < bank.shardCount(); ++s) {
+        bank.runOn(s, [](Bank& shard) { shard.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS); });
+    }
+    for(int i = 0; i < accountCount; ++i) {
+        string id = to_string(i);
+        Customer& customer = bank.addCustomer("user" + id, "pwd" + id, "Customer " + id, "user" + id + "@example.com");
+        bank.openAccount<CheckingAccount>(customer, "ST" + id, "Customer " + id, openingBalance, Money());
+    }
+}
+
+// Sum of all balances in a stress bank
+Money totalFunds(Bank& bank, int accountCount) {
+    Money total;
+    for(int i = 0; i < accountCount; ++i) {
+        total += bank.findAccount("ST" + to_string(i))->getBalance();
+    }
+    return total;
+}
+
+// Multi-threaded stress test: contended random transfers must conserve total funds,
+// and transfers over disjoint accounts should scale with the thread count
+int runStressTest(int threadCount, int opsPerThread) {
+    cout << "Stress test: " << threadCount << " threads, " << opsPerThread << " transfers per thread\n";
+
+    // Contended phase: every thread transfers between the same few accounts
+    const int contendedAccounts = 8;
+    Bank contended;
+    buildStressBank(contended, contendedAccounts, Money::fromDollars(1000));
+    Money before = totalFunds(contended, contendedAccounts);
+    atomic<long> declined(0);
+    // Transfers never change the bank's deposits, so every read of the running totals must show the opening funds
+    atomic<bool> transferring{true};
+    atomic<long> polls{0}, badPolls{0};
+    thread poller([&]() {
+        while(transferring.load(memory_order_relaxed)) {
+            badPolls += contended.bookTotals().deposits() != before;
+            ++polls;
+        }
+    });
+    vector<thread> workers;
+    for(int t = 0; t < threadCount; ++t) {
+        workers.emplace_back([&, t]() {
+            mt19937 rng(t + 1);
+            uniform_int_distribution<int> pick(0, contendedAccounts - 1);
+            uniform_int_distribution<int> dollars(1, 200);
+            for(int i = 0; i < opsPerThread; ++i) {
+                int from = pick(rng);
+                int to = (from + 1 + pick(rng) % (contendedAccounts - 1)) % contendedAccounts;
+                try {
+                    contended.applyTransfer("ST" + to_string(from), "ST" + to_string(to), Money::fromDollars(dollars(rng)));
+                }
+                catch(const exception&) {
+                    ++declined;
+                }
+            }
+        });
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    transferring = false;
+    poller.join();
+    Money after = totalFunds(contended, contendedAccounts);
+    cout << "Contended: total before $" << before << ", after $" << after
+         << ", declined " << declined.load() << ", running totals read " << polls.load() << " times\n";
+    if(before != after) {
+        cerr << "Stress test failed: funds were not conserved.\n";
+        return 1;
+    }
+    if(badPolls.load() != 0 || contended.bookTotals().deposits() != after) {
+        cerr << "Stress test failed: " << badPolls.load() << " reads of the running totals saw part of a transfer.\n";
+        return 1;
+    }
+
+    // Totals phase: every kind of posting on every account type at once, after which the
+    // running totals must match a scan of the accounts, bank-wide and per customer
+    {
+        const int mixedCustomers = 64;
+        Bank mixed;
+        mixed.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+        vector<Account*> accounts;
+        for(int c = 0; c < mixedCustomers; ++c) {
+            string id = to_string(c);
+            Customer& customer = mixed.addCustomer("mix" + id, "pwd", "Customer " + id, "mix" + id + "@example.com");
+            accounts.push_back(&mixed.openAccount<SavingsAccount>(customer, "MS" + id, "Customer " + id,
+                                                                  Money::fromDollars(1000), Rate::fromMicros(20000)));
+            accounts.push_back(&mixed.openAccount<CheckingAccount>(customer, "MC" + id, "Customer " + id,
+                                                                   Money::fromDollars(100), Money::fromDollars(500)));
+            accounts.push_back(&mixed.openAccount<LoanAccount>(customer, "ML" + id, "Customer " + id,
+                                                               Money::fromDollars(5000), Rate::fromMicros(50000)));
+        }
+        workers.clear();
+        for(int t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&, t]() {
+                mt19937 rng(t + 101);
+                uniform_int_distribution<size_t> pick(0, accounts.size() - 1);
+                uniform_int_distribution<int> kind(0, 5);
+                uniform_int_distribution<int64_t> cents(1, 30000);
+                for(int i = 0; i < opsPerThread / 4; ++i) {
+                    Account* account = accounts[pick(rng)];
+                    Money amount = Money::fromCents(cents(rng));
+                    switch(kind(rng)) {
+                        case 0: account->tryDeposit(amount); break;
+                        case 1: account->tryWithdraw(amount); break;
+                        case 2: mixed.tryTransfer(*account, *accounts[pick(rng)], amount); break;
+                        case 3:
+                            if(auto sav = accountAs<SavingsAccount>(account)) {
+                                sav->applyInterest();
+                            }
+                            break;
+                        case 4:
+                            if(auto loan = accountAs<LoanAccount>(account)) {
+                                loan->processMonthlyPayment();
+                            }
+                            break;
+                        default: mixed.bookTotals(); break;
+                    }
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        BookTotals scanned;
+        bool customersMatch = true;
+        for(int c = 0; c < mixedCustomers; ++c) {
+            BookTotals mine;
+            for(int k = 0; k < 3; ++k) {
+                Account::State state = accounts[c * 3 + k]->getState();
+                mine += BookTotals::of(accounts[c * 3 + k]->getKind(), state.balance, state.principal);
+            }
+            customersMatch = customersMatch && mixed.customerTotals("mix" + to_string(c)) == mine;
+            scanned += mine;
+        }
+        BookTotals running = mixed.bookTotals();
+        cout << "Totals: deposits $" << running.deposits() << ", loan principal $" << running.loanPrincipal
+             << ", overdraft $" << running.overdraft << "\n";
+        if(!(running == scanned) || !customersMatch) {
+            cerr << "Stress test failed: running totals disagree with the accounts.\n";
+            return 1;
+        }
+    }
+
+    // Limits phase: threads withdraw and transfer $1 at a time out of one customer's accounts.
+    // The customer's daily cap must be reached exactly, and no account may pass its own
+    // count cap, however the debits interleave.
+    {
+        const int limitedAccounts = 4;
+        const Money dailyCap = Money::fromDollars(1000);
+        const uint32_t accountCap = 300;
+        Bank limited;
+        limited.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+        Customer& customer = limited.addCustomer("limited", "pwd", "Limited Customer", "limited@example.com");
+        Customer& payee = limited.addCustomer("payee", "pwd", "Payee", "payee@example.com");
+        vector<Account*> accounts;
+        for(int a = 0; a < limitedAccounts; ++a) {
+            accounts.push_back(&limited.openAccount<CheckingAccount>(customer, "LM" + to_string(a), "Limited Customer",
+                                                                     dailyCap, Money()));
+        }
+        Account& sink = limited.openAccount<CheckingAccount>(payee, "LP0", "Payee", Money(), Money());
+        limited.setLimits({{LimitScope::Customer, 86400 * MICROS_PER_SECOND, dailyCap, 0},
+                           {LimitScope::Account, 600 * MICROS_PER_SECOND, Money(), accountCap}});
+        atomic<int64_t> declined{0};
+        workers.clear();
+        for(int t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&, t]() {
+                for(int i = 0; i < opsPerThread; ++i) {
+                    Account& account = *accounts[(t + i) % limitedAccounts];
+                    TxnStatus status = i % 2 ? account.tryWithdraw(Money::fromDollars(1))
+                                             : limited.tryTransfer(account, sink, Money::fromDollars(1));
+                    if(status == TxnStatus::LimitExceeded) {
+                        declined.fetch_add(1, memory_order_relaxed);
+                    }
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        Money debited;
+        bool withinAccountCap = true;
+        for(Account* account : accounts) {
+            Money out = dailyCap - account->getBalance();
+            debited += out;
+            withinAccountCap = withinAccountCap && out <= Money::fromDollars(accountCap);
+        }
+        int64_t attempts = static_cast<int64_t>(threadCount) * opsPerThread;
+        cout << "Limits: $" << debited << " of a $" << dailyCap << " daily cap debited, " << declined.load()
+             << " debits declined\n";
+        if(debited != min(dailyCap, Money::fromDollars(attempts)) || !withinAccountCap ||
+           declined.load() != attempts - debited.getCents() / 100) {
+            cerr << "Stress test failed: debit limits were not enforced exactly.\n";
+            return 1;
+        }
+    }
+
+    // Scheduler phase: daily standing transfers around a ring of accounts for 30 simulated
+    // days, while another thread adds and cancels jobs due later. Every order still standing
+    // must run once a day, in one batch per day, and funds must be conserved.
+    {
+        const int ringAccounts = 2000;
+        const int days = 30;
+        const int64_t day = 86400 * MICROS_PER_SECOND;
+        Bank scheduled;
+        buildStressBank(scheduled, ringAccounts, Money::fromDollars(1000));
+        int64_t start = TimestampClock::now();
+        vector<ScheduleId> orders;
+        for(int i = 0; i < ringAccounts; ++i) {
+            orders.push_back(scheduled.scheduleTransfer("ST" + to_string(i), "ST" + to_string((i + 1) % ringAccounts),
+                                                        Money::fromDollars(1), start + day, day));
+        }
+        vector<bool> standing(ringAccounts, true);
+        for(int i = 0; i < ringAccounts; i += 4) {
+            standing[i] = !scheduled.cancelScheduled(orders[i]);
+        }
+        atomic<bool> churning{true};
+        atomic<size_t> churned{0};
+        thread churn([&]() {
+            mt19937 rng(7);
+            uniform_int_distribution<int> pick(0, ringAccounts - 1);
+            while(churning.load(memory_order_relaxed)) {
+                int a = pick(rng);
+                ScheduleId id = scheduled.scheduleTransfer("ST" + to_string(a), "ST" + to_string((a + 1) % ringAccounts),
+                                                           Money::fromDollars(1), start + 365 * day, day);
+                churned += scheduled.cancelScheduled(id);
+            }
+        });
+        auto begin = chrono::steady_clock::now();
+        ScheduleSummary summary = scheduled.runScheduled(start + days * day + SCHEDULE_TICK_MICROS, threadCount);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        churning = false;
+        churn.join();
+        size_t active = count(standing.begin(), standing.end(), true);
+        bool balancesMatch = true;
+        for(int i = 0; i < ringAccounts; ++i) {
+            Money expected = Money::fromDollars(1000 - days * standing[i] + days * standing[(i + ringAccounts - 1) % ringAccounts]);
+            balancesMatch = balancesMatch && scheduled.findAccount("ST" + to_string(i))->getBalance() == expected;
+        }
+        cout << "Scheduler: " << active << " standing orders ran for " << days << " days in " << summary.rounds << " batches ("
+             << summary.operations << " transfers) in " << fixed << setprecision(1) << seconds * 1000 << "ms, "
+             << churned.load() << " jobs added and cancelled meanwhile\n";
+        if(summary.rounds != static_cast<size_t>(days) || summary.operations != active * days || summary.declined != 0 ||
+           !balancesMatch || totalFunds(scheduled, ringAccounts) != Money::fromDollars(1000) * ringAccounts ||
+           scheduled.scheduledCount() != active) {
+            cerr << "Stress test failed: scheduled transfers did not run exactly once a day.\n";
+            return 1;
+        }
+    }
+
+    // Journal phase: threads append to one shared journal without any account lock
+    TransactionJournal journal;
+    workers.clear();
+    for(int t = 0; t < threadCount; ++t) {
+        workers.emplace_back([&, t]() {
+            for(int i = 0; i < opsPerThread; ++i) {
+                journal.append({static_cast<int64_t>(t), Money::fromCents(1), DESC_DEPOSIT, TransactionType::Deposit});
+            }
+        });
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    Money journaled;
+    journal.forEach([&](const Transaction& txn) { journaled += txn.amount; });
+    cout << "Journal: " << journal.size() << " records appended concurrently\n";
+    if(journaled != Money::fromCents(static_cast<int64_t>(threadCount) * opsPerThread) ||
+       journal.size() != static_cast<size_t>(threadCount) * opsPerThread) {
+        cerr << "Stress test failed: journal lost records.\n";
+        return 1;
+    }
+
+    // Metrics phase: many short-lived threads record in turn; exited threads' shards must be
+    // reused rather than piling up
+    {
+        const int rounds = 50;
+        size_t shardsBefore = Metrics::instance().shardCount();
+        for(int round = 0; round < rounds; ++round) {
+            workers.clear();
+            for(int t = 0; t < threadCount; ++t) {
+                workers.emplace_back([]() { Metrics::instance().record(MetricOp::Deposit, UNRESOLVED_ACCOUNT, 1); });
+            }
+            for(auto& worker : workers) {
+                worker.join();
+            }
+        }
+        size_t grown = Metrics::instance().shardCount() - shardsBefore;
+        cout << "Metrics: " << rounds * threadCount << " short-lived threads recorded into " << grown << " new shards\n";
+        if(grown > static_cast<size_t>(threadCount)) {
+            cerr << "Stress test failed: metrics shards of exited threads were not reused.\n";
+            return 1;
+        }
+    }
+
+    // Allocation phase: once accounts are open, deposits, withdrawals and transfers should not
+    // take memory from the bank's heap resource except for the occasional new arena block as
+    // journals grow
+    {
+        const int allocationAccounts = 1000;
+        const int allocationOps = 300000;
+        Bank quiet;
+        buildStressBank(quiet, allocationAccounts, Money::fromDollars(1000000));
+        // Limits far above what the phase debits, so that checking them is on the measured path
+        quiet.setLimits({{LimitScope::Account, 3600 * MICROS_PER_SECOND, Money::fromDollars(1000000), 0},
+                         {LimitScope::Customer, 86400 * MICROS_PER_SECOND, Money::fromDollars(1000000), 1000000}});
+        vector<string> numbers;
+        vector<Account*> accounts;
+        for(int i = 0; i < allocationAccounts; ++i) {
+            numbers.push_back("ST" + to_string(i));
+            accounts.push_back(quiet.findAccount(numbers.back()));
+        }
+        uint64_t before = quiet.memoryStats().allocations;
+        for(int i = 0; i < allocationOps; ++i) {
+            int a = i % allocationAccounts;
+            int b = (i * 7 + 1) % allocationAccounts;
+            switch(i % 3) {
+                case 0: accounts[a]->deposit(Money::fromDollars(2)); break;
+                case 1: accounts[a]->withdraw(Money::fromDollars(1)); break;
+                default:
+                    if(a != b) {
+                        quiet.applyTransfer(numbers[a], numbers[b], Money::fromDollars(1));
+                    }
+                    break;
+            }
+        }
+        uint64_t allocations = quiet.memoryStats().allocations - before;
+        cout << "Allocation: " << allocationOps << " deposits, withdrawals and transfers made " << allocations
+             << " heap allocations\n";
+        quiet.printMemoryStats(cout);
+        if(allocations > static_cast<uint64_t>(allocationOps) / 1000) {
+            cerr << "Stress test failed: the posting path allocates.\n";
+            return 1;
+        }
+    }
+
+    // Accrual phase: the batch month-end run must match per-account processing exactly
+    const int accrualAccounts = 200000;
+    Bank batch;
+    batch.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    vector<unique_ptr<SavingsAccount>> singleSavings;
+    vector<unique_ptr<LoanAccount>> singleLoans;
+    mt19937 rng(42);
+    uniform_int_distribution<int64_t> cents(0, 100000000);
+    uniform_int_distribution<int64_t> micros(0, 120000);
+    for(int i = 0; i < accrualAccounts; ++i) {
+        string id = to_string(i);
+        Money balance = Money::fromCents(cents(rng));
+        Rate rate = Rate::fromMicros(micros(rng));
+        Customer& customer = batch.addCustomer("acc" + id, "pwd", "Customer " + id, "acc" + id + "@example.com");
+        batch.openAccount<SavingsAccount>(customer, "SV" + id, "Customer " + id, balance, rate);
+        batch.openAccount<LoanAccount>(customer, "LN" + id, "Customer " + id, balance, rate);
+        singleSavings.push_back(make_unique<SavingsAccount>("SV" + id, "Customer " + id, balance, rate));
+        singleLoans.push_back(make_unique<LoanAccount>("LN" + id, "Customer " + id, balance, rate));
+    }
+    auto start = chrono::steady_clock::now();
+    AccrualSummary summary = batch.runMonthEndAccrual(threadCount);
+    double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for(int i = 0; i < accrualAccounts; ++i) {
+        singleSavings[i]->applyInterest();
+        singleLoans[i]->processMonthlyPayment();
+    }
+    double singleSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for(int i = 0; i < accrualAccounts; ++i) {
+        string id = to_string(i);
+        if(batch.findAccount("SV" + id)->getBalance() != singleSavings[i]->getBalance() ||
+           batch.findAccount("LN" + id)->getBalance() != singleLoans[i]->getBalance() ||
+           accountAs<LoanAccount>(batch.findAccount("LN" + id))->getLoanAmount() != singleLoans[i]->getLoanAmount()) {
+            cerr << "Stress test failed: batch accrual differs for account " << id << ".\n";
+            return 1;
+        }
+    }
+    cout << "Accrual: " << summary.savingsAccounts + summary.loanAccounts << " accounts, interest $"
+         << summary.interestCredited << ", loan interest $" << summary.loanInterestCharged
+         << ", batch " << fixed << setprecision(3) << batchSeconds << "s vs per-account " << singleSeconds << "s\n";
+
+    // Persistence phase: checkpoint and reload a large bank, replaying transfers from the log
+    const int persistedAccounts = 200000;
+    string dataDir = (filesystem::temp_directory_path() / ("safetransact-stress-" + to_string(getpid()))).string();
+    filesystem::remove_all(dataDir);
+    vector<Money> expected(persistedAccounts);
+    vector<size_t> expectedHistory(persistedAccounts);
+    {
+        Bank original;
+        original.enablePersistence(dataDir, chrono::seconds(0));
+        buildStressBank(original, persistedAccounts, Money::fromDollars(1000));
+        start = chrono::steady_clock::now();
+        original.checkpoint();
+        double checkpointSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        workers.clear();
+        for(int t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&, t]() {
+                mt19937 rng(t + 100);
+                uniform_int_distribution<int> pick(0, persistedAccounts - 1);
+                for(int i = 0; i < opsPerThread; ++i) {
+                    try {
+                        original.applyTransfer("ST" + to_string(pick(rng)), "ST" + to_string(pick(rng)), Money::fromDollars(5));
+                    }
+                    catch(const exception&) {
+                        // same-account picks and declines are expected
+                    }
+                }
+                original.commit();
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        for(int i = 0; i < persistedAccounts; ++i) {
+            auto account = original.findAccount("ST" + to_string(i));
+            expected[i] = account->getBalance();
+            expectedHistory[i] = account->getTransactions().size();
+        }
+        cout << "Persistence: checkpointed " << persistedAccounts << " accounts in "
+             << fixed << setprecision(3) << checkpointSeconds << "s\n";
+    }
+    {
+        // Opening maps the snapshot and replays the log; only the customers the log touches
+        // are copied onto the heap. Checkpointing then merges them with the mapped rows.
+        Bank recovered;
+        start = chrono::steady_clock::now();
+        recovered.enablePersistence(dataDir, chrono::seconds(0));
+        double openSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        recovered.checkpoint();
+        cout << "Persistence: opened snapshot + log in " << fixed << setprecision(1) << openSeconds * 1000 << "ms\n";
+    }
+    {
+        Bank recovered;
+        start = chrono::steady_clock::now();
+        recovered.enablePersistence(dataDir, chrono::seconds(0));
+        double openSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for(int i = 0; i < persistedAccounts; ++i) {
+            auto account = recovered.findAccount("ST" + to_string(i));
+            if(!account || account->getBalance() != expected[i] || account->getTransactions().size() != expectedHistory[i]) {
+                cerr << "Stress test failed: recovered state differs for account ST" << i << ".\n";
+                return 1;
+            }
+        }
+        double recoverySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Persistence: reopened merged snapshot in " << fixed << setprecision(1) << openSeconds * 1000
+             << "ms, copied every account onto the heap in " << setprecision(3) << recoverySeconds << "s ("
+             << setprecision(0) << persistedAccounts / recoverySeconds << " accounts/sec)\n";
+    }
+    {
+        // A torn record at the end of the log is cut off on recovery, so that what is logged
+        // after it is still replayed the next time
+        string lastSegment;
+        for(const auto& entry : filesystem::directory_iterator(dataDir)) {
+            string name = entry.path().filename().string();
+            if(name.compare(0, 4, "wal-") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) {
+                lastSegment = max(lastSegment, entry.path().string());
+            }
+        }
+        ofstream(lastSegment, ios::binary | ios::app) << string(11, '\x7f');
+        {
+            Bank reopened;
+            reopened.enablePersistence(dataDir, chrono::seconds(0));
+            reopened.findAccount("ST0")->deposit(Money::fromDollars(1));
+            reopened.commit();
+        }
+        Bank recovered;
+        recovered.enablePersistence(dataDir, chrono::seconds(0));
+        if(recovered.findAccount("ST0")->getBalance() != expected[0] + Money::fromDollars(1)) {
+            cerr << "Stress test failed: a deposit logged after a torn record was lost.\n";
+            return 1;
+        }
+        cout << "Persistence: recovered past a torn log record\n";
+    }
+    {
+        // A snapshot with a damaged body must be refused, not read out of bounds
+        string snapshotPath = dataDir + "/snapshot.bin";
+        string damagedPath = dataDir + "/damaged.bin";
+        uint64_t snapshotSize = filesystem::file_size(snapshotPath);
+        filesystem::copy_file(snapshotPath, damagedPath);
+        {
+            fstream damaged(damagedPath, ios::binary | ios::in | ios::out);
+            damaged.seekg(static_cast<streamoff>(snapshotSize / 2));
+            char byte = static_cast<char>(damaged.get());
+            damaged.seekp(static_cast<streamoff>(snapshotSize / 2));
+            damaged.put(static_cast<char>(byte ^ 0x5a));
+        }
+        bool refused = false;
+        try {
+            MappedSnapshot::open(damagedPath);
+        }
+        catch(const runtime_error&) {
+            refused = true;
+        }
+        filesystem::remove(damagedPath);
+        if(!refused || !MappedSnapshot::open(snapshotPath)) {
+            cerr << "Stress test failed: a damaged snapshot was accepted.\n";
+            return 1;
+        }
+    }
+    filesystem::remove_all(dataDir);
+
+    // Sharded phase: random transfers over four shards, most of them between shards. Some
+    // overdraw and some go to an account that does not exist, so the two-phase protocol
+    // both commits and releases reservations; funds must be conserved either way.
+    {
+        const int shardedAccounts = 1000;
+        ShardedBank sharded(4);
+        buildStressBank(sharded, shardedAccounts, Money::fromDollars(1000));
+        atomic<uint64_t> released{0};
+        workers.clear();
+        start = chrono::steady_clock::now();
+        for(int t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&, t]() {
+                mt19937 rng(t + 500);
+                uniform_int_distribution<int> pick(0, shardedAccounts - 1);
+                uniform_int_distribution<int64_t> cents(1, 150000);
+                vector<ShardCommand> batch(256);
+                vector<TxnStatus> results;
+                for(int done = 0; done < opsPerThread; done += batch.size()) {
+                    for(auto& cmd : batch) {
+                        cmd.type = 'T';
+                        cmd.from = "ST" + to_string(pick(rng));
+                        cmd.to = pick(rng) % 50 == 0 ? "ST-missing" : "ST" + to_string(pick(rng));
+                        cmd.amount = Money::fromCents(cents(rng));
+                    }
+                    ShardCompletion completion;
+                    sharded.submit(batch, results, completion);
+                    completion.wait();
+                    released += count(results.begin(), results.end(), TxnStatus::AccountNotFound);
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Money total;
+        for(int i = 0; i < shardedAccounts; ++i) {
+            string number = "ST" + to_string(i);
+            total += sharded.shardBank(sharded.shardOf(number)).findAccount(number)->getBalance();
+        }
+        if(total != Money::fromDollars(1000) * shardedAccounts || sharded.reserved() != Money() || released == 0) {
+            cerr << "Stress test failed: sharded bank holds " << total << " with " << sharded.reserved() << " reserved.\n";
+            return 1;
+        }
+        // Every transfer, within a shard or across shards, committed or released, is one pair of
+        // legs under one ID that nets to zero, and no transfer posts anything else. A shard's own
+        // transfer IDs are only unique within the shard, so they are counted per shard.
+        map<pair<uint32_t, uint64_t>, pair<int, Money>> legs;
+        bool untagged = false;
+        for(int i = 0; i < shardedAccounts; ++i) {
+            string number = "ST" + to_string(i);
+            uint32_t shard = sharded.shardOf(number);
+            sharded.shardBank(shard).findAccount(number)->getTransactions().forEach([&](const Transaction& txn) {
+                if(txn.type == TransactionType::Transfer) {
+                    untagged = untagged || txn.transferId == 0;
+                    auto& leg = legs[{txn.transferId >> ShardedBank::ORIGIN_SHIFT ? 0 : shard + 1, txn.transferId}];
+                    leg.first++;
+                    leg.second += txn.amount;
+                }
+                else {
+                    untagged = true;
+                }
+            });
+        }
+        bool paired = all_of(legs.begin(), legs.end(), [](const auto& entry) {
+            return entry.second.first == 2 && entry.second.second == Money();
+        });
+        if(untagged || !paired) {
+            cerr << "Stress test failed: a sharded transfer did not post exactly one linked pair of legs.\n";
+            return 1;
+        }
+        cout << "Sharded: 4 shards, total " << total << " conserved, " << released.load()
+             << " transfers to a missing account released, " << fixed << setprecision(0)
+             << threadCount * static_cast<double>(opsPerThread) / seconds << " transfers/sec\n";
+    }
+
+    // Disjoint phase: each thread owns its own pair of accounts
+    for(int threads = 1; threads <= threadCount; threads *= 2) {
+        Bank disjoint;
+        buildStressBank(disjoint, threads * 2, Money::fromDollars(1000));
+        workers.clear();
+        start = chrono::steady_clock::now();
+        for(int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                string a = "ST" + to_string(2 * t);
+                string b = "ST" + to_string(2 * t + 1);
+                for(int i = 0; i < opsPerThread; ++i) {
+                    if(i % 2 == 0) {
+                        disjoint.applyTransfer(a, b, Money::fromDollars(1));
+                    }
+                    else {
+                        disjoint.applyTransfer(b, a, Money::fromDollars(1));
+                    }
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Disjoint: " << threads << " threads, "
+             << fixed << setprecision(0) << (threads * static_cast<double>(opsPerThread)) / seconds << " transfers/sec\n";
+    }
+    return 0;
+}
+
+// The account layout that the kind-tagged pools replaced, kept for the dispatch benchmark:
+// a virtual hierarchy with one shared_ptr heap object per account, found by copying the
+// shared_ptr and narrowed with dynamic_cast. Postings do the same work as Account::record.
+class LegacyAccount {
 protected:
     string accountNumber;
     string accountHolder;
-    double balance;
+    Money balance;
+    mutable recursive_mutex mtx;
+    TransactionJournal transactions;
+
+    void record(TransactionType type, Money amount, uint32_t descriptionId) {
+        transactions.append({TimestampClock::now(), amount, descriptionId, type});
+    }
 
 public:
-    // Constructor
-    Account(const string& accNum, const string& holder, double initialBalance)
+    LegacyAccount(const string& accNum, const string& holder, Money initialBalance)
         : accountNumber(accNum), accountHolder(holder), balance(initialBalance) {}
 
-    // Getter methods
-    string getAccountNumber() const { return accountNumber; }
-    string getAccountHolder() const { return accountHolder; }
-    double getBalance() const { return balance; }
+    Money getBalance() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        return balance;
+    }
 
-    // Deposit method
-    virtual void deposit(double amount) {
-        if(amount <= 0) {
+    virtual void deposit(Money amount) {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount <= Money()) {
             throw invalid_argument("Deposit amount must be positive.");
         }
         balance += amount;
     }
 
-    // Withdraw method (pure virtual)
-    virtual void withdraw(double amount) = 0;
+    virtual Account::State getState() const {
+        lock_guard<recursive_mutex> lock(mtx);
+        return {balance, Money(), Money()};
+    }
+
+    virtual void withdraw(Money amount) = 0;
+    virtual ~LegacyAccount() {}
+};
+
+class LegacySavingsAccount : public LegacyAccount {
+private:
+    Rate interestRate;
+
+public:
+    LegacySavingsAccount(const string& accNum, const string& holder, Money initialBalance, Rate rate)
+        : LegacyAccount(accNum, holder, initialBalance), interestRate(rate) {}
+
+    void applyInterest() {
+        lock_guard<recursive_mutex> lock(mtx);
+        Money interest = balance.applyRate(interestRate, RoundingMode::HalfEven);
+        balance += interest;
+        record(TransactionType::Deposit, interest, DESC_INTEREST);
+    }
+
+    void deposit(Money amount) override {
+        lock_guard<recursive_mutex> lock(mtx);
+        LegacyAccount::deposit(amount);
+        record(TransactionType::Deposit, amount, DESC_DEPOSIT);
+    }
+
+    void withdraw(Money amount) override {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount > balance) {
+            throw runtime_error("Insufficient funds.");
+        }
+        balance -= amount;
+        record(TransactionType::Withdrawal, amount, DESC_WITHDRAWAL);
+    }
+};
+
+class LegacyCheckingAccount : public LegacyAccount {
+private:
+    Money overdraftLimit;
+
+public:
+    LegacyCheckingAccount(const string& accNum, const string& holder, Money initialBalance, Money overdraft)
+        : LegacyAccount(accNum, holder, initialBalance), overdraftLimit(overdraft) {}
+
+    void deposit(Money amount) override {
+        lock_guard<recursive_mutex> lock(mtx);
+        LegacyAccount::deposit(amount);
+        record(TransactionType::Deposit, amount, DESC_DEPOSIT);
+    }
+
+    void withdraw(Money amount) override {
+        lock_guard<recursive_mutex> lock(mtx);
+        if(amount > balance + overdraftLimit) {
+            throw runtime_error("Overdraft limit exceeded.");
+        }
+        balance -= amount;
+        record(TransactionType::Withdrawal, amount, DESC_WITHDRAWAL);
+    }
+};
+
+// Dispatch benchmark: the same deposits, withdrawals, state reads and interest sweep over a mix of
+// savings and checking accounts, once through the legacy hierarchy and once through a
+// Bank's pools and visitAccount. Accounts are picked at random so the cost of reaching
+// each account's memory shows up as well as the cost of the call.
+int runDispatchBenchmark(int accountCount, int opCount) {
+    cout << "Dispatch benchmark: " << accountCount << " accounts, " << opCount << " operations\n";
+    mt19937 rng(7);
+    vector<uint32_t> picks(opCount);
+    uniform_int_distribution<uint32_t> pick(0, accountCount - 1);
+    for(auto& p : picks) {
+        p = pick(rng);
+    }
+    Money amount = Money::fromDollars(1);
+    Rate rate = Rate::fromMicros(2000);
+
+    // Legacy: heap objects allocated in opening order between other allocations, as the
+    // customers, strings and journals of a real bank would be
+    vector<shared_ptr<LegacyAccount>> legacy;
+    vector<string> clutter;
+    for(int i = 0; i < accountCount; ++i) {
+        string id = to_string(i);
+        if(i % 2 == 0) {
+            legacy.push_back(make_shared<LegacySavingsAccount>("SB" + id, "Customer " + id, Money::fromDollars(1000), rate));
+        }
+        else {
+            legacy.push_back(make_shared<LegacyCheckingAccount>("SB" + id, "Customer " + id, Money::fromDollars(1000), Money()));
+        }
+        clutter.push_back("user" + id + "@example.com");
+    }
+
+    Bank bank;
+    bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    vector<Account*> pooled;
+    for(int i = 0; i < accountCount; ++i) {
+        string id = to_string(i);
+        Customer& customer = bank.addCustomer("user" + id, "pwd", "Customer " + id, "user" + id + "@example.com");
+        if(i % 2 == 0) {
+            pooled.push_back(&bank.openAccount<SavingsAccount>(customer, "SB" + id, "Customer " + id, Money::fromDollars(1000), rate));
+        }
+        else {
+            pooled.push_back(&bank.openAccount<CheckingAccount>(customer, "SB" + id, "Customer " + id, Money::fromDollars(1000), Money()));
+        }
+    }
+
+    auto timeIt = [](auto body) {
+        auto start = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    double legacyPostings = timeIt([&]() {
+        for(int i = 0; i < opCount; ++i) {
+            shared_ptr<LegacyAccount> account = legacy[picks[i]];
+            if(i % 2 == 0) {
+                account->deposit(amount);
+            }
+            else {
+                account->withdraw(amount);
+            }
+        }
+    });
+    double pooledPostings = timeIt([&]() {
+        for(int i = 0; i < opCount; ++i) {
+            Account* account = pooled[picks[i]];
+            if(i % 2 == 0) {
+                account->deposit(amount);
+            }
+            else {
+                account->withdraw(amount);
+            }
+        }
+    });
+    Money legacyTotal, pooledTotal;
+    double legacyReads = timeIt([&]() {
+        for(int i = 0; i < opCount; ++i) {
+            shared_ptr<LegacyAccount> account = legacy[picks[i]];
+            legacyTotal += account->getState().balance;
+        }
+    });
+    double pooledReads = timeIt([&]() {
+        for(int i = 0; i < opCount; ++i) {
+            pooledTotal += pooled[picks[i]]->getState().balance;
+        }
+    });
+    double legacySweep = timeIt([&]() {
+        for(const auto& account : legacy) {
+            if(auto sav = dynamic_cast<LegacySavingsAccount*>(account.get())) {
+                sav->applyInterest();
+            }
+        }
+    });
+    double pooledSweep = timeIt([&]() {
+        for(Account* account : pooled) {
+            visitAccount(*account, [](auto& acc) {
+                if constexpr(is_same_v<decay_t<decltype(acc)>, SavingsAccount>) {
+                    acc.applyInterest();
+                }
+            });
+        }
+    });
+
+    for(int i = 0; i < accountCount; ++i) {
+        if(legacyTotal != pooledTotal || legacy[i]->getBalance() != pooled[i]->getBalance()) {
+            cerr << "Dispatch benchmark failed: balances differ for account SB" << i << ".\n";
+            return 1;
+        }
+    }
+    cout << fixed << setprecision(1)
+         << "Postings: virtual/shared_ptr " << legacyPostings * 1e9 / opCount << " ns/op, pooled/visitor "
+         << pooledPostings * 1e9 / opCount << " ns/op (" << setprecision(2) << legacyPostings / pooledPostings << "x)\n"
+         << setprecision(1)
+         << "State reads: virtual/shared_ptr " << legacyReads * 1e9 / opCount << " ns/op, pooled/visitor "
+         << pooledReads * 1e9 / opCount << " ns/op (" << setprecision(2) << legacyReads / pooledReads << "x)\n"
+         << setprecision(1)
+         << "Interest sweep: dynamic_cast " << legacySweep * 1e9 / accountCount << " ns/account, visitor "
+         << pooledSweep * 1e9 / accountCount << " ns/account (" << setprecision(2) << legacySweep / pooledSweep << "x)\n";
+    return 0;
+}
+
+// Benchmark suite.
+// Builds a synthetic bank of customers x accounts x history depth and measures the hot
+// paths (lookup, deposit, withdraw, transfer, history rendering, interest) one operation
+// at a time, single-threaded and on several threads. Each result carries throughput and
+// the latency distribution, and the whole run can be written as JSON for tracking
+// regressions against a baseline.
+
+struct BenchConfig {
+    int customers = 10000;
+    int accountsPerCustomer = 3;
+    int historyDepth = 16;
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    uint64_t opsPerThread = 200000;
+    string jsonPath;
+};
+
+struct BenchResult {
+    string name;
+    unsigned threads = 1;
+    uint64_t operations = 0;
+    double seconds = 0;
+    double meanNs = 0;
+    uint64_t p50 = 0, p90 = 0, p99 = 0, p999 = 0, maxNs = 0;
+};
+
+// Accounts of a synthetic bank, grouped the way the benchmarks draw them
+struct SyntheticBank {
+    vector<string> numbers;     // every account
+    vector<Account*> accounts;  // every account, same order
+    vector<Account*> spendable; // savings and checking accounts
+    vector<SavingsAccount*> savings;
+};
+
+// Open customers x accountsPerCustomer accounts (savings, checking, loan in turn) with
+// historyDepth past transactions each
+SyntheticBank buildSyntheticBank(Bank& bank, const BenchConfig& config) {
+    SyntheticBank synthetic;
+    int64_t now = TimestampClock::now();
+    bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    for(int c = 0; c < config.customers; ++c) {
+        string id = to_string(c);
+        Customer& customer = bank.addCustomer("bench" + id, "pwd", "Customer " + id, "bench" + id + "@example.com");
+        for(int a = 0; a < config.accountsPerCustomer; ++a) {
+            string number = "B" + id + "-" + to_string(a);
+            Account* account;
+            switch(a % 3) {
+                case 0: {
+                    SavingsAccount& sav = bank.openAccount<SavingsAccount>(customer, number, "Customer " + id,
+                        Money::fromDollars(1000000000), Rate::fromMicros(20000));
+                    synthetic.savings.push_back(&sav);
+                    synthetic.spendable.push_back(&sav);
+                    account = &sav;
+                    break;
+                }
+                case 1:
+                    account = &bank.openAccount<CheckingAccount>(customer, number, "Customer " + id,
+                        Money::fromDollars(1000000000), Money::fromDollars(500));
+                    synthetic.spendable.push_back(account);
+                    break;
+                default:
+                    account = &bank.openAccount<LoanAccount>(customer, number, "Customer " + id,
+                        Money::fromDollars(100000), Rate::fromMicros(50000));
+                    break;
+            }
+            for(int h = 0; h < config.historyDepth; ++h) {
+                account->restoreTransaction({now - (config.historyDepth - h) * 3600 * MICROS_PER_SECOND, Money::fromDollars(10 + h),
+                                             DESC_DEPOSIT, TransactionType::Deposit});
+            }
+            synthetic.numbers.push_back(number);
+            synthetic.accounts.push_back(account);
+        }
+    }
+    return synthetic;
+}
+
+// Throughput and latency percentiles of the samples (in ns) taken over seconds
+BenchResult summarizeSamples(const string& name, unsigned threads, vector<uint64_t>& all, double seconds) {
+    BenchResult result;
+    result.name = name;
+    result.threads = threads;
+    result.seconds = seconds;
+    sort(all.begin(), all.end());
+    result.operations = all.size();
+    if(!all.empty()) {
+        auto at = [&](double q) { return all[min(all.size() - 1, static_cast<size_t>(q * all.size()))]; };
+        double total = 0;
+        for(uint64_t ns : all) {
+            total += ns;
+        }
+        result.meanNs = total / all.size();
+        result.p50 = at(0.50);
+        result.p90 = at(0.90);
+        result.p99 = at(0.99);
+        result.p999 = at(0.999);
+        result.maxNs = all.back();
+    }
+    return result;
+}
+
+// Run op opsPerThread times on each of threads threads, timing every call.
+// op(rng) is called with a per-thread random generator.
+template<typename Op>
+BenchResult runBenchmark(const string& name, unsigned threads, uint64_t opsPerThread, Op op) {
+    vector<vector<uint64_t>> samples(threads, vector<uint64_t>(opsPerThread));
+    atomic<unsigned> ready{0};
+    atomic<bool> go{false};
+    vector<thread> workers;
+    for(unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            mt19937_64 rng(t * 7919 + 1);
+            ready.fetch_add(1);
+            while(!go.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            for(uint64_t i = 0; i < opsPerThread; ++i) {
+                auto begin = chrono::steady_clock::now();
+                op(rng);
+                samples[t][i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+            }
+        });
+    }
+    while(ready.load() != threads) {
+        this_thread::yield();
+    }
+    auto start = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for(auto& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    vector<uint64_t> all;
+    all.reserve(threads * opsPerThread);
+    for(auto& s : samples) {
+        all.insert(all.end(), s.begin(), s.end());
+    }
+    return summarizeSamples(name, threads, all, seconds);
+}
 
-    // Display account details
-    virtual void display() const {
-        cout << "Account Number: " << accountNumber << "\n"
-             << "Account Holder: " << accountHolder << "\n"
-             << fixed << setprecision(2)
-             << "Balance: $" << balance << "\n";
+void printBenchTable(const vector<BenchResult>& results) {
+    cout << left << setw(34) << "Benchmark" << right << setw(14) << "ops/sec" << setw(12) << "p50 ns"
+         << setw(12) << "p99 ns" << setw(14) << "p99.9 ns" << setw(14) << "max ns" << "\n";
+    for(const auto& r : results) {
+        cout << left << setw(34) << (r.name + "/threads:" + to_string(r.threads)) << right << fixed
+             << setprecision(r.operations / r.seconds < 10 ? 2 : 0) << setw(14) << r.operations / r.seconds
+             << setprecision(0) << setw(12) << r.p50 << setw(12) << r.p99 << setw(14) << r.p999 << setw(14) << r.maxNs << "\n";
     }
+}
 
-    // Virtual destructor
-    virtual ~Account() {}
-};
+void writeBenchJson(ostream& out, const BenchConfig& config, const vector<BenchResult>& results) {
+    time_t now = time(0);
+    tm utc;
+    gmtime_r(&now, &utc);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"hardware_concurrency\": " << thread::hardware_concurrency() << ",\n"
+        << "    \"customers\": " << config.customers << ",\n"
+        << "    \"accounts_per_customer\": " << config.accountsPerCustomer << ",\n"
+        << "    \"history_depth\": " << config.historyDepth << ",\n"
+        << "    \"ops_per_thread\": " << config.opsPerThread << "\n"
+        << "  },\n  \"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "/threads:" << r.threads << "\", "
+            << "\"threads\": " << r.threads << ", "
+            << "\"operations\": " << r.operations << ", "
+            << "\"seconds\": " << fixed << setprecision(6) << r.seconds << ", "
+            << "\"ops_per_sec\": " << setprecision(1) << r.operations / r.seconds << ", "
+            << "\"latency_ns\": {\"mean\": " << r.meanNs << ", \"p50\": " << r.p50 << ", \"p90\": " << r.p90
+            << ", \"p99\": " << r.p99 << ", \"p999\": " << r.p999 << ", \"max\": " << r.maxNs << "}}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
 
-// SavingsAccount Derived Class
-class SavingsAccount : public Account {
-private:
-    double interestRate;
-    vector<Transaction> transactions;
+int runBenchmarkSuite(const BenchConfig& config) {
+    Bank bank;
+    auto buildStart = chrono::steady_clock::now();
+    SyntheticBank synthetic = buildSyntheticBank(bank, config);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - buildStart).count();
+    cout << "Benchmark bank: " << config.customers << " customers x " << config.accountsPerCustomer
+         << " accounts x " << config.historyDepth << " history, built in " << fixed << setprecision(3)
+         << buildSeconds << "s\n";
+    if(synthetic.spendable.size() < 2 || synthetic.savings.empty()) {
+        cerr << "Benchmark bank needs at least two spendable accounts and one savings account.\n";
+        return 1;
+    }
 
-public:
-    SavingsAccount(const string& accNum, const string& holder, double initialBalance, double rate)
-        : Account(accNum, holder, initialBalance), interestRate(rate) {}
+    Money amount = Money::fromDollars(1);
+    Money tooMuch = Money::fromDollars(10000000000000); // beyond any synthetic balance
+    uniform_int_distribution<size_t> anyAccount(0, synthetic.accounts.size() - 1);
+    uniform_int_distribution<size_t> anySpendable(0, synthetic.spendable.size() - 1);
+    uniform_int_distribution<size_t> anySavings(0, synthetic.savings.size() - 1);
+    // History rendering writes to a discarded stream instead of the terminal
+    ostringstream sink;
 
-    // Apply interest
-    void applyInterest() {
-        double interest = balance * interestRate;
-        balance += interest;
-        transactions.emplace_back('D', interest, "Interest Applied");
+    vector<BenchResult> results;
+    vector<unsigned> threadCounts = {1};
+    if(config.threads > 1) {
+        threadCounts.push_back(config.threads);
+    }
+    for(unsigned threads : threadCounts) {
+        results.push_back(runBenchmark("lookup", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            bank.findAccount(synthetic.numbers[anyAccount(rng)]);
+        }));
+        results.push_back(runBenchmark("deposit", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            synthetic.spendable[anySpendable(rng)]->deposit(amount);
+        }));
+        results.push_back(runBenchmark("withdraw", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            synthetic.spendable[anySpendable(rng)]->withdraw(amount);
+        }));
+        // A declined withdrawal through the status API should cost about the same as one that
+        // succeeds; the throwing form shows what the exception path costs
+        results.push_back(runBenchmark("withdraw_declined", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            Account& account = *synthetic.savings[anySavings(rng)];
+            account.tryWithdraw(tooMuch);
+        }));
+        results.push_back(runBenchmark("withdraw_declined_throw", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            Account& account = *synthetic.savings[anySavings(rng)];
+            try {
+                account.withdraw(tooMuch);
+            }
+            catch(const runtime_error&) {
+            }
+        }));
+        results.push_back(runBenchmark("transfer", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            Account* from = synthetic.spendable[anySpendable(rng)];
+            Account* to = synthetic.spendable[anySpendable(rng)];
+            if(from != to) {
+                bank.applyTransfer(*from, *to, amount);
+            }
+        }));
+        results.push_back(runBenchmark("apply_interest", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            synthetic.savings[anySavings(rng)]->applyInterest();
+        }));
+        // "Deposits in the last day, third page of five": two binary searches and a short copy
+        results.push_back(runBenchmark("history_query", threads, config.opsPerThread, [&](mt19937_64& rng) {
+            thread_local vector<Transaction> page;
+            HistoryQuery query;
+            query.from = TimestampClock::now() - 24 * 3600 * MICROS_PER_SECOND;
+            query.type = TransactionType::Deposit;
+            query.offset = 10;
+            query.limit = 5;
+            query.newestFirst = true;
+            synthetic.accounts[anyAccount(rng)]->queryHistory(query, page);
+        }));
+        // Rendering is only measured single-threaded; it serialises on the output stream
+        if(threads == 1) {
+            streambuf* saved = cout.rdbuf(sink.rdbuf());
+            results.push_back(runBenchmark("history", 1, max<uint64_t>(1, config.opsPerThread / 20), [&](mt19937_64& rng) {
+                synthetic.accounts[anyAccount(rng)]->displayHistory();
+                if(sink.tellp() > (1 << 20)) {
+                    sink.str(string());
+                }
+            }));
+            cout.rdbuf(saved);
+        }
     }
+    // Macro benchmark: the whole month-end run, a few times
+    results.push_back(runBenchmark("month_end_accrual", 1, 5, [&](mt19937_64&) {
+        bank.runMonthEndAccrual(config.threads);
+    }));
+    results.back().threads = config.threads;
 
-    // Override withdraw method
-    void withdraw(double amount) override {
-        if(amount <= 0) {
-            throw invalid_argument("Withdrawal amount must be positive.");
+    // Statements for every account over the last 30 days: printed through the stream-based
+    // display methods, then exported by the statement engine as CSV and as JSON
+    string statementPath = (filesystem::temp_directory_path() / ("safetransact-bench-" + to_string(::getpid()))).string();
+    StatementPeriod period{TimestampClock::now() - 30 * 24 * 3600 * MICROS_PER_SECOND, TimestampClock::now() + MICROS_PER_SECOND};
+    results.push_back(runBenchmark("statements_stream", 1, 1, [&](mt19937_64&) {
+        ofstream file(statementPath);
+        streambuf* saved = cout.rdbuf(file.rdbuf());
+        for(Account* account : synthetic.accounts) {
+            account->display();
+            account->displayHistory();
         }
-        if(amount > balance) {
-            throw runtime_error("Insufficient funds.");
+        cout.rdbuf(saved);
+    }));
+    results.push_back(runBenchmark("statements_csv", 1, 1, [&](mt19937_64&) {
+        bank.exportStatements(statementPath, StatementFormat::Csv, period, config.threads);
+    }));
+    results.back().threads = config.threads;
+    results.push_back(runBenchmark("statements_json", 1, 1, [&](mt19937_64&) {
+        bank.exportStatements(statementPath, StatementFormat::Json, period, config.threads);
+    }));
+    results.back().threads = config.threads;
+    filesystem::remove(statementPath);
+
+    printBenchTable(results);
+    if(!config.jsonPath.empty()) {
+        ofstream json(config.jsonPath);
+        writeBenchJson(json, config, results);
+        if(!json) {
+            cerr << "Cannot write " << config.jsonPath << "\n";
+            return 1;
         }
-        balance -= amount;
-        transactions.emplace_back('W', amount, "Withdrawal");
+        cout << "Results written to " << config.jsonPath << "\n";
     }
+    return 0;
+}
 
-    // Override deposit method to record transactions
-    void deposit(double amount) override {
-        Account::deposit(amount);
-        transactions.emplace_back('D', amount, "Deposit");
+// Login storm benchmark.
+// Builds banks of 1,000 customers up to maxCustomers, ten times larger each step, and has
+// every core log in loginsPerThread times against each: returning customers answered by the
+// session cache, logins checked against the password hash (cache off), and unknown
+// usernames. None should slow down as the bank grows. The banks hash with
+// SYNTHETIC_PASSWORD_ITERATIONS so they build quickly; the last row is what the default
+// work factor costs a checked login.
+int runLoginBenchmark(int maxCustomers, uint64_t loginsPerThread) {
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    vector<BenchResult> results;
+    vector<string> strangers;
+    for(int i = 0; i < 1000; ++i) {
+        strangers.push_back("stranger" + to_string(i));
     }
-
-    // Display account details
-    void display() const override {
-        Account::display();
-        cout << "Account Type: Savings\n"
-             << "Interest Rate: " << interestRate * 100 << "%\n";
+    for(int customers = 1000; customers <= maxCustomers; customers *= 10) {
+        Bank bank;
+        bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+        vector<string> usernames, passwords;
+        for(int c = 0; c < customers; ++c) {
+            string id = to_string(c);
+            usernames.push_back("login" + id);
+            passwords.push_back("pwd" + id);
+            bank.addCustomer(usernames.back(), passwords.back(), "Customer " + id, "login" + id + "@example.com");
+        }
+        // The storm: the same thousand customers logging in again and again
+        uniform_int_distribution<int> returning(0, min(customers, 1000) - 1);
+        uniform_int_distribution<int> anyCustomer(0, customers - 1);
+        uniform_int_distribution<size_t> anyStranger(0, strangers.size() - 1);
+        atomic<uint64_t> rejected{0};
+        auto login = [&](int c) {
+            if(!bank.authenticateCustomer(usernames[c], passwords[c])) {
+                rejected.fetch_add(1, memory_order_relaxed);
+            }
+        };
+        string size = "/" + to_string(customers);
+        results.push_back(runBenchmark("login_cached" + size, threads, loginsPerThread, [&](mt19937_64& rng) {
+            login(returning(rng));
+        }));
+        bank.setSessionCacheCapacity(0);
+        results.push_back(runBenchmark("login_verified" + size, threads, loginsPerThread, [&](mt19937_64& rng) {
+            login(anyCustomer(rng));
+        }));
+        results.push_back(runBenchmark("login_unknown" + size, threads, loginsPerThread, [&](mt19937_64& rng) {
+            if(bank.authenticateCustomer(strangers[anyStranger(rng)], "pwd")) {
+                rejected.fetch_add(1, memory_order_relaxed);
+            }
+        }));
+        if(rejected.load() != 0) {
+            cerr << "Login benchmark failed: " << rejected.load() << " logins gave the wrong answer.\n";
+            return 1;
+        }
     }
+    string cred = PasswordHash::create("pwd");
+    results.push_back(runBenchmark("password_hash/" + to_string(PasswordHash::DEFAULT_ITERATIONS), 1, 20, [&](mt19937_64&) {
+        PasswordHash::verify(cred, "pwd");
+    }));
+    printBenchTable(results);
+    return 0;
+}
 
-    // Display transaction history
-    void displayHistory() const {
-        cout << "Transaction History for Savings Account " << accountNumber << ":\n";
-        for(const auto& txn : transactions) {
-            string typeStr;
-            switch(txn.type) {
-                case 'D': typeStr = "Deposit"; break;
-                case 'W': typeStr = "Withdrawal"; break;
-                case 'T': typeStr = "Transfer"; break;
-                case 'L': typeStr = "Loan"; break;
-                default: typeStr = "Unknown"; break;
+// Transfer benchmark.
+// Times Bank::tryTransfer between accounts whose histories already hold 0, 10, 100 ...
+// maxHistory transactions, to show that a transfer costs the same however old the
+// accounts are. Each row is a fresh bank of ACCOUNTS checking accounts.
+int runTransferBenchmark(int maxHistory, uint64_t transfersPerThread) {
+    const int ACCOUNTS = 16;
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    vector<BenchResult> results;
+    for(int history = 0; history <= maxHistory; history = history ? history * 10 : 10) {
+        Bank bank;
+        buildStressBank(bank, ACCOUNTS, Money::fromDollars(1000000000));
+        vector<Account*> accounts;
+        int64_t now = TimestampClock::now();
+        for(int i = 0; i < ACCOUNTS; ++i) {
+            accounts.push_back(bank.findAccount("ST" + to_string(i)));
+            for(int h = 0; h < history; ++h) {
+                accounts.back()->restoreTransaction({now - (history - h) * MICROS_PER_SECOND, Money::fromDollars(10),
+                                                     DESC_DEPOSIT, TransactionType::Deposit});
             }
-            cout << txn.date << " - " << typeStr << " of $" << fixed << setprecision(2) << txn.amount 
-                 << " - " << txn.description << "\n";
         }
+        uniform_int_distribution<int> pick(0, ACCOUNTS - 1);
+        results.push_back(runBenchmark("transfer/history:" + to_string(history), threads, transfersPerThread, [&](mt19937_64& rng) {
+            int from = pick(rng);
+            int to = (from + 1 + pick(rng) % (ACCOUNTS - 1)) % ACCOUNTS;
+            bank.tryTransfer(*accounts[from], *accounts[to], Money::fromCents(100));
+        }));
     }
-};
-
-// CheckingAccount Derived Class
-class CheckingAccount : public Account {
-private:
-    double overdraftLimit;
-    vector<Transaction> transactions;
-
-public:
-    CheckingAccount(const string& accNum, const string& holder, double initialBalance, double overdraft)
-        : Account(accNum, holder, initialBalance), overdraftLimit(overdraft) {}
+    printBenchTable(results);
+    return 0;
+}
 
-    // Override withdraw method
-    void withdraw(double amount) override {
-        if(amount <= 0) {
-            throw invalid_argument("Withdrawal amount must be positive.");
-        }
-        if(amount > balance + overdraftLimit) {
-            throw runtime_error("Overdraft limit exceeded.");
+// Limit benchmark.
+// Times withdrawals and transfers with 0, 1, 4 and 16 debit limit rules in force, half of
+// them per account and half per customer above 1, on one thread and on several. The caps
+// are far above what the benchmark debits, so every operation pays for the full check.
+// The check rows time the limit check by itself, clock read included.
+int runLimitBenchmark(uint64_t opsPerThread) {
+    const int CUSTOMERS = 256;
+    const int ACCOUNTS_PER_CUSTOMER = 4;
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    Bank bank;
+    bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    vector<Account*> accounts;
+    for(int c = 0; c < CUSTOMERS; ++c) {
+        string id = to_string(c);
+        Customer& customer = bank.addCustomer("user" + id, "pwd" + id, "Customer " + id, "user" + id + "@example.com");
+        for(int a = 0; a < ACCOUNTS_PER_CUSTOMER; ++a) {
+            accounts.push_back(&bank.openAccount<CheckingAccount>(customer, "LB" + id + "-" + to_string(a), "Customer " + id,
+                                                                  Money::fromDollars(1000000000), Money()));
         }
-        balance -= amount;
-        transactions.emplace_back('W', amount, "Withdrawal");
     }
-
-    // Override deposit method to record transactions
-    void deposit(double amount) override {
-        Account::deposit(amount);
-        transactions.emplace_back('D', amount, "Deposit");
+    uniform_int_distribution<size_t> pick(0, accounts.size() - 1);
+    vector<BenchResult> results;
+    for(int ruleCount : {0, 1, 4, 16}) {
+        vector<LimitRule> rules;
+        for(int r = 0; r < ruleCount; ++r) {
+            LimitScope scope = r % 2 ? LimitScope::Customer : LimitScope::Account;
+            rules.push_back({scope, (60 << r % 8) * MICROS_PER_SECOND, Money::fromDollars(1000000000), 1000000000});
+        }
+        bank.setLimits(rules);
+        string suffix = "/rules:" + to_string(ruleCount);
+        // The check alone, on windows of its own; they are not synchronized, so one thread
+        vector<LimitWindows> windows(accounts.size());
+        for(LimitWindows& accountWindows : windows) {
+            accountWindows.reset(rules, pmr::new_delete_resource());
+        }
+        results.push_back(runBenchmark("check" + suffix, 1, opsPerThread, [&](mt19937_64& rng) {
+            windows[pick(rng)].charge(Money::fromCents(1), TimestampClock::now());
+        }));
+        for(unsigned t : {1u, threads}) {
+            results.push_back(runBenchmark("withdraw" + suffix, t, opsPerThread, [&](mt19937_64& rng) {
+                accounts[pick(rng)]->tryWithdraw(Money::fromCents(1));
+            }));
+            results.push_back(runBenchmark("transfer" + suffix, t, opsPerThread, [&](mt19937_64& rng) {
+                size_t from = pick(rng);
+                bank.tryTransfer(*accounts[from], *accounts[(from + 1 + pick(rng) % (accounts.size() - 1)) % accounts.size()],
+                                 Money::fromCents(1));
+            }));
+        }
     }
+    printBenchTable(results);
+    return 0;
+}
 
-    // Display account details
-    void display() const override {
-        Account::display();
-        cout << "Account Type: Checking\n"
-             << "Overdraft Limit: $" << fixed << setprecision(2) << overdraftLimit << "\n";
+// Scheduler benchmark.
+// Schedules monthly jobs, a third each of loan installments, interest postings and standing
+// transfers, first due at random times over the next 30 days. Reports what adding and
+// cancelling a job costs and the memory each takes, then runs the month's jobs, which all
+// fall due in one batch.
+int runSchedulerBenchmark(size_t jobCount) {
+    const int ACCOUNTS_PER_KIND = 10000;
+    const int64_t month = 30 * 86400 * MICROS_PER_SECOND;
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    Bank bank;
+    bank.setPasswordIterations(SYNTHETIC_PASSWORD_ITERATIONS);
+    vector<LoanAccount*> loans;
+    vector<SavingsAccount*> savings;
+    vector<Account*> checking;
+    for(int i = 0; i < ACCOUNTS_PER_KIND; ++i) {
+        string id = to_string(i);
+        Customer& customer = bank.addCustomer("user" + id, "pwd" + id, "Customer " + id, "user" + id + "@example.com");
+        savings.push_back(&bank.openAccount<SavingsAccount>(customer, "SS" + id, "Customer " + id, Money::fromDollars(1000),
+                                                            Rate::fromMicros(2000)));
+        checking.push_back(&bank.openAccount<CheckingAccount>(customer, "SC" + id, "Customer " + id, Money::fromDollars(1000000),
+                                                              Money()));
+        loans.push_back(&bank.openAccount<LoanAccount>(customer, "SL" + id, "Customer " + id, Money::fromDollars(20000),
+                                                       Rate::fromMicros(4000)));
     }
 
-    // Display transaction history
-    void displayHistory() const {
-        cout << "Transaction History for Checking Account " << accountNumber << ":\n";
-        for(const auto& txn : transactions) {
-            string typeStr;
-            switch(txn.type) {
-                case 'D': typeStr = "Deposit"; break;
-                case 'W': typeStr = "Withdrawal"; break;
-                case 'T': typeStr = "Transfer"; break;
-                case 'L': typeStr = "Loan"; break;
-                default: typeStr = "Unknown"; break;
+    mt19937_64 rng(1);
+    uniform_int_distribution<int64_t> offset(0, month - SCHEDULE_TICK_MICROS);
+    uniform_int_distribution<int> pick(0, ACCOUNTS_PER_KIND - 1);
+    int64_t start = TimestampClock::now();
+    vector<ScheduleId> ids(jobCount);
+    auto began = chrono::steady_clock::now();
+    for(size_t j = 0; j < jobCount; ++j) {
+        int64_t due = start + offset(rng);
+        switch(j % 3) {
+            case 0: ids[j] = bank.scheduleLoanInstallment(*loans[pick(rng)], due, month); break;
+            case 1: ids[j] = bank.scheduleInterest(*savings[pick(rng)], due, month); break;
+            default: {
+                int from = pick(rng);
+                ids[j] = bank.scheduleTransfer(*checking[from], *checking[(from + 1) % ACCOUNTS_PER_KIND], Money::fromDollars(1),
+                                               due, month);
+                break;
             }
-            cout << txn.date << " - " << typeStr << " of $" << fixed << setprecision(2) << txn.amount 
-                 << " - " << txn.description << "\n";
         }
     }
-};
+    double addSeconds = chrono::duration<double>(chrono::steady_clock::now() - began).count();
+    size_t memory = bank.scheduleMemory();
 
-// LoanAccount Derived Class
-class LoanAccount : public Account {
-private:
-    double loanAmount;
-    double interestRate;
-    double monthlyPayment;
-    vector<Transaction> transactions;
+    // Cancel a tenth of the jobs, in random order
+    shuffle(ids.begin(), ids.end(), rng);
+    size_t cancels = jobCount / 10;
+    began = chrono::steady_clock::now();
+    for(size_t j = 0; j < cancels; ++j) {
+        bank.cancelScheduled(ids[j]);
+    }
+    double cancelSeconds = chrono::duration<double>(chrono::steady_clock::now() - began).count();
 
-public:
-    LoanAccount(const string& accNum, const string& holder, double loanAmt, double rate)
-        : Account(accNum, holder, 0.0), loanAmount(loanAmt), interestRate(rate) {}
+    began = chrono::steady_clock::now();
+    ScheduleSummary summary = bank.runScheduled(start + month, threads);
+    double runSeconds = chrono::duration<double>(chrono::steady_clock::now() - began).count();
 
-    // Apply interest and calculate monthly payment
-    void processMonthlyPayment() {
-        double interest = loanAmount * interestRate;
-        loanAmount += interest;
-        monthlyPayment = loanAmount * 0.01; // Example: 1% monthly payment
-        transactions.emplace_back('L', monthlyPayment, "Monthly Loan Payment");
-        balance -= monthlyPayment;
+    cout << "Scheduler: " << jobCount << " jobs added at " << fixed << setprecision(1) << addSeconds * 1e9 / jobCount
+         << " ns each, " << static_cast<double>(memory) / jobCount << " bytes each\n";
+    cout << "Scheduler: " << cancels << " jobs cancelled at " << cancelSeconds * 1e9 / max<size_t>(cancels, 1) << " ns each\n";
+    cout << "Scheduler: " << summary.operations << " due jobs run in " << summary.rounds << " batch(es) on " << threads
+         << " threads in " << setprecision(3) << runSeconds << "s (" << setprecision(0)
+         << summary.operations / runSeconds << " jobs/sec), " << summary.declined << " transfers declined\n";
+    return 0;
+}
+
+// Sharded bank benchmark.
+// For 1, 2, 4 ... maxShards shards, opens ACCOUNTS_PER_SHARD accounts per shard and drives
+// the bank with one client thread per shard. Each client keeps two batches in flight of
+// deposits, withdrawals and transfers (a fifth, a fifth and three fifths) on accounts of
+// its own shard; crossPercent of the transfers go to an account on another shard instead.
+// Prints throughput and the speedup over one shard, and checks that the total funds equal
+// the opening funds plus the deposits and minus the withdrawals that went through.
+int runShardBenchmark(uint32_t maxShards, uint64_t opsPerShard, int crossPercent) {
+    const int ACCOUNTS_PER_SHARD = 10000;
+    const size_t BATCH = 1024;
+    const Money opening = Money::fromDollars(1000);
+    double baseline = 0;
+    vector<uint32_t> shardCounts;
+    for(uint32_t shards = 1; shards < maxShards; shards *= 2) {
+        shardCounts.push_back(shards);
     }
+    shardCounts.push_back(max(1u, maxShards));
+    for(uint32_t shards : shardCounts) {
+        ShardedBank bank(shards);
+        int accountCount = ACCOUNTS_PER_SHARD * static_cast<int>(shards);
+        buildStressBank(bank, accountCount, opening);
+        vector<vector<string>> local(shards);
+        for(int i = 0; i < accountCount; ++i) {
+            string number = "ST" + to_string(i);
+            local[bank.shardOf(number)].push_back(number);
+        }
 
-    // Override deposit to handle loan repayment
-    void deposit(double amount) override {
-        if(amount <= 0) {
-            throw invalid_argument("Repayment amount must be positive.");
+        atomic<int64_t> netCents{0};
+        vector<thread> clients;
+        auto start = chrono::steady_clock::now();
+        for(uint32_t s = 0; s < shards; ++s) {
+            clients.emplace_back([&, s]() {
+                mt19937_64 rng(s * 7919 + 1);
+                uniform_int_distribution<int> kind(0, 4);
+                uniform_int_distribution<int> percent(0, 99);
+                uniform_int_distribution<int64_t> cents(100, 20000);
+                auto anyOn = [&](uint32_t shard) {
+                    return local[shard][uniform_int_distribution<size_t>(0, local[shard].size() - 1)(rng)];
+                };
+                array<vector<ShardCommand>, 2> batches{vector<ShardCommand>(BATCH), vector<ShardCommand>(BATCH)};
+                array<vector<TxnStatus>, 2> results;
+                array<ShardCompletion, 2> completions;
+                int64_t net = 0;
+                auto tally = [&](int b) {
+                    completions[b].wait();
+                    for(size_t i = 0; i < batches[b].size(); ++i) {
+                        if(results[b][i] == TxnStatus::Ok && batches[b][i].type != 'T') {
+                            net += batches[b][i].type == 'D' ? batches[b][i].amount.getCents() : -batches[b][i].amount.getCents();
+                        }
+                    }
+                };
+                uint64_t rounds = (opsPerShard + BATCH - 1) / BATCH;
+                for(uint64_t r = 0; r < rounds; ++r) {
+                    int b = r % 2;
+                    if(r >= 2) {
+                        tally(b);
+                    }
+                    for(auto& cmd : batches[b]) {
+                        int k = kind(rng);
+                        cmd.type = k == 0 ? 'D' : k == 1 ? 'W' : 'T';
+                        cmd.from = anyOn(s);
+                        if(cmd.type == 'T') {
+                            uint32_t other = shards > 1 && percent(rng) < crossPercent
+                                ? (s + 1 + uniform_int_distribution<uint32_t>(0, shards - 2)(rng)) % shards : s;
+                            cmd.to = anyOn(other);
+                        }
+                        cmd.amount = Money::fromCents(cents(rng));
+                    }
+                    bank.submit(batches[b], results[b], completions[b]);
+                }
+                for(uint64_t r = rounds > 2 ? rounds - 2 : 0; r < rounds; ++r) {
+                    tally(r % 2);
+                }
+                netCents += net;
+            });
         }
-        loanAmount -= amount;
-        balance += amount;
-        transactions.emplace_back('D', amount, "Loan Repayment");
-    }
+        for(auto& client : clients) {
+            client.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    // Override withdraw (not applicable for loans)
-    void withdraw(double amount) override {
-        throw runtime_error("Withdrawals are not allowed from a loan account.");
+        Money total;
+        for(uint32_t s = 0; s < shards; ++s) {
+            for(const string& number : local[s]) {
+                total += bank.shardBank(s).findAccount(number)->getBalance();
+            }
+        }
+        if(total != opening * accountCount + Money::fromCents(netCents.load()) || bank.reserved() != Money()) {
+            cerr << "Shard benchmark failed: " << shards << " shards hold " << total << ".\n";
+            return 1;
+        }
+        double rate = shards * static_cast<double>((opsPerShard + BATCH - 1) / BATCH * BATCH) / seconds;
+        if(baseline == 0) {
+            baseline = rate;
+        }
+        cout << "Shards " << shards << ": " << fixed << setprecision(0) << rate << " ops/sec ("
+             << setprecision(2) << rate / baseline << "x), funds reconcile\n";
     }
+    return 0;
+}
 
-    // Display account details
-    void display() const override {
-        cout << "Loan Account Number: " << accountNumber << "\n"
-             << "Loan Holder: " << accountHolder << "\n"
-             << fixed << setprecision(2)
-             << "Loan Amount: $" << loanAmount << "\n"
-             << "Interest Rate: " << interestRate * 100 << "%\n"
-             << "Monthly Payment: $" << monthlyPayment << "\n";
+// Request server benchmark.
+// Serves a stress bank of one account per session on a temporary Unix socket, then drives
+// it from sessions client connections multiplexed on one event loop. Each session logs in
+// and sends requests requests one at a time (deposits, withdrawals, transfers to the next
+// session's account and account listings in turn), timing each round trip. Prints the
+// latency of each request kind and checks that the funds reconcile with the replies.
+int runServerBenchmark(int sessions, int requests, unsigned serverThreads) {
+    // Each session holds a descriptor at both ends
+    rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
     }
+    const Money opening = Money::fromDollars(1000);
+    Bank bank;
+    buildStressBank(bank, sessions, opening);
+    string path = (filesystem::temp_directory_path() / ("safetransact-" + to_string(getpid()) + ".sock")).string();
+    BankServer server(bank, path, serverThreads);
 
-    // Display transaction history
-    void displayHistory() const {
-        cout << "Transaction History for Loan Account " << accountNumber << ":\n";
-        for(const auto& txn : transactions) {
-            string typeStr;
-            switch(txn.type) {
-                case 'D': typeStr = "Repayment"; break;
-                case 'L': typeStr = "Loan Payment"; break;
-                default: typeStr = "Unknown"; break;
-            }
-            cout << txn.date << " - " << typeStr << " of $" << fixed << setprecision(2) << txn.amount 
-                 << " - " << txn.description << "\n";
+    vector<int> fds;
+    for(int i = 0; i < sessions; ++i) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        if(fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            cerr << "Cannot connect session " << i << ": " << strerror(errno) << "\n";
+            return 1;
         }
+        ::fcntl(fd, F_SETFL, O_NONBLOCK);
+        fds.push_back(fd);
     }
-};
-
-// Customer Class
-class Customer {
-private:
-    string username;
-    string password;
-    string name;
-    string email;
-    vector<shared_ptr<Account>> accounts;
 
-public:
-    Customer(const string& uname, const string& pwd, const string& nm, const string& mail)
-        : username(uname), password(pwd), name(nm), email(mail) {}
+    static const char* KINDS[] = {"deposit", "withdraw", "transfer", "accounts"};
+    array<vector<uint64_t>, 4> samples;
+    int64_t netCents = 0;
+    int finished = 0;
+    bool failed = false;
+    EventLoop clients;
+    auto session = [&](int i) -> DetachedTask {
+        LoopSocket socket(clients, fds[i]);
+        string reply;
+        char buffer[4096];
+        string self = "ST" + to_string(i), next = "ST" + to_string((i + 1) % sessions);
+        for(int r = -1; r < requests && !failed; ++r) {
+            int kind = r < 0 ? -1 : r % 4;
+            Money amount = Money::fromCents(100 + (i * 31 + r * 17) % 5000);
+            string request = kind < 0 ? "LOGIN user" + to_string(i) + " pwd" + to_string(i)
+                           : kind == 0 ? "DEPOSIT " + self + " " + amount.toString()
+                           : kind == 1 ? "WITHDRAW " + self + " " + amount.toString()
+                           : kind == 2 ? "TRANSFER " + self + " " + next + " " + amount.toString()
+                           : "ACCOUNTS";
+            request += '\n';
+            auto begin = chrono::steady_clock::now();
+            size_t sent = 0;
+            while(sent < request.size()) {
+                ssize_t written = ::send(fds[i], request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+                if(written > 0) {
+                    sent += written;
+                }
+                else if(written < 0 && errno == EAGAIN) {
+                    co_await socket.ready();
+                }
+                else {
+                    failed = true;
+                    break;
+                }
+            }
+            // A listing is a header line and one line for the session's account
+            size_t lines = kind == 3 ? 2 : 1;
+            reply.clear();
+            while(!failed && static_cast<size_t>(count(reply.begin(), reply.end(), '\n')) < lines) {
+                ssize_t received = ::read(fds[i], buffer, sizeof(buffer));
+                if(received > 0) {
+                    reply.append(buffer, received);
+                }
+                else if(received < 0 && errno == EAGAIN) {
+                    co_await socket.ready();
+                }
+                else {
+                    failed = true;
+                }
+            }
+            if(failed || (kind != 1 && kind != 2 && reply.compare(0, 3, "OK ") != 0)) {
+                cerr << "Session " << i << " got \"" << reply.substr(0, reply.find('\n')) << "\" for " << request;
+                failed = true;
+                break;
+            }
+            if(kind >= 0) {
+                samples[kind].push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+            }
+            if(reply.compare(0, 3, "OK ") == 0 && (kind == 0 || kind == 1)) {
+                netCents += kind == 0 ? amount.getCents() : -amount.getCents();
+            }
+        }
+        if(++finished == sessions) {
+            clients.stop();
+        }
+    };
 
-    // Authenticate user
-    bool authenticate(const string& uname, const string& pwd) const {
-        return (uname == username && pwd == password);
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < sessions; ++i) {
+        session(i);
+    }
+    clients.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if(failed) {
+        return 1;
     }
+    server.stop();
 
-    // Add account
-    void addAccount(shared_ptr<Account> account) {
-        accounts.push_back(account);
+    vector<BenchResult> results;
+    for(int k = 0; k < 4; ++k) {
+        results.push_back(summarizeSamples(string("server_") + KINDS[k] + "/sessions:" + to_string(sessions), serverThreads,
+                                           samples[k], seconds));
+    }
+    printBenchTable(results);
+    if(totalFunds(bank, sessions) != opening * sessions + Money::fromCents(netCents)) {
+        cerr << "Server benchmark failed: the accounts hold " << totalFunds(bank, sessions) << ".\n";
+        return 1;
     }
+    cout << "Served " << static_cast<uint64_t>(sessions) * requests << " requests in " << fixed << setprecision(3) << seconds
+         << "s, funds reconcile\n";
+    return 0;
+}
 
-    // Get accounts
-    vector<shared_ptr<Account>> getAccounts() const {
-        return accounts;
+// Local midnight at the start of a YYYY-MM-DD date, plus days, in microseconds since the epoch
+int64_t parseLocalDate(const string& text, int days = 0) {
+    tm date = {};
+    if(sscanf(text.c_str(), "%d-%d-%d", &date.tm_year, &date.tm_mon, &date.tm_mday) != 3) {
+        throw invalid_argument("Invalid date (expected YYYY-MM-DD): " + text);
     }
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    date.tm_mday += days;
+    date.tm_isdst = -1;
+    return static_cast<int64_t>(mktime(&date)) * MICROS_PER_SECOND;
+}
 
-    // Display customer details
-    void displayCustomer() const {
-        cout << "Customer Name: " << name << "\n"
-             << "Email: " << email << "\n"
-             << "Username: " << username << "\n";
+// Parse a debit limit "SCOPE:WINDOW:AMOUNT[:COUNT]", such as "customer:24h:10000" or
+// "account:10m::3". SCOPE is account or customer, WINDOW a number of s, m, h or d, and an
+// empty AMOUNT or COUNT leaves that cap off.
+LimitRule parseLimitRule(const string& text) {
+    vector<string> fields;
+    stringstream parts(text);
+    for(string field; getline(parts, field, ':');) {
+        fields.push_back(field);
     }
-};
+    if(fields.size() < 3 || fields.size() > 4 || (fields[0] != "account" && fields[0] != "customer") || fields[1].size() < 2) {
+        throw invalid_argument("Invalid limit (expected SCOPE:WINDOW:AMOUNT[:COUNT]): " + text);
+    }
+    LimitRule rule;
+    rule.scope = fields[0] == "account" ? LimitScope::Account : LimitScope::Customer;
+    int64_t unit = 0;
+    switch(fields[1].back()) {
+        case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 3600; break;
+        case 'd': unit = 86400; break;
+    }
+    int64_t length = 0;
+    auto [end, error] = from_chars(fields[1].data(), fields[1].data() + fields[1].size() - 1, length);
+    if(unit == 0 || error != errc() || end != fields[1].data() + fields[1].size() - 1 || length <= 0) {
+        throw invalid_argument("Invalid limit window (expected a number of s, m, h or d): " + fields[1]);
+    }
+    rule.windowMicros = length * unit * MICROS_PER_SECOND;
+    if(!fields[2].empty()) {
+        rule.maxAmount = Money::parse(fields[2]);
+    }
+    if(fields.size() == 4 && !fields[3].empty()) {
+        rule.maxCount = stoul(fields[3]);
+    }
+    return rule;
+}
 
-// Bank Class
-class Bank {
-private:
-    vector<shared_ptr<Customer>> customers;
+// The current month so far
+StatementPeriod currentMonth() {
+    time_t now = time(0);
+    tm date;
+    localtime_r(&now, &date);
+    date.tm_mday = 1;
+    date.tm_hour = date.tm_min = date.tm_sec = 0;
+    date.tm_isdst = -1;
+    return {static_cast<int64_t>(mktime(&date)) * MICROS_PER_SECOND, TimestampClock::now() + 1};
+}
 
+// Runs a callback each time the process receives SIGUSR1. The signal must be blocked in
+// every thread, so construct this before starting any other. The destructor wakes the
+// thread with its own SIGUSR1 and joins it, so the callback never outlives what it uses.
+class SignalDumpThread {
 public:
-    // Add customer
-    void addCustomer(shared_ptr<Customer> customer) {
-        customers.push_back(customer);
+    explicit SignalDumpThread(function<void()> dump) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        worker = thread([this, signals, dump = move(dump)] {
+            int signal;
+            while(sigwait(&signals, &signal) == 0 && !stopping.load(memory_order_acquire)) {
+                dump();
+            }
+        });
     }
+    ~SignalDumpThread() {
+        stopping.store(true, memory_order_release);
+        pthread_kill(worker.native_handle(), SIGUSR1);
+        worker.join();
+    }
+    SignalDumpThread(const SignalDumpThread&) = delete;
+    SignalDumpThread& operator=(const SignalDumpThread&) = delete;
 
-    // Authenticate customer
-    shared_ptr<Customer> authenticateCustomer(const string& uname, const string& pwd) const {
-        for(const auto& customer : customers) {
-            if(customer->authenticate(uname, pwd)) {
-                return customer;
-            }
+private:
+    atomic<bool> stopping{false};
+    thread worker;
+};
+
+// Create the predefined demo customers and their accounts
+void seedDemoCustomers(Bank& bank) {
+    // Create Customers
+    Customer& customer1 = bank.addCustomer("alice", "password123", "Alice Smith", "alice@example.com");
+    Customer& customer2 = bank.addCustomer("bob", "securepwd", "Bob Johnson", "bob@example.com");
+
+    // Open Accounts for Customer 1
+    bank.openAccount<SavingsAccount>(customer1, "SA1001", "Alice Smith", Money::fromDollars(5000), Rate::fromMicros(30000));
+    bank.openAccount<CheckingAccount>(customer1, "CA1001", "Alice Smith", Money::fromDollars(2000), Money::fromDollars(500));
+
+    // Open Accounts for Customer 2
+    bank.openAccount<SavingsAccount>(customer2, "SA2001", "Bob Johnson", Money::fromDollars(3000), Rate::fromMicros(20000));
+    bank.openAccount<LoanAccount>(customer2, "LA2001", "Bob Johnson", Money::fromDollars(10000), Rate::fromMicros(50000));
+}
+
+// Sample Main Function
+int main(int argc, char* argv[]) {
+    // --no-metrics may appear anywhere and turns off operation metrics for the whole run
+    int kept = 1;
+    for(int i = 1; i < argc; ++i) {
+        if(string(argv[i]) == "--no-metrics") {
+            Metrics::instance().setEnabled(false);
+        }
+        else {
+            argv[kept++] = argv[i];
         }
-        return nullptr;
     }
+    argc = kept;
 
-    // Find account by account number
-    shared_ptr<Account> findAccount(const string& accNum) const {
-        for(const auto& customer : customers) {
-            for(const auto& account : customer->getAccounts()) {
-                if(account->getAccountNumber() == accNum) {
-                    return account;
-                }
-            }
-        }
-        return nullptr;
+    if(argc > 1 && string(argv[1]) == "--stress") {
+        int threads = argc > 2 ? stoi(argv[2]) : max(2u, thread::hardware_concurrency());
+        int ops = argc > 3 ? stoi(argv[3]) : 100000;
+        return runStressTest(threads, ops);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-dispatch") {
+        int accounts = argc > 2 ? stoi(argv[2]) : 200000;
+        int ops = argc > 3 ? stoi(argv[3]) : 2000000;
+        return runDispatchBenchmark(accounts, ops);
     }
 
-    // Transfer funds between accounts
-    void transferFunds(const string& fromAcc, const string& toAcc, double amount) {
-        auto source = findAccount(fromAcc);
-        auto destination = findAccount(toAcc);
+    if(argc > 1 && string(argv[1]) == "--bench-shards") {
+        uint32_t shards = argc > 2 ? stoul(argv[2]) : max(2u, thread::hardware_concurrency());
+        uint64_t ops = argc > 3 ? stoull(argv[3]) : 1000000;
+        int cross = argc > 4 ? stoi(argv[4]) : 10;
+        return runShardBenchmark(shards, ops, cross);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-server") {
+        int sessions = argc > 2 ? stoi(argv[2]) : 1000;
+        int requests = argc > 3 ? stoi(argv[3]) : 200;
+        unsigned threads = argc > 4 ? stoul(argv[4]) : max(2u, thread::hardware_concurrency());
+        return runServerBenchmark(sessions, requests, threads);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-transfer") {
+        int history = argc > 2 ? stoi(argv[2]) : 100000;
+        uint64_t transfers = argc > 3 ? stoull(argv[3]) : 200000;
+        return runTransferBenchmark(history, transfers);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-limits") {
+        uint64_t ops = argc > 2 ? stoull(argv[2]) : 500000;
+        return runLimitBenchmark(ops);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-scheduler") {
+        size_t jobs = argc > 2 ? stoull(argv[2]) : 2000000;
+        return runSchedulerBenchmark(jobs);
+    }
+    if(argc > 1 && string(argv[1]) == "--bench-login") {
+        int customers = argc > 2 ? stoi(argv[2]) : 100000;
+        uint64_t logins = argc > 3 ? stoull(argv[3]) : 20000;
+        return runLoginBenchmark(customers, logins);
+    }
 
-        if(!source || !destination) {
-            throw runtime_error("One or both accounts not found.");
+    if(argc > 1 && string(argv[1]) == "--bench") {
+        BenchConfig config;
+        for(int i = 2; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            if(option == "--customers") config.customers = stoi(argv[i + 1]);
+            else if(option == "--accounts") config.accountsPerCustomer = stoi(argv[i + 1]);
+            else if(option == "--history") config.historyDepth = stoi(argv[i + 1]);
+            else if(option == "--threads") config.threads = stoi(argv[i + 1]);
+            else if(option == "--ops") config.opsPerThread = stoull(argv[i + 1]);
+            else if(option == "--json") config.jsonPath = argv[i + 1];
+            else {
+                cerr << "Unknown benchmark option " << option << "\n";
+                return 1;
+            }
         }
+        return runBenchmarkSuite(config);
+    }
+    if(argc > 3 && string(argv[1]) == "--generate") {
+        writeIngestFile(argv[2], stoull(argv[3]), argc > 4 ? stoi(argv[4]) : 0);
+        return 0;
+    }
 
-        // Attempt withdrawal from source
-        source->withdraw(amount);
-        // Deposit into destination
-        destination->deposit(amount);
+    Bank bank;
 
-        // Record transfer transactions
-        // Assuming Account class has a way to record transactions; otherwise, casting to derived classes
-        // For simplicity, we will handle only Savings and Checking accounts here
-        SavingsAccount* srcSav = dynamic_cast<SavingsAccount*>(source.get());
-        if(srcSav) {
-            srcSav->deposit(-amount); // Negative deposit to indicate transfer out
-            srcSav->displayHistory(); // Optionally record transfer
+    // Optional directory holding the write-ahead log and snapshots, and an optional
+    // command file to ingest instead of running the interactive menu
+    string dataDir;
+    string ingestInput, ingestOutput;
+    string metricsPath;
+    string statementsPath;
+    StatementPeriod statementPeriod = currentMonth();
+    int ingestAccounts = 0;
+    string serveAddress;
+    unsigned serveThreads = max(2u, thread::hardware_concurrency());
+    vector<LimitRule> limits;
+    for(int i = 1; i + 1 < argc; ++i) {
+        if(string(argv[i]) == "--data-dir") {
+            dataDir = argv[i + 1];
         }
-
-        CheckingAccount* srcChk = dynamic_cast<CheckingAccount*>(source.get());
-        if(srcChk) {
-            srcChk->deposit(-amount); // Negative deposit to indicate transfer out
-            srcChk->displayHistory(); // Optionally record transfer
+        else if(string(argv[i]) == "--limit") {
+            try {
+                limits.push_back(parseLimitRule(argv[i + 1]));
+            }
+            catch(const exception& e) {
+                cerr << e.what() << "\n";
+                return 1;
+            }
         }
-
-        SavingsAccount* destSav = dynamic_cast<SavingsAccount*>(destination.get());
-        if(destSav) {
-            destSav->deposit(amount);
-            destSav->displayHistory(); // Optionally record transfer
+        else if(string(argv[i]) == "--metrics-out") {
+            metricsPath = argv[i + 1];
         }
-
-        CheckingAccount* destChk = dynamic_cast<CheckingAccount*>(destination.get());
-        if(destChk) {
-            destChk->deposit(amount);
-            destChk->displayHistory(); // Optionally record transfer
+        else if(string(argv[i]) == "--statements") {
+            statementsPath = argv[i + 1];
+            if(i + 3 < argc && isdigit(static_cast<unsigned char>(argv[i + 2][0]))) {
+                try {
+                    statementPeriod = {parseLocalDate(argv[i + 2]), parseLocalDate(argv[i + 3], 1)};
+                }
+                catch(const exception& e) {
+                    cerr << e.what() << "\n";
+                    return 1;
+                }
+            }
         }
-
-        cout << "Transferred $" << fixed << setprecision(2) << amount 
-             << " from " << fromAcc << " to " << toAcc << " successfully.\n";
-    }
-
-    // Display all customers
-    void displayAllCustomers() const {
-        for(const auto& customer : customers) {
-            customer->displayCustomer();
-            cout << "Accounts:\n";
-            for(const auto& account : customer->getAccounts()) {
-                account->display();
-                cout << "\n";
+        else if(string(argv[i]) == "--serve") {
+            serveAddress = argv[i + 1];
+            if(i + 2 < argc && isdigit(static_cast<unsigned char>(argv[i + 2][0]))) {
+                serveThreads = stoul(argv[i + 2]);
+            }
+        }
+        else if(string(argv[i]) == "--ingest" && i + 2 < argc) {
+            ingestInput = argv[i + 1];
+            ingestOutput = argv[i + 2];
+            if(i + 3 < argc && isdigit(static_cast<unsigned char>(argv[i + 3][0]))) {
+                ingestAccounts = stoi(argv[i + 3]);
             }
-            cout << "-----------------------------\n";
         }
     }
-};
 
-// Function to process transactions
-void processTransaction(shared_ptr<Account> account, char type, double amount, const string& description = "") {
-    try {
-        switch(type) {
-            case 'D':
-                account->deposit(amount);
-                cout << "Deposited $" << fixed << setprecision(2) << amount << " successfully.\n";
-                break;
-            case 'W':
-                account->withdraw(amount);
-                cout << "Withdrew $" << fixed << setprecision(2) << amount << " successfully.\n";
-                break;
-            case 'T':
-                // Transfer handled separately
-                break;
-            default:
-                throw invalid_argument("Invalid transaction type.");
+    // Metrics are written to metricsPath on exit and whenever the process receives SIGUSR1
+    auto writeMetrics = [metricsPath, &bank] {
+        if(metricsPath.empty()) {
+            return;
+        }
+        try {
+            Metrics::instance().dumpPrometheus(metricsPath, [&bank](ostream& out) { bank.dumpTotalsPrometheus(out); });
         }
+        catch(const exception& e) {
+            cerr << "Cannot write metrics: " << e.what() << "\n";
+        }
+    };
+    // A server runs until SIGINT or SIGTERM; block them before any thread starts so that
+    // main can wait for them below
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    if(!serveAddress.empty()) {
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
     }
-    catch(const exception& e) {
-        cerr << "Transaction failed: " << e.what() << "\n";
+    // Declared after bank, so the dump thread is joined before bank is destroyed
+    optional<SignalDumpThread> metricsDumper;
+    if(!metricsPath.empty()) {
+        metricsDumper.emplace(writeMetrics);
     }
-}
-
-// Sample Main Function
-int main() {
-    Bank bank;
 
-    // Create Customers
-    auto customer1 = make_shared<Customer>("alice", "password123", "Alice Smith", "alice@example.com");
-    auto customer2 = make_shared<Customer>("bob", "securepwd", "Bob Johnson", "bob@example.com");
+    bool restored = false;
+    if(!dataDir.empty()) {
+        try {
+            restored = bank.enablePersistence(dataDir);
+        }
+        catch(const exception& e) {
+            cerr << "Cannot open data directory: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if(!restored) {
+        if(ingestAccounts > 0) {
+            buildStressBank(bank, ingestAccounts, Money::fromDollars(1000));
+        }
+        else {
+            seedDemoCustomers(bank);
+        }
+        bank.checkpoint();
+    }
+    bank.setLimits(limits);
+    bank.startScheduler();
 
-    // Create Accounts for Customer 1
-    auto savings1 = make_shared<SavingsAccount>("SA1001", "Alice Smith", 5000.0, 0.03);
-    auto checking1 = make_shared<CheckingAccount>("CA1001", "Alice Smith", 2000.0, 500.0);
-    customer1->addAccount(savings1);
-    customer1->addAccount(checking1);
+    if(!ingestInput.empty()) {
+        try {
+            IngestSummary summary = runIngestion(bank, ingestInput, ingestOutput);
+            bank.checkpoint();
+            writeMetrics();
+            cout << "Ingested " << summary.commands << " commands (" << summary.succeeded << " succeeded, "
+                 << summary.failed << " failed, " << summary.errors << " errors) in " << fixed << setprecision(3)
+                 << summary.seconds << "s, "
+                 << setprecision(0) << summary.commands / max(summary.seconds, 1e-9) << " ops/sec\n";
+            return 0;
+        }
+        catch(const exception& e) {
+            cerr << "Ingestion failed: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
-    // Create Accounts for Customer 2
-    auto savings2 = make_shared<SavingsAccount>("SA2001", "Bob Johnson", 3000.0, 0.02);
-    auto loan2 = make_shared<LoanAccount>("LA2001", "Bob Johnson", 10000.0, 0.05);
-    customer2->addAccount(savings2);
-    customer2->addAccount(loan2);
+    if(!serveAddress.empty()) {
+        try {
+            BankServer server(bank, serveAddress, serveThreads);
+            cout << "Serving on " << serveAddress << " with " << serveThreads << " threads\n";
+            int signal;
+            sigwait(&stopSignals, &signal);
+            server.stop();
+        }
+        catch(const exception& e) {
+            cerr << "Server failed: " << e.what() << "\n";
+            return 1;
+        }
+        bank.checkpoint();
+        writeMetrics();
+        return 0;
+    }
 
-    // Add Customers to Bank
-    bank.addCustomer(customer1);
-    bank.addCustomer(customer2);
+    if(!statementsPath.empty()) {
+        try {
+            bool json = statementsPath.size() >= 5 && statementsPath.compare(statementsPath.size() - 5, 5, ".json") == 0;
+            StatementSummary summary = bank.exportStatements(statementsPath, json ? StatementFormat::Json : StatementFormat::Csv,
+                                                             statementPeriod);
+            cout << "Wrote statements for " << summary.accounts << " accounts (" << summary.transactions
+                 << " transactions, " << summary.bytes / 1024 << " KiB) in " << fixed << setprecision(3)
+                 << summary.seconds << "s\n";
+            writeMetrics();
+            return 0;
+        }
+        catch(const exception& e) {
+            cerr << "Statement export failed: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
     // Display All Customers
     cout << "Welcome to SafeTransact Banking System!\n";
@@ -467,7 +9026,7 @@ int main() {
         else if(choice == 2) {
             // Deposit Funds
             string accNum;
-            double amount;
+            Money amount;
             cout << "Enter Account Number to Deposit Into: ";
             cin >> accNum;
             cout << "Enter Amount to Deposit: ";
@@ -475,7 +9034,7 @@ int main() {
 
             auto account = bank.findAccount(accNum);
             if(account) {
-                processTransaction(account, 'D', amount);
+                processTransaction(*account, 'D', amount);
             }
             else {
                 cerr << "Account not found.\n";
@@ -484,7 +9043,7 @@ int main() {
         else if(choice == 3) {
             // Withdraw Funds
             string accNum;
-            double amount;
+            Money amount;
             cout << "Enter Account Number to Withdraw From: ";
             cin >> accNum;
             cout << "Enter Amount to Withdraw: ";
@@ -492,7 +9051,7 @@ int main() {
 
             auto account = bank.findAccount(accNum);
             if(account) {
-                processTransaction(account, 'W', amount);
+                processTransaction(*account, 'W', amount);
             }
             else {
                 cerr << "Account not found.\n";
@@ -501,7 +9060,7 @@ int main() {
         else if(choice == 4) {
             // Transfer Funds
             string fromAcc, toAcc;
-            double amount;
+            Money amount;
             cout << "Enter Source Account Number: ";
             cin >> fromAcc;
             cout << "Enter Destination Account Number: ";
@@ -524,19 +9083,7 @@ int main() {
 
             auto account = bank.findAccount(accNum);
             if(account) {
-                // Dynamic casting to access transaction history
-                if(auto sav = dynamic_cast<SavingsAccount*>(account.get())) {
-                    sav->displayHistory();
-                }
-                else if(auto chk = dynamic_cast<CheckingAccount*>(account.get())) {
-                    chk->displayHistory();
-                }
-                else if(auto loan = dynamic_cast<LoanAccount*>(account.get())) {
-                    loan->displayHistory();
-                }
-                else {
-                    cout << "No transaction history available for this account type.\n";
-                }
+                account->displayHistory();
             }
             else {
                 cerr << "Account not found.\n";
@@ -545,7 +9092,7 @@ int main() {
         else if(choice == 6) {
             // Apply Interest for Savings Accounts
             for(const auto& acc : loggedInCustomer->getAccounts()) {
-                if(auto sav = dynamic_cast<SavingsAccount*>(acc.get())) {
+                if(auto sav = accountAs<SavingsAccount>(acc)) {
                     sav->applyInterest();
                     cout << "Interest applied to Savings Account " << sav->getAccountNumber() << ".\n";
                 }
@@ -554,7 +9101,7 @@ int main() {
         else if(choice == 7) {
             // Process Loan Payment
             string accNum;
-            double amount;
+            Money amount;
             cout << "Enter Loan Account Number: ";
             cin >> accNum;
             cout << "Enter Repayment Amount: ";
@@ -564,7 +9111,7 @@ int main() {
             if(account) {
                 try {
                     account->deposit(amount);
-                    cout << "Loan repayment of $" << fixed << setprecision(2) << amount << " processed successfully.\n";
+                    cout << "Loan repayment of $" << amount << " processed successfully.\n";
                 }
                 catch(const exception& e) {
                     cerr << "Loan repayment failed: " << e.what() << "\n";
@@ -581,7 +9128,12 @@ int main() {
             cout << "Invalid choice. Please try again.\n";
         }
 
+        // Make this operation durable before showing the menu again
+        bank.commit();
+
     } while(choice != 8);
 
+    bank.checkpoint();
+    writeMetrics();
     return 0;
 }